@@ -35,7 +35,9 @@
 #include <thread.h>
 #include <current.h>
 #include <syscall.h>
+#include <copyinout.h>
 #include "opt-A2.h"
+#include "opt-A3.h"
 
 /*
  * System call dispatcher.
@@ -81,6 +83,10 @@ syscall(struct trapframe *tf)
 	int callno;
 	int32_t retval;
 	int err;
+#if OPT_A3
+	int fd;
+	off_t offset;
+#endif
 
 	KASSERT(curthread != NULL);
 	KASSERT(curthread->t_curspl == 0);
@@ -137,6 +143,43 @@ syscall(struct trapframe *tf)
       err = sys_execv((userptr_t)tf->tf_a0, (userptr_t)tf->tf_a1);
       break;
 #endif
+#if OPT_A3
+    case SYS_sbrk:
+      err = sys_sbrk((intptr_t)tf->tf_a0, (vaddr_t *)&retval);
+      break;
+    case SYS_mmap:
+      //fd and the 64-bit offset (aligned to 8) are on the user stack
+      err = copyin((const_userptr_t)(tf->tf_sp + 16), &fd, sizeof(fd));
+      if (!err) {
+        err = copyin((const_userptr_t)(tf->tf_sp + 24), &offset,
+                     sizeof(offset));
+      }
+      if (!err) {
+        err = sys_mmap((userptr_t)tf->tf_a0, (size_t)tf->tf_a1,
+                       (int)tf->tf_a2, (int)tf->tf_a3, fd, offset,
+                       (vaddr_t *)&retval);
+      }
+      break;
+    case SYS_munmap:
+      err = sys_munmap((userptr_t)tf->tf_a0, (size_t)tf->tf_a1);
+      break;
+    case SYS_mprotect:
+      err = sys_mprotect((userptr_t)tf->tf_a0, (size_t)tf->tf_a1,
+                         (int)tf->tf_a2);
+      break;
+    case SYS_madvise:
+      err = sys_madvise((userptr_t)tf->tf_a0, (size_t)tf->tf_a1,
+                        (int)tf->tf_a2);
+      break;
+    case SYS_mincore:
+      err = sys_mincore((userptr_t)tf->tf_a0, (size_t)tf->tf_a1,
+                        (userptr_t)tf->tf_a2);
+      break;
+    case SYS___vmstats:
+      err = sys___vmstats((userptr_t)tf->tf_a0, (unsigned)tf->tf_a1,
+                          (int *)&retval);
+      break;
+#endif
 #endif // UW
 
 	    /* Add stuff here */
@@ -38,6 +38,17 @@
 #include <addrspace.h>
 #include <vm.h>
 #include "opt-A3.h"
+#if OPT_A3
+#include <kern/mman.h>
+#include <uio.h>
+#include <vnode.h>
+#include <coremap.h>
+#include <swap.h>
+#include <textcache.h>
+#include <shrinker.h>
+#include <cpu.h>
+#include <uw-vmstats.h>
+#endif
 
 /*
  * Dumb MIPS-only "VM system" that is intended to only be just barely
@@ -48,15 +59,96 @@
 #define DUMBVM_STACKPAGES    12
 
 #if OPT_A3
-struct spinlock coremap_lock = SPINLOCK_INITIALIZER;
-unsigned int coremap_size = 0;
-paddr_t mem_start = 0;
-paddr_t mem_end = 0;
+/*
+ * A page table entry is 0 for a page that has never been touched,
+ * the physical address of its frame, or a swap slot number shifted
+ * up past PTE_SWAPPED. Either of the last two may have PTE_READONLY
+ * or PTE_NOACCESS (for PROT_NONE mappings) set, so that faults on a
+ * page that is already there don't have to find its region.
+ *
+ * A frame entry also carries the TLBLO_VALID and TLBLO_DIRTY bits of
+ * the TLB entry vm_fault last made for it (PTE_TLBBITS). While they
+ * are set, the UTLB refill handler in exception-mips1.S loads the
+ * entry into the TLB by itself. Whoever changes what the mapping
+ * should be clears them first; the clock does so through the coremap.
+ */
+#define PTE_SWAPPED          0x1
+#define PTE_READONLY         0x2
+#define PTE_NOACCESS         0x4
+#define PTE_PROTBITS         (PTE_READONLY | PTE_NOACCESS)
+#define PTE_TLBBITS          (TLBLO_VALID | TLBLO_DIRTY)
+#if TLBLO_VALID != CM_PTE_REFBITS
+#error "CM_PTE_REFBITS must be the valid bit of a page table entry"
+#endif
+#define PTE_ISSWAPPED(pte)   (((pte) & PTE_SWAPPED) != 0)
+#define PTE_FRAME(pte)       ((pte) & PAGE_FRAME)
+#define PTE_SLOT(pte)        ((unsigned)((pte) >> 12))
+#define PTE_MKSWAP(slot)     (((paddr_t)(slot) << 12) | PTE_SWAPPED)
 
-int* coremap_map;
+/*
+ * The page directory has a pointer for each 4M of user space to a
+ * one-page table of PT_TABLESIZE entries.
+ */
+#define PT_TABLESIZE         (PAGE_SIZE / sizeof(paddr_t))
+#define PT_DIRSIZE           (USERSPACETOP / PAGE_SIZE / PT_TABLESIZE)
+#define PT_DIRINDEX(va)      ((va) / PAGE_SIZE / PT_TABLESIZE)
+#define PT_TABLEINDEX(va)    (((va) / PAGE_SIZE) % PT_TABLESIZE)
 
-bool have_coremap = false;
+/*
+ * The page directory of the address space each cpu is running, for
+ * the UTLB refill handler, which finds its cpu's slot by the cpu
+ * number kept in c0_context.
+ */
+paddr_t **vm_utlb_pagedir[MAXCPUS];
+
+/*
+ * The stack starts out one page long and grows down when pages below
+ * it are touched, to at most VM_STACKLIMIT bytes. The heap can't grow
+ * into that space either.
+ */
+#define VM_STACKPAGES        1
+#define VM_STACKLIMIT        (2 * 1024 * 1024)
+
+/*
+ * Pages read ahead after a page fault in an MADV_SEQUENTIAL region.
+ * Neither read-ahead nor MADV_WILLNEED takes frames once fewer than
+ * VM_PREFETCH_MINFREE are free, so they never push anything out.
+ */
+#define VM_READAHEAD         8
+#define VM_PREFETCH_MINFREE  32
+
+/* Most pages the clock hand ages per eviction; one IPI batch. */
+#define VM_AGE_BATCH         (TLBSHOOTDOWN_MAX - 1)
+
+/*
+ * Each cpu hands out the ASIDs 1 to TLBHI_NPID - 1 to the address
+ * spaces that run on it, tagged with a generation number in the bits
+ * above them; 0 is never used. When a cpu runs out it flushes its TLB
+ * and starts a new generation, and address spaces whose tags are from
+ * an older one get a fresh ASID the next time they run there. Only
+ * entries of the current generation can be in a cpu's TLB. These are
+ * only touched by their own cpu, at splhigh.
+ */
+#define ASID_NUM(tag)        ((tag) & (TLBHI_NPID - 1))
+#define ASID_GEN(tag)        ((tag) & ~(uint32_t)(TLBHI_NPID - 1))
+
+static uint32_t vm_asidgen[MAXCPUS];
+static uint32_t vm_asidnext[MAXCPUS];
+
+/*
+ * A frame of zeros, mapped read-only wherever anonymous or BSS memory
+ * is read before it is written; the first write gets a frame of its
+ * own through the copy-on-write path. It is taken before the coremap
+ * exists, which then treats it as shared by everyone and never frees
+ * it.
+ */
+static paddr_t vm_zeroframe;
+
+static paddr_t vm_getuserpage(void);
+static paddr_t vm_getzeroedpage(void);
+static void vm_readahead(struct addrspace *as, vaddr_t vaddr);
 #endif
+
 /*
  * Wrap rma_stealmem in a spinlock.
  */
@@ -66,83 +158,776 @@ void
 vm_bootstrap(void)
 {
 #if OPT_A3
-    spinlock_init(&coremap_lock);
-    ram_getsize(&mem_start, &mem_end);
-    coremap_size = (mem_end - mem_start) / PAGE_SIZE;
-    coremap_size -= 1; //I want some space between coremap and other stack allocated memory
-    coremap_map = (int*)PADDR_TO_KVADDR(mem_start);
-    for(unsigned int i = 0; i < coremap_size; i++){
-        coremap_map[i] = 0;
-    }
-    have_coremap = true;
+    //generation 0 is never current, so new address spaces have no ASID
+    for(unsigned i = 0; i < MAXCPUS; i++){
+        vm_asidgen[i] = TLBHI_NPID;
+        vm_asidnext[i] = 1;
+    }
+    spinlock_acquire(&stealmem_lock);
+    vm_zeroframe = ram_stealmem(1);
+    spinlock_release(&stealmem_lock);
+    if(vm_zeroframe == 0){
+        panic("vm_bootstrap: no memory for the zero page\n");
+    }
+    bzero((void *)PADDR_TO_KVADDR(vm_zeroframe), PAGE_SIZE);
+    coremap_bootstrap();
+    kmalloc_bootstrap();
+    textcache_bootstrap();
+    vmstats_init();
+    swap_bootstrap();
+    shrinker_bootstrap();
 #endif
 	/* Do nothing. */
 }
 
+#if OPT_A3
+bool
+vm_idle(void)
+{
+    if(coremap_prezero()){
+        vmstats_inc(VMSTAT_PAGE_ZEROED);
+        return true;
+    }
+    return false;
+}
+#endif
+
 static
 paddr_t
 getppages(unsigned long npages)
 {
+	paddr_t addr;
+
 #if OPT_A3
-    if(have_coremap){
-        //kprintf("o");
-        spinlock_acquire(&coremap_lock);
-        for(unsigned int i = 0; i < coremap_size; i++){
-            if(coremap_map[i] == 0){
-                if(npages == 1){
-                    //kprintf("a");
-                    coremap_map[i] = 1;
-                    spinlock_release(&coremap_lock);
-                    return (i + 1) * PAGE_SIZE + mem_start;
-                }
-                for(unsigned int j = (i + 1); j < coremap_size; j++){
-                    if(coremap_map[j] != 0){
-                        break;
-                    }
-                    if((j - i + 1) == npages){
-                        //kprintf("c");
-                        unsigned int t = i;
-                        for(unsigned long k = 1; k <= npages; k++){
-                            coremap_map[t] = k;
-                            t++;
-                        }
-                        spinlock_release(&coremap_lock);
-                        return (i + 1) * PAGE_SIZE + mem_start;
-                    }
+    if(coremap_ready()){
+        addr = coremap_alloc(npages);
+        if(coremap_freecount() < SHRINK_LOWWATER){
+            shrinker_kick();
+        }
+        return addr;
+    }
+#endif
+	spinlock_acquire(&stealmem_lock);
+
+	addr = ram_stealmem(npages);
+	
+	spinlock_release(&stealmem_lock);
+	return addr;
+}
+
+static
+void
+as_zero_region(paddr_t paddr, unsigned npages)
+{
+	bzero((void *)PADDR_TO_KVADDR(paddr), npages * PAGE_SIZE);
+}
+
+#if OPT_A3
+/*
+ * Flush this cpu's whole TLB. Call at splhigh.
+ */
+static
+void
+vm_tlb_flush(void)
+{
+    int i;
+
+    for(i = 0; i < NUM_TLB; i++){
+        tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+    }
+    vmstats_inc(VMSTAT_TLB_INVALIDATE);
+}
+
+/*
+ * Make AS the address space this cpu matches TLB entries against,
+ * giving it an ASID here first if its tag is from an old generation.
+ */
+static
+void
+vm_asid_activate(struct addrspace *as)
+{
+    unsigned cpu;
+    int spl;
+
+    spl = splhigh();
+    cpu = curcpu->c_number;
+    if(ASID_GEN(as->as_asid[cpu]) != vm_asidgen[cpu]){
+        if(vm_asidnext[cpu] == TLBHI_NPID){
+            //out of ASIDs: nothing from the last generation may match
+            vm_tlb_flush();
+            vm_asidgen[cpu] += TLBHI_NPID;
+            if(vm_asidgen[cpu] == 0){
+                vm_asidgen[cpu] = TLBHI_NPID;
+            }
+            vm_asidnext[cpu] = 1;
+        }
+        as->as_asid[cpu] = vm_asidgen[cpu] | vm_asidnext[cpu]++;
+    }
+    tlb_setasid(ASID_NUM(as->as_asid[cpu]));
+    vm_utlb_pagedir[cpu] = as->as_pagedir;
+    splx(spl);
+}
+
+/*
+ * The cpus other than this one that may still have TLB entries for
+ * AS: those where it has an ASID of the current generation, that is,
+ * that have run it since they last flushed. A cpu that is rolling
+ * over flushes before it bumps the generation, so this never misses
+ * one that still needs to be told.
+ */
+static
+uint32_t
+as_tlb_cpus(struct addrspace *as)
+{
+    uint32_t mask = 0;
+
+    for(unsigned i = 0; i < MAXCPUS; i++){
+        if(as->as_asid[i] != 0 &&
+           ASID_GEN(as->as_asid[i]) == vm_asidgen[i]){
+            mask |= (uint32_t)1 << i;
+        }
+    }
+    return mask & ~((uint32_t)1 << curcpu->c_number);
+}
+
+/*
+ * Drop all the TLB entries of AS, the current address space, on the
+ * other cpus that may have some (as_tlb_cpus), by taking its ASIDs
+ * there away; the entries tagged with them can't be matched any more,
+ * and the ASIDs aren't handed out again before the next flush. Cpus
+ * AS hasn't run on since they last flushed keep their stale tags,
+ * which already won't match, and if AS has only run here there is
+ * nothing to do at all.
+ */
+static
+void
+as_flush_remote_tlbs(struct addrspace *as)
+{
+    uint32_t cpus;
+    int spl;
+
+    spl = splhigh();
+    cpus = as_tlb_cpus(as);
+    for(unsigned i = 0; cpus != 0 && i < MAXCPUS; i++){
+        if(cpus & ((uint32_t)1 << i)){
+            as->as_asid[i] = 0;
+        }
+    }
+    splx(spl);
+}
+
+/*
+ * Same, on every cpu including this one.
+ */
+static
+void
+as_flush_tlb(struct addrspace *as)
+{
+    int spl;
+
+    spl = splhigh();
+    as_flush_remote_tlbs(as);
+    as->as_asid[curcpu->c_number] = 0;
+    vm_asid_activate(as);
+    splx(spl);
+}
+
+/*
+ * Read the page table entry PTE, which maps VADDR in AS, and pin the
+ * frame it names so that it can't be evicted from under us. Returns
+ * the entry; only if it is a frame is anything pinned.
+ */
+static
+paddr_t
+as_pin_pte(struct addrspace *as, vaddr_t vaddr, paddr_t *pte)
+{
+    paddr_t entry;
+
+    while(1){
+        entry = *pte;
+        if(entry == 0 || PTE_ISSWAPPED(entry)){
+            return entry;
+        }
+        if(coremap_pin(PTE_FRAME(entry), as, vaddr)){
+            if(*pte == entry){
+                return entry;
+            }
+            coremap_unpin(PTE_FRAME(entry));
+        }
+        //it was evicted while we waited; look again
+    }
+}
+
+/*
+ * Find the page table entry for VADDR in AS. If its second-level
+ * table doesn't exist yet, make it if CREATE is set and otherwise
+ * return NULL; NULL also means out of memory when CREATE is set.
+ */
+static
+paddr_t *
+as_lookup_pte(struct addrspace *as, vaddr_t vaddr, bool create)
+{
+    paddr_t *pt, pa;
+
+    KASSERT(vaddr < USERSPACETOP);
+    pt = as->as_pagedir[PT_DIRINDEX(vaddr)];
+    if(pt == NULL){
+        if(!create){
+            return NULL;
+        }
+        //page tables may push user pages out to make room
+        pa = vm_getzeroedpage();
+        if(pa == 0){
+            return NULL;
+        }
+        pt = (paddr_t *)PADDR_TO_KVADDR(pa);
+        as->as_pagedir[PT_DIRINDEX(vaddr)] = pt;
+    }
+    return &pt[PT_TABLEINDEX(vaddr)];
+}
+
+/*
+ * Keep the UTLB refill handler from loading any page of AS in the
+ * NPAGES from BASE again until vm_fault has looked at it. Entries
+ * already in the TLB are the caller's to flush.
+ */
+static
+void
+as_revoke_refills(struct addrspace *as, vaddr_t base, size_t npages)
+{
+    paddr_t *pte, entry;
+    vaddr_t va;
+
+    for(size_t n = 0; n < npages; n++){
+        va = base + n * PAGE_SIZE;
+        pte = as_lookup_pte(as, va, false);
+        if(pte == NULL){
+            continue;
+        }
+        entry = as_pin_pte(as, va, pte);
+        if(entry == 0 || PTE_ISSWAPPED(entry)){
+            continue;
+        }
+        *pte &= ~PTE_TLBBITS;
+        coremap_unpin(PTE_FRAME(entry));
+    }
+}
+
+/*
+ * Free every frame and swap slot in the page table of AS. The tables
+ * themselves are left alone.
+ */
+static
+void
+as_release_pagetable(struct addrspace *as)
+{
+    paddr_t *pt, entry;
+    vaddr_t base;
+    int slot;
+
+    for(unsigned d = 0; d < PT_DIRSIZE; d++){
+        pt = as->as_pagedir[d];
+        if(pt == NULL){
+            continue;
+        }
+        base = d * PT_TABLESIZE * PAGE_SIZE;
+        for(unsigned i = 0; i < PT_TABLESIZE; i++){
+            entry = as_pin_pte(as, base + i * PAGE_SIZE, &pt[i]);
+            if(entry == 0){
+                continue;
+            }
+            if(PTE_ISSWAPPED(entry)){
+                swap_free(PTE_SLOT(entry));
+                continue;
+            }
+            entry = PTE_FRAME(entry);
+            slot = coremap_swapslot(entry);
+            if(slot >= 0){
+                swap_free(slot);
+            }
+            coremap_setowner(entry, NULL, 0, NULL);
+            free_kpages(PADDR_TO_KVADDR(entry));
+        }
+    }
+}
+
+/*
+ * Share every page the parent OLD has touched with the child NEW;
+ * vm_fault copies a page when either side first writes to it. Pages
+ * nobody has touched stay demand-zero (or demand-loaded) in both.
+ * Pages out on swap get a slot of their own.
+ */
+static
+int
+as_copy_pagetable(struct addrspace *old, struct addrspace *new)
+{
+    paddr_t *from, *to, entry;
+    vaddr_t base;
+    unsigned slot;
+    int oldslot, result;
+
+    for(unsigned d = 0; d < PT_DIRSIZE; d++){
+        from = old->as_pagedir[d];
+        if(from == NULL){
+            continue;
+        }
+        base = d * PT_TABLESIZE * PAGE_SIZE;
+        to = as_lookup_pte(new, base, true);
+        if(to == NULL){
+            return ENOMEM;
+        }
+        for(unsigned i = 0; i < PT_TABLESIZE; i++){
+            entry = as_pin_pte(old, base + i * PAGE_SIZE, &from[i]);
+            if(entry == 0){
+                continue;
+            }
+            if(PTE_ISSWAPPED(entry)){
+                result = swap_dup(PTE_SLOT(entry), &slot);
+                if(result){
+                    return result;
                 }
+                to[i] = PTE_MKSWAP(slot) | (entry & PTE_PROTBITS);
+                continue;
             }
+            //a swap copy can only belong to one of the sharers
+            oldslot = coremap_swapslot(PTE_FRAME(entry));
+            if(oldslot >= 0){
+                coremap_markdirty(PTE_FRAME(entry));
+                swap_free(oldslot);
+            }
+            coremap_incref(PTE_FRAME(entry));
+            //shared frames have no single owner and are never evicted
+            coremap_setowner(PTE_FRAME(entry), NULL, 0, NULL);
+            //and must not be refilled writable for either side
+            entry &= ~PTE_TLBBITS;
+            from[i] = entry;
+            to[i] = entry;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Throw away the pages from BASE to BASE + NPAGES * PAGE_SIZE of AS,
+ * the current address space: take them out of the TLBs and free their
+ * frames and swap slots, so the next touch of any of them faults in a
+ * fresh page.
+ */
+static
+void
+as_discard_range(struct addrspace *as, vaddr_t base, size_t npages)
+{
+    paddr_t *pte, entry;
+    vaddr_t va;
+    int slot;
+
+    as_revoke_refills(as, base, npages);
+    as_flush_tlb(as);
+    for(size_t n = 0; n < npages; n++){
+        va = base + n * PAGE_SIZE;
+        pte = as_lookup_pte(as, va, false);
+        if(pte == NULL){
+            continue;
+        }
+        entry = as_pin_pte(as, va, pte);
+        if(entry == 0){
+            continue;
+        }
+        *pte = 0;
+        if(PTE_ISSWAPPED(entry)){
+            swap_free(PTE_SLOT(entry));
+            continue;
+        }
+        entry = PTE_FRAME(entry);
+        slot = coremap_swapslot(entry);
+        if(slot >= 0){
+            swap_free(slot);
+        }
+        coremap_setowner(entry, NULL, 0, NULL);
+        free_kpages(PADDR_TO_KVADDR(entry));
+    }
+}
+
+/*
+ * Find the first region of AS that contains VADDR, or NULL.
+ */
+static
+struct vm_region *
+as_find_region(struct addrspace *as, vaddr_t vaddr)
+{
+    struct vm_region *r;
+
+    for(r = as->as_regions; r != NULL && r->vr_base <= vaddr; r = r->vr_next){
+        if(vaddr < r->vr_base + r->vr_npages * PAGE_SIZE){
+            return r;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * If VADDR is below the stack of AS but within VM_STACKLIMIT of its
+ * top, and no other region is in the way, extend the stack down to
+ * VADDR and return it. Otherwise return NULL.
+ */
+static
+struct vm_region *
+as_grow_stack(struct addrspace *as, vaddr_t vaddr)
+{
+    struct vm_region *stack = as->as_stack, *r;
+
+    if(stack == NULL || vaddr >= stack->vr_base ||
+       vaddr < USERSTACK - VM_STACKLIMIT){
+        return NULL;
+    }
+    for(r = as->as_regions; r != stack; r = r->vr_next){
+        if(r->vr_base + r->vr_npages * PAGE_SIZE > vaddr ||
+           r->vr_base > vaddr){
+            return NULL;
         }
-        spinlock_release(&coremap_lock);
+    }
+    //nothing lies in between, so the list stays sorted
+    stack->vr_npages += (stack->vr_base - vaddr) / PAGE_SIZE;
+    stack->vr_base = vaddr;
+    return stack;
+}
+
+/*
+ * Add a region to AS, keeping the list sorted by base.
+ */
+static
+struct vm_region *
+as_insert_region(struct addrspace *as, vaddr_t base, size_t npages,
+                 bool writeable)
+{
+    struct vm_region *r, **prev;
+
+    r = kmalloc(sizeof(struct vm_region));
+    if(r == NULL){
+        return NULL;
+    }
+    r->vr_base = base;
+    r->vr_npages = npages;
+    r->vr_writeable = writeable;
+    r->vr_filevaddr = 0;
+    r->vr_fileoffset = 0;
+    r->vr_filesize = 0;
+    r->vr_mmapped = false;
+    r->vr_noaccess = false;
+    r->vr_advice = MADV_NORMAL;
+
+    prev = &as->as_regions;
+    while(*prev != NULL && (*prev)->vr_base <= base){
+        prev = &(*prev)->vr_next;
+    }
+    r->vr_next = *prev;
+    *prev = r;
+    return r;
+}
+
+/*
+ * If the page at VADDR in AS can be shared through the text cache,
+ * that is, only REGION covers it, REGION is read-only and all of the
+ * page comes from the executable, return true and the page's offset
+ * in the file in OFFSET. Nothing is shared while the executable is
+ * still being loaded, since pages are writable then.
+ */
+static
+bool
+as_text_offset(struct addrspace *as, struct vm_region *region,
+               vaddr_t vaddr, off_t *offset)
+{
+    if(!as->load_complete || as->as_vnode == NULL || region->vr_writeable){
+        return false;
+    }
+    //a data segment may start in the same page
+    if(region->vr_next != NULL && region->vr_next->vr_base <= vaddr){
+        return false;
+    }
+    if(vaddr < region->vr_filevaddr ||
+       vaddr + PAGE_SIZE > region->vr_filevaddr + region->vr_filesize){
+        return false;
+    }
+    *offset = region->vr_fileoffset + (vaddr - region->vr_filevaddr);
+    return *offset % PAGE_SIZE == 0;
+}
+
+/*
+ * True if any of the page at VADDR in AS comes from the part of the
+ * executable REGION maps; otherwise REGION only zero-fills it.
+ */
+static
+bool
+as_page_in_file(struct addrspace *as, struct vm_region *region, vaddr_t vaddr)
+{
+    return as->as_vnode != NULL && region->vr_filesize != 0 &&
+           vaddr < region->vr_filevaddr + region->vr_filesize &&
+           vaddr + PAGE_SIZE > region->vr_filevaddr;
+}
+
+/*
+ * Fill the frame at PADDR, which backs the user page at PAGEVA, with
+ * whatever part of the file segment (FILEVADDR, OFFSET, FILESIZE)
+ * falls inside that page. The frame must already be zeroed.
+ */
+static
+int
+as_read_page(struct vnode *v, paddr_t paddr, vaddr_t pageva,
+             vaddr_t filevaddr, off_t offset, size_t filesize)
+{
+    struct iovec iov;
+    struct uio u;
+    vaddr_t start, end;
+    int result;
+
+    start = pageva > filevaddr ? pageva : filevaddr;
+    end = pageva + PAGE_SIZE;
+    if(end > filevaddr + filesize){
+        end = filevaddr + filesize;
+    }
+    KASSERT(start < end);
+
+    uio_kinit(&iov, &u, (void *)(PADDR_TO_KVADDR(paddr) + (start - pageva)),
+              end - start, offset + (start - filevaddr), UIO_READ);
+    result = VOP_READ(v, &u);
+    if(result){
+        return result;
+    }
+    if(u.uio_resid != 0){
+        kprintf("ELF: short read on page 0x%x - file truncated?\n", pageva);
+        return ENOEXEC;
+    }
+    return 0;
+}
+
+/*
+ * Push some user page out of memory and hand its frame back, still
+ * allocated but no longer owned. A clean page is just dropped: its
+ * page table entry goes back to its swap slot, or to 0 if it can be
+ * read from the executable or zero-filled again. A dirty page is
+ * written to swap first. Returns 0 if nothing could be evicted.
+ */
+static
+paddr_t
+vm_evict(void)
+{
+    struct addrspace *vas;
+    struct tlbshootdown ts[VM_AGE_BATCH + 1];
+    struct coremap_aged aged[VM_AGE_BATCH];
+    vaddr_t vva;
+    paddr_t victim, newpte, *pte;
+    uint32_t cpus;
+    unsigned naged, i, slot;
+    int oldslot, result;
+
+    victim = coremap_pick_victim(&vas, &vva, aged, VM_AGE_BATCH, &naged);
+    if(victim != 0){
+        //the refill handler must not map it again from here on
+        pte = as_lookup_pte(vas, vva, false);
+        KASSERT(pte != NULL && PTE_FRAME(*pte) == victim);
+        *pte &= ~PTE_TLBBITS;
+    }
+
+    //pages given a second chance must fault again to count as used
+    cpus = 0;
+    for(i = 0; i < naged; i++){
+        ts[i].ts_addrspace = aged[i].ca_as;
+        ts[i].ts_vaddr = aged[i].ca_vaddr;
+        cpus |= as_tlb_cpus(aged[i].ca_as);
+        vmstats_inc(VMSTAT_CLOCK_SECOND_CHANCE);
+    }
+    //the victim is pinned, so nobody maps it again; remove the mappings
+    if(victim != 0){
+        ts[naged].ts_addrspace = vas;
+        ts[naged].ts_vaddr = vva;
+        cpus |= as_tlb_cpus(vas);
+    }
+    //only cpus that have run one of the owners can have anything to drop
+    if(naged > 0 || victim != 0){
+        ipi_tlbshootdown_cpus(ts, naged + (victim != 0), cpus);
+    }
+    //the owners can go away once we let go of the aged pages
+    for(i = 0; i < naged; i++){
+        coremap_unpin(aged[i].ca_paddr);
+    }
+    if(victim == 0){
         return 0;
-    }else{
-        paddr_t addr;
+    }
 
-        spinlock_acquire(&stealmem_lock);
+    if(coremap_isdirty(victim)){
+        result = swap_out(victim, &slot);
+        if(result){
+            coremap_unpin(victim);
+            return 0;
+        }
+        newpte = PTE_MKSWAP(slot);
+        vmstats_inc(VMSTAT_EVICT_DIRTY);
+    }
+    else{
+        oldslot = coremap_swapslot(victim);
+        newpte = oldslot >= 0 ? PTE_MKSWAP(oldslot) : 0;
+        vmstats_inc(VMSTAT_EVICT_CLEAN);
+    }
 
-        addr = ram_stealmem(npages);
+    if(newpte != 0){
+        newpte |= *pte & PTE_PROTBITS;
+    }
+    *pte = newpte;
+    //this also lets anyone waiting for the frame look at the entry again
+    coremap_setowner(victim, NULL, 0, NULL);
+    return victim;
+}
 
-        spinlock_release(&stealmem_lock);
+/*
+ * Get a frame for a user page, pushing another page out to swap if
+ * memory is full.
+ */
+static
+paddr_t
+vm_getuserpage(void)
+{
+    paddr_t paddr;
 
-        return addr;
+    paddr = getppages(1);
+    if(paddr == 0){
+        //cached text nobody maps is cheaper to give up than a user page
+        paddr = textcache_reclaim();
     }
-#else
-	paddr_t addr;
+    if(paddr == 0){
+        paddr = vm_evict();
+        if(paddr == 0){
+            return 0;
+        }
+    }
+    coremap_resetstate(paddr);
+    vmstats_inc(VMSTAT_PAGE_ALLOC);
+    return paddr;
+}
 
-	spinlock_acquire(&stealmem_lock);
+/*
+ * Same, but zeroed: from the pool the idle loop fills if it can, or
+ * else zeroed here.
+ */
+static
+paddr_t
+vm_getzeroedpage(void)
+{
+    paddr_t paddr;
 
-	addr = ram_stealmem(npages);
-	
-	spinlock_release(&stealmem_lock);
-	return addr;
-#endif
+    paddr = coremap_alloc_zeroed();
+    if(paddr != 0){
+        vmstats_inc(VMSTAT_ZERO_POOL_HIT);
+        vmstats_inc(VMSTAT_PAGE_ALLOC);
+        coremap_resetstate(paddr);
+        return paddr;
+    }
+    vmstats_inc(VMSTAT_ZERO_POOL_MISS);
+    paddr = vm_getuserpage();
+    if(paddr != 0){
+        as_zero_region(paddr, 1);
+        vmstats_inc(VMSTAT_PAGE_ZEROED);
+    }
+    return paddr;
 }
 
+/*
+ * Get the frame for the read-only executable page at VADDR in AS,
+ * which as_text_offset says is at OFFSET in the file, from the text
+ * cache or else by reading it there. If the frame is shared (it
+ * normally is, with the cache) it comes back pinned. PREFETCH says
+ * whether a read counts as a page fault or as read-ahead.
+ */
+static
+int
+vm_gettextpage(struct addrspace *as, struct vm_region *region,
+               vaddr_t vaddr, off_t offset, bool prefetch, paddr_t *ret)
+{
+    paddr_t paddr;
+    int result;
+
+    paddr = textcache_get(as->as_vnode, offset);
+    if(paddr == 0){
+        paddr = vm_getuserpage();
+        if(paddr == 0){
+            return ENOMEM;
+        }
+        result = as_read_page(as->as_vnode, paddr, vaddr,
+                              region->vr_filevaddr, region->vr_fileoffset,
+                              region->vr_filesize);
+        if(result){
+            free_kpages(PADDR_TO_KVADDR(paddr));
+            return result;
+        }
+        vmstats_inc(prefetch ? VMSTAT_PAGE_READAHEAD : VMSTAT_PAGE_FAULT_DISK);
+        vmstats_inc(VMSTAT_ELF_FILE_READ);
+        paddr = textcache_put(as->as_vnode, offset, paddr);
+    }
+    if(coremap_refcount(paddr) > 1){
+        //shared frames have no owner, so this can't fail
+        if(!coremap_pin(paddr, as, vaddr)){
+            panic("vm_gettextpage: can't pin shared frame 0x%x\n", paddr);
+        }
+    }
+    *ret = paddr;
+    return 0;
+}
+
+/*
+ * Enter VADDR -> ELO for AS, the current address space, in this cpu's
+ * TLB, replacing an existing entry for VADDR, else taking a free slot,
+ * else a random one.
+ */
+static
+void
+vm_tlb_load(struct addrspace *as, vaddr_t vaddr, uint32_t elo)
+{
+    uint32_t ehi, oldehi, oldelo;
+    int i, spl;
+
+    /* Disable interrupts on this CPU while frobbing the TLB. */
+    spl = splhigh();
+
+    //as_activate has given the address space an ASID on this cpu
+    ehi = vaddr |
+        (ASID_NUM(as->as_asid[curcpu->c_number]) << TLBHI_PIDSHIFT);
+
+    //a read-only fault replaces the entry that is already there
+    i = tlb_probe(ehi, 0);
+    if(i >= 0){
+        tlb_write(ehi, elo, i);
+        splx(spl);
+        return;
+    }
+    for(i = 0; i < NUM_TLB; i++){
+        tlb_read(&oldehi, &oldelo, i);
+        if(oldelo & TLBLO_VALID){
+            continue;
+        }
+        DEBUG(DB_VM, "dumbvm: 0x%x -> 0x%x\n", vaddr, elo & TLBLO_PPAGE);
+        tlb_write(ehi, elo, i);
+        vmstats_inc(VMSTAT_TLB_FAULT_FREE);
+        splx(spl);
+        return;
+    }
+    vmstats_inc(VMSTAT_TLB_FAULT_REPLACE);
+    DEBUG(DB_VM, "dumbvm: 0x%x -> 0x%x\n", vaddr, elo & TLBLO_PPAGE);
+    tlb_random(ehi, elo);
+    splx(spl);
+}
+#endif
+
 /* Allocate/free some kernel-space virtual pages */
 vaddr_t 
 alloc_kpages(int npages)
 {
 	paddr_t pa;
 	pa = getppages(npages);
+#if OPT_A3
+    //give the shrinkers a chance before failing
+    if(pa == 0 && coremap_ready() && shrink_memory(npages) > 0){
+        pa = getppages(npages);
+    }
+#endif
 	if (pa==0) {
 		return 0;
 	}
@@ -152,23 +937,10 @@ alloc_kpages(int npages)
 void 
 free_kpages(vaddr_t addr)
 {
-	/* nothing - leak the memory. */
 #if OPT_A3
-    //kprintf("b");
-    spinlock_acquire(&coremap_lock);
-    paddr_t paddr = KVADDR_TO_PADDR(addr);
-    unsigned int index = (paddr - mem_start) / PAGE_SIZE - 1;
-    //kprintf("%d", coremap_map[index]);
-    coremap_map[index] = 0;
-    index += 1;
-    //kprintf("%d", coremap_map[index]);
-    while((index < coremap_size) && (coremap_map[index] != 0) && (coremap_map[index] != 1)){
-        //kprintf("d");
-        coremap_map[index] = 0;
-        index += 1;
-    }
-    spinlock_release(&coremap_lock);
+    coremap_free(KVADDR_TO_PADDR(addr));
 #else
+	/* nothing - leak the memory. */
 	(void)addr;
 #endif
 }
@@ -176,36 +948,336 @@ free_kpages(vaddr_t addr)
 void
 vm_tlbshootdown_all(void)
 {
+#if OPT_A3
+    int spl;
+
+    spl = splhigh();
+    vm_tlb_flush();
+    splx(spl);
+#else
 	panic("dumbvm tried to do tlb shootdown?!\n");
+#endif
 }
 
 void
 vm_tlbshootdown(const struct tlbshootdown *ts)
 {
+#if OPT_A3
+    uint32_t tag;
+    int i, spl;
+
+    KASSERT(ts->ts_addrspace != NULL);
+
+    spl = splhigh();
+    //entries tagged with an old generation were flushed already
+    tag = ts->ts_addrspace->as_asid[curcpu->c_number];
+    if(ASID_GEN(tag) == vm_asidgen[curcpu->c_number]){
+        i = tlb_probe(ts->ts_vaddr | (ASID_NUM(tag) << TLBHI_PIDSHIFT), 0);
+        if(i >= 0){
+            tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+        }
+    }
+    splx(spl);
+#else
 	(void)ts;
 	panic("dumbvm tried to do tlb shootdown?!\n");
+#endif
 }
 
+#if OPT_A3
+/*
+ * Make the page at FAULTADDRESS in AS, the current address space,
+ * present for an access of type FAULTTYPE and load it into the TLB.
+ * With PREFETCH set, only bring it in from the executable or swap if
+ * it isn't present yet, for madvise and read-ahead: nothing is loaded
+ * into the TLB and pages that would just be zero-filled are left
+ * alone.
+ */
+static
+int
+vm_pagefault(struct addrspace *as, int faulttype, vaddr_t faultaddress,
+             bool prefetch)
+{
+    struct vm_region *region, *r;
+    bool writable, fresh, fromfile, paged;
+    paddr_t paddr, *pte, entry, copy;
+    uint32_t elo;
+    off_t offset;
+    int slot;
+    int result;
+
+    if(faultaddress >= USERSPACETOP){
+        return EFAULT;
+    }
+    if(faulttype != VM_FAULT_READONLY && !prefetch){
+        vmstats_inc(VMSTAT_TLB_FAULT);
+    }
+
+    //frames we hand out here get an owner only once they are mapped
+    fresh = true;
+    paged = false;
+    pte = as_lookup_pte(as, faultaddress, false);
+    entry = pte == NULL ? 0 : as_pin_pte(as, faultaddress, pte);
+    if(entry & PTE_NOACCESS){
+        if(!PTE_ISSWAPPED(entry)){
+            coremap_unpin(PTE_FRAME(entry));
+        }
+        return EFAULT;
+    }
+    if(entry == 0){
+        //first touch of this page (or it was dropped while clean)
+        region = as_find_region(as, faultaddress);
+        if(region == NULL && !prefetch){
+            region = as_grow_stack(as, faultaddress);
+        }
+        if(region == NULL || region->vr_noaccess){
+            return EFAULT;
+        }
+        if(pte == NULL){
+            pte = as_lookup_pte(as, faultaddress, true);
+            if(pte == NULL){
+                return ENOMEM;
+            }
+        }
+        if(as_text_offset(as, region, faultaddress, &offset)){
+            //the same in every process running this executable
+            result = vm_gettextpage(as, region, faultaddress, offset,
+                                    prefetch, &paddr);
+            if(result){
+                return result;
+            }
+            fresh = coremap_refcount(paddr) == 1;
+            paged = true;
+            writable = false;
+            *pte = paddr | PTE_READONLY;
+        }
+        else{
+            //the page may be covered by more than one region
+            writable = !as->load_complete;
+            fromfile = false;
+            for(r = region; r != NULL && r->vr_base <= faultaddress;
+                r = r->vr_next){
+                if(faultaddress < r->vr_base + r->vr_npages * PAGE_SIZE){
+                    writable = writable || r->vr_writeable;
+                    fromfile = fromfile || as_page_in_file(as, r, faultaddress);
+                }
+            }
+            if(!fromfile && prefetch){
+                //zero-fill pages cost nothing to make when touched
+                return 0;
+            }
+            if(!fromfile && faulttype == VM_FAULT_READ){
+                //reads the same as every other page nobody has written
+                paddr = vm_zeroframe;
+                fresh = false;
+                vmstats_inc(VMSTAT_ZERO_PAGE_MAP);
+            }
+            else{
+                paddr = vm_getzeroedpage();
+                if(paddr == 0){
+                    return ENOMEM;
+                }
+            }
+
+            //read in whatever parts of it come from the executable
+            for(r = region; fromfile && r != NULL &&
+                r->vr_base <= faultaddress; r = r->vr_next){
+                if(faultaddress >= r->vr_base + r->vr_npages * PAGE_SIZE ||
+                   !as_page_in_file(as, r, faultaddress)){
+                    continue;
+                }
+                result = as_read_page(as->as_vnode, paddr, faultaddress,
+                                      r->vr_filevaddr, r->vr_fileoffset,
+                                      r->vr_filesize);
+                if(result){
+                    free_kpages(PADDR_TO_KVADDR(paddr));
+                    return result;
+                }
+            }
+            if(fromfile){
+                vmstats_inc(prefetch ? VMSTAT_PAGE_READAHEAD :
+                                       VMSTAT_PAGE_FAULT_DISK);
+                vmstats_inc(VMSTAT_ELF_FILE_READ);
+                paged = true;
+            }
+            else{
+                vmstats_inc(VMSTAT_PAGE_FAULT_ZERO);
+            }
+            *pte = paddr | (writable ? 0 : PTE_READONLY);
+        }
+    }
+    else if(PTE_ISSWAPPED(entry)){
+        paddr = vm_getuserpage();
+        if(paddr == 0){
+            return ENOMEM;
+        }
+        result = swap_in(PTE_SLOT(entry), paddr);
+        if(result){
+            free_kpages(PADDR_TO_KVADDR(paddr));
+            return result;
+        }
+        //clean until written, so the slot is kept
+        coremap_setswapslot(paddr, PTE_SLOT(entry));
+        vmstats_inc(prefetch ? VMSTAT_PAGE_READAHEAD : VMSTAT_PAGE_FAULT_DISK);
+        paged = true;
+        writable = (entry & PTE_READONLY) == 0;
+        *pte = paddr | (entry & PTE_PROTBITS);
+    }
+    else{
+        //pinned by as_pin_pte until the TLB entry is in
+        paddr = PTE_FRAME(entry);
+        if(prefetch){
+            coremap_unpin(paddr);
+            return 0;
+        }
+        fresh = false;
+        writable = (entry & PTE_READONLY) == 0;
+        if(faulttype != VM_FAULT_READONLY){
+            vmstats_inc(VMSTAT_TLB_RELOAD);
+        }
+    }
+
+    if(faulttype == VM_FAULT_READONLY){
+        if(!writable){
+            if(!fresh){
+                coremap_unpin(paddr);
+            }
+            return EFAULT;
+        }
+        if(coremap_refcount(paddr) > 1){
+            //still shared since fork: give this address space its own copy
+            KASSERT(!fresh);
+            if(paddr == vm_zeroframe){
+                //a copy of zeros can come from the prezeroed pool
+                copy = vm_getzeroedpage();
+            }
+            else{
+                copy = vm_getuserpage();
+                if(copy != 0){
+                    memmove((void *)PADDR_TO_KVADDR(copy),
+                            (const void *)PADDR_TO_KVADDR(paddr),
+                            PAGE_SIZE);
+                }
+            }
+            if(copy == 0){
+                coremap_unpin(paddr);
+                return ENOMEM;
+            }
+            if(paddr == vm_zeroframe){
+                vmstats_inc(VMSTAT_ZERO_PAGE_COPY);
+            }
+            else{
+                vmstats_inc(VMSTAT_COW_COPY);
+            }
+            *pte = copy;
+            //cpus this address space ran on may still map the shared frame
+            as_flush_remote_tlbs(as);
+            coremap_unpin(paddr);
+            free_kpages(PADDR_TO_KVADDR(paddr));
+            paddr = copy;
+            fresh = true;
+        }
+    }
+    else if(coremap_refcount(paddr) > 1){
+        //shared pages are mapped read-only until someone writes
+        writable = false;
+    }
+    if(!fresh && coremap_refcount(paddr) == 1){
+        //the last of the sharers owns the page again
+        coremap_setowner(paddr, as, faultaddress, pte);
+    }
+
+    /*
+     * Clean pages are mapped read-only so the first write shows up
+     * here as VM_FAULT_READONLY and the page can be marked dirty.
+     */
+    if(writable && faulttype != VM_FAULT_READ && !coremap_isdirty(paddr)){
+        //its backing copy is about to be stale
+        slot = coremap_markdirty(paddr);
+        if(slot >= 0){
+            swap_free(slot);
+        }
+    }
+    writable = writable && coremap_isdirty(paddr);
+
+    /* make sure it's page-aligned */
+    KASSERT((paddr & PAGE_FRAME) == paddr);
+
+    //a prefetched page is left for the first use to load
+    if(!prefetch){
+        elo = paddr | TLBLO_VALID;
+        if(writable){
+            elo |= TLBLO_DIRTY;
+        }
+        vm_tlb_load(as, faultaddress, elo);
+        coremap_referenced(paddr);
+        //until something changes, the refill handler can do this itself
+        *pte = (*pte & ~PTE_TLBBITS) | (elo & PTE_TLBBITS);
+    }
+
+    //only now may the evictor take the page
+    if(fresh){
+        coremap_setowner(paddr, as, faultaddress, pte);
+    }
+    else{
+        coremap_unpin(paddr);
+    }
+
+    if(paged && !prefetch){
+        vm_readahead(as, faultaddress);
+    }
+    return 0;
+}
+
+/*
+ * Read ahead the pages after VADDR, which was just paged in, if the
+ * region it is in was marked MADV_SEQUENTIAL. Stops short of taking
+ * frames that would have to be evicted.
+ */
+static
+void
+vm_readahead(struct addrspace *as, vaddr_t vaddr)
+{
+    struct vm_region *region;
+    vaddr_t top;
+
+    region = as_find_region(as, vaddr);
+    if(region == NULL || region->vr_advice != MADV_SEQUENTIAL){
+        return;
+    }
+    top = region->vr_base + region->vr_npages * PAGE_SIZE;
+    for(unsigned n = 1; n <= VM_READAHEAD && vaddr + n * PAGE_SIZE < top; n++){
+        if(coremap_freecount() < VM_PREFETCH_MINFREE ||
+           vm_pagefault(as, VM_FAULT_READ, vaddr + n * PAGE_SIZE, true)){
+            break;
+        }
+    }
+}
+#endif
+
 int
 vm_fault(int faulttype, vaddr_t faultaddress)
 {
+#if !OPT_A3
 	vaddr_t vbase1, vtop1, vbase2, vtop2, stackbase, stacktop;
 	paddr_t paddr;
-	int i;
-	uint32_t ehi, elo;
+	uint32_t elo;
+#endif
 	struct addrspace *as;
-	int spl;
 
 	faultaddress &= PAGE_FRAME;
-#if OPT_A3
-    bool textsegment = false;
+#if !OPT_A3
+	int i;
+	uint32_t ehi;
+	int spl;
 #endif
 	DEBUG(DB_VM, "dumbvm: fault: 0x%x\n", faultaddress);
 
 	switch (faulttype) {
 	    case VM_FAULT_READONLY:
 #if OPT_A3
-            return EFAULT;
+            //a write to a copy-on-write page, sorted out in vm_pagefault
+            break;
 #else
 		/* We always create pages read-write, so we can't get this */
 		panic("dumbvm: got VM_FAULT_READONLY\n");
@@ -235,31 +1307,22 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 		return EFAULT;
 	}
 
+#if OPT_A3
+    return vm_pagefault(as, faulttype, faultaddress, false);
+#else
 	/* Assert that the address space has been set up properly. */
 	KASSERT(as->as_vbase1 != 0);
-#if OPT_A3
-    KASSERT(as->as_pagetable1 != NULL);
-#else 
 	KASSERT(as->as_pbase1 != 0);
-#endif
 	KASSERT(as->as_npages1 != 0);
 	KASSERT(as->as_vbase2 != 0);
-#if OPT_A3
-    KASSERT(as->as_pagetable2 != NULL);
-#else
 	KASSERT(as->as_pbase2 != 0);
-#endif
 	KASSERT(as->as_npages2 != 0);
-#if OPT_A3
-    KASSERT(as->as_pagetable_stack != NULL);
-#else
 	KASSERT(as->as_stackpbase != 0);
-#endif
 	KASSERT((as->as_vbase1 & PAGE_FRAME) == as->as_vbase1);
-	//KASSERT((as->as_pbase1 & PAGE_FRAME) == as->as_pbase1);
+	KASSERT((as->as_pbase1 & PAGE_FRAME) == as->as_pbase1);
 	KASSERT((as->as_vbase2 & PAGE_FRAME) == as->as_vbase2);
-	//KASSERT((as->as_pbase2 & PAGE_FRAME) == as->as_pbase2);
-	//KASSERT((as->as_stackpbase & PAGE_FRAME) == as->as_stackpbase);
+	KASSERT((as->as_pbase2 & PAGE_FRAME) == as->as_pbase2);
+	KASSERT((as->as_stackpbase & PAGE_FRAME) == as->as_stackpbase);
 
 	vbase1 = as->as_vbase1;
 	vtop1 = vbase1 + as->as_npages1 * PAGE_SIZE;
@@ -267,32 +1330,15 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 	vtop2 = vbase2 + as->as_npages2 * PAGE_SIZE;
 	stackbase = USERSTACK - DUMBVM_STACKPAGES * PAGE_SIZE;
 	stacktop = USERSTACK;
-//code
+
 	if (faultaddress >= vbase1 && faultaddress < vtop1) {
-#if OPT_A3
-        paddr = (faultaddress - vbase1) + as->as_pagetable1[0];
-#else
 		paddr = (faultaddress - vbase1) + as->as_pbase1;
-#endif
-#if OPT_A3
-        textsegment = true;
-#endif
 	}
-    //data
 	else if (faultaddress >= vbase2 && faultaddress < vtop2) {
-#if OPT_A3
-        paddr = (faultaddress - vbase2) + as->as_pagetable2[0];
-#else
 		paddr = (faultaddress - vbase2) + as->as_pbase2;
-#endif
 	}
-    //stack
 	else if (faultaddress >= stackbase && faultaddress < stacktop) {
-#if OPT_A3
-        paddr = (faultaddress - stackbase) + as->as_pagetable_stack[0];
-#else
 		paddr = (faultaddress - stackbase) + as->as_stackpbase;
-#endif
 	}
 	else {
 		return EFAULT;
@@ -311,27 +1357,12 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 		}
 		ehi = faultaddress;
 		elo = paddr | TLBLO_DIRTY | TLBLO_VALID;
-#if OPT_A3
-        if(textsegment && as->load_complete){
-            elo &= ~TLBLO_DIRTY;
-        }
-#endif
 		DEBUG(DB_VM, "dumbvm: 0x%x -> 0x%x\n", faultaddress, paddr);
 		tlb_write(ehi, elo, i);
 		splx(spl);
-		return 0;
-	}
-#if OPT_A3
-    ehi = faultaddress;
-    elo = paddr | TLBLO_DIRTY | TLBLO_VALID;
-    if(textsegment && as->load_complete){
-        elo &= ~TLBLO_DIRTY;
-    }
-    DEBUG(DB_VM, "dumbvm: 0x%x -> 0x%x\n", faultaddress, paddr);
-    tlb_random(ehi, elo);
-    splx(spl);
-    return 0;
-#else 
+		return 0;
+	}
+
 	kprintf("dumbvm: Ran out of TLB entries - cannot handle page fault\n");
 	splx(spl);
 	return EFAULT;
@@ -346,29 +1377,33 @@ as_create(void)
 		return NULL;
 	}
 
-	as->as_vbase1 = 0;
 #if OPT_A3
-    as->as_pagetable1 = NULL;
-#else 
+    as->as_regions = NULL;
+    as->as_pagedir = kmalloc(PT_DIRSIZE * sizeof(paddr_t *));
+    if(as->as_pagedir == NULL){
+        kfree(as);
+        return NULL;
+    }
+    for(unsigned d = 0; d < PT_DIRSIZE; d++){
+        as->as_pagedir[d] = NULL;
+    }
+    as->load_complete = false;
+    as->as_vnode = NULL;
+    as->as_heap = NULL;
+    as->as_heapbreak = 0;
+    as->as_stack = NULL;
+    for(unsigned i = 0; i < MAXCPUS; i++){
+        as->as_asid[i] = 0;
+    }
+#else
+	as->as_vbase1 = 0;
 	as->as_pbase1 = 0;
-#endif
 	as->as_npages1 = 0;
 	as->as_vbase2 = 0;
-#if OPT_A3
-    as->as_pagetable1 = NULL;
-#else
 	as->as_pbase2 = 0;
-#endif
 	as->as_npages2 = 0;
-#if OPT_A3
-    as->as_pagetable_stack = NULL;
-#else
 	as->as_stackpbase = 0;
 #endif
-
-#if OPT_A3
-    as->load_complete = false;
-#endif
 	return as;
 }
 
@@ -376,17 +1411,29 @@ void
 as_destroy(struct addrspace *as)
 {
 #if OPT_A3
-    for(unsigned int i = 0; i < as->as_npages1; i++){
-        vaddr_t v1 = PADDR_TO_KVADDR(as->as_pagetable1[i]);
-        free_kpages(v1);
+    struct vm_region *r;
+
+    as_release_pagetable(as);
+    //no cpu may refill from the directory once it is freed
+    for(unsigned c = 0; c < MAXCPUS; c++){
+        if(vm_utlb_pagedir[c] == as->as_pagedir){
+            vm_utlb_pagedir[c] = NULL;
+        }
+    }
+    //only now can no evictor be looking at the tables any more
+    for(unsigned d = 0; d < PT_DIRSIZE; d++){
+        if(as->as_pagedir[d] != NULL){
+            free_kpages((vaddr_t)as->as_pagedir[d]);
+        }
     }
-    for(unsigned int i = 0; i < as->as_npages2; i++){
-        vaddr_t v2 = PADDR_TO_KVADDR(as->as_pagetable2[i]);
-        free_kpages(v2);
+    kfree(as->as_pagedir);
+    while(as->as_regions != NULL){
+        r = as->as_regions;
+        as->as_regions = r->vr_next;
+        kfree(r);
     }
-    for(unsigned int i = 0; i < DUMBVM_STACKPAGES; i++){
-        vaddr_t v3 = PADDR_TO_KVADDR(as->as_pagetable_stack[i]);
-        free_kpages(v3);
+    if(as->as_vnode != NULL){
+        VOP_DECREF(as->as_vnode);
     }
 #else
     vaddr_t v1 = PADDR_TO_KVADDR(as->as_pbase1);
@@ -402,7 +1449,9 @@ as_destroy(struct addrspace *as)
 void
 as_activate(void)
 {
+#if !OPT_A3
 	int i, spl;
+#endif
 	struct addrspace *as;
 
 	as = curproc_getas();
@@ -413,6 +1462,10 @@ as_activate(void)
 		return;
 	}
 
+#if OPT_A3
+    //the TLB keeps every address space's entries apart by ASID
+    vm_asid_activate(as);
+#else
 	/* Disable interrupts on this CPU while frobbing the TLB. */
 	spl = splhigh();
 
@@ -421,12 +1474,22 @@ as_activate(void)
 	}
 
 	splx(spl);
+#endif
 }
 
 void
 as_deactivate(void)
 {
+#if OPT_A3
+    int spl;
+
+    //the address space may be about to go away
+    spl = splhigh();
+    vm_utlb_pagedir[curcpu->c_number] = NULL;
+    splx(spl);
+#else
 	/* nothing */
+#endif
 }
 
 int
@@ -444,6 +1507,32 @@ as_define_region(struct addrspace *as, vaddr_t vaddr, size_t sz,
 
 	npages = sz / PAGE_SIZE;
 
+#if OPT_A3
+    struct vm_region *r;
+    vaddr_t top = vaddr + sz;
+
+    (void)readable;
+    (void)executable;
+
+    if(npages == 0){
+        return 0;
+    }
+    if(top < vaddr || top > USERSPACETOP){
+        return EFAULT;
+    }
+    //neighbouring segments may share their boundary page, no more
+    for(r = as->as_regions; r != NULL; r = r->vr_next){
+        if(vaddr + PAGE_SIZE < r->vr_base + r->vr_npages * PAGE_SIZE &&
+           r->vr_base + PAGE_SIZE < top){
+            kprintf("dumbvm: Warning: overlapping regions\n");
+            return EINVAL;
+        }
+    }
+    if(as_insert_region(as, vaddr, npages, writeable != 0) == NULL){
+        return ENOMEM;
+    }
+    return 0;
+#else
 	/* We don't use these - all pages are read-write */
 	(void)readable;
 	(void)writeable;
@@ -451,18 +1540,12 @@ as_define_region(struct addrspace *as, vaddr_t vaddr, size_t sz,
 
 	if (as->as_vbase1 == 0) {
 		as->as_vbase1 = vaddr;
-#if OPT_A3
-        as->as_pagetable1 = kmalloc(sizeof(paddr_t) * npages);
-#endif
 		as->as_npages1 = npages;
 		return 0;
 	}
 
 	if (as->as_vbase2 == 0) {
 		as->as_vbase2 = vaddr;
-#if OPT_A3
-        as->as_pagetable2 = kmalloc(sizeof(paddr_t) * npages);
-#endif
 		as->as_npages2 = npages;
 		return 0;
 	}
@@ -472,48 +1555,20 @@ as_define_region(struct addrspace *as, vaddr_t vaddr, size_t sz,
 	 */
 	kprintf("dumbvm: Warning: too many regions\n");
 	return EUNIMP;
-}
-
-static
-void
-as_zero_region(paddr_t paddr, unsigned npages)
-{
-	bzero((void *)PADDR_TO_KVADDR(paddr), npages * PAGE_SIZE);
+#endif
 }
 
 int
 as_prepare_load(struct addrspace *as)
 {
-	//KASSERT(as->as_pbase1 == 0);
-	//KASSERT(as->as_pbase2 == 0);
-	//KASSERT(as->as_stackpbase == 0);
 #if OPT_A3
-    for(unsigned int i = 0; i < as->as_npages1; i++){
-        paddr_t onepage = getppages(1);
-        if(onepage == 0){
-            return ENOMEM;
-        }
-        as->as_pagetable1[i] = onepage;
-        as_zero_region(onepage, 1);
-    }
-    for(unsigned int i = 0; i < as->as_npages2; i++){
-        paddr_t onepage = getppages(1);
-        if(onepage == 0){
-            return ENOMEM;
-        }
-        as->as_pagetable2[i] = onepage;
-        as_zero_region(onepage, 1);
-    }
-    as->as_pagetable_stack = kmalloc(sizeof(paddr_t) * DUMBVM_STACKPAGES);
-    for(unsigned int i = 0; i < DUMBVM_STACKPAGES; i++){
-        paddr_t onepage = getppages(1);
-        if(onepage == 0){
-            return ENOMEM;
-        }
-        as->as_pagetable_stack[i] = onepage;
-        as_zero_region(onepage, 1);
-    }
+    //frames are handed out by vm_fault on first touch
+    (void)as;
 #else
+	KASSERT(as->as_pbase1 == 0);
+	KASSERT(as->as_pbase2 == 0);
+	KASSERT(as->as_stackpbase == 0);
+
 	as->as_pbase1 = getppages(as->as_npages1);
 	if (as->as_pbase1 == 0) {
 		return ENOMEM;
@@ -540,8 +1595,27 @@ int
 as_complete_load(struct addrspace *as)
 {
 #if OPT_A3
-    as_activate();
+    struct vm_region *r;
+    vaddr_t heapbase = 0;
+
+    //the heap starts out empty, on the page after the last segment
+    for(r = as->as_regions; r != NULL; r = r->vr_next){
+        if(r->vr_base + r->vr_npages * PAGE_SIZE > heapbase){
+            heapbase = r->vr_base + r->vr_npages * PAGE_SIZE;
+        }
+    }
+    as->as_heap = as_insert_region(as, heapbase, 0, true);
+    if(as->as_heap == NULL){
+        return ENOMEM;
+    }
+    as->as_heapbreak = heapbase;
+
+    //pages loaded so far were mapped writable; make them fault again
     as->load_complete = true;
+    for(r = as->as_regions; r != NULL; r = r->vr_next){
+        as_revoke_refills(as, r->vr_base, r->vr_npages);
+    }
+    as_flush_tlb(as);
     return 0;
 #else
 	(void)as;
@@ -549,11 +1623,432 @@ as_complete_load(struct addrspace *as)
 #endif
 }
 
+#if OPT_A3
+int
+as_define_file(struct addrspace *as, struct vnode *v,
+               vaddr_t vaddr, off_t offset, size_t filesize)
+{
+    struct vm_region *r;
+
+    if(filesize == 0){
+        return 0;
+    }
+    //a process only ever pages from the one executable
+    KASSERT(as->as_vnode == NULL || as->as_vnode == v);
+
+    //the last region to start at or below vaddr is the one just defined
+    r = NULL;
+    for(struct vm_region *p = as->as_regions;
+        p != NULL && p->vr_base <= vaddr; p = p->vr_next){
+        r = p;
+    }
+    if(r == NULL || r->vr_filesize != 0 ||
+       vaddr + filesize > r->vr_base + r->vr_npages * PAGE_SIZE){
+        return EINVAL;
+    }
+    r->vr_filevaddr = vaddr;
+    r->vr_fileoffset = offset;
+    r->vr_filesize = filesize;
+
+    if(as->as_vnode == NULL){
+        VOP_INCREF(v);
+        as->as_vnode = v;
+    }
+    return 0;
+}
+#endif
+
+#if OPT_A3
+int
+as_sbrk(struct addrspace *as, intptr_t amount, vaddr_t *oldbreak)
+{
+    struct vm_region *heap = as->as_heap;
+    vaddr_t newbreak, oldtop, newtop;
+
+    if(heap == NULL){
+        return ENOMEM;
+    }
+    //negate after the cast: -amount overflows for INTPTR_MIN
+    if(amount < 0 &&
+       (vaddr_t)0 - (vaddr_t)amount > as->as_heapbreak - heap->vr_base){
+        return EINVAL;
+    }
+    if(amount > 0 && (vaddr_t)amount > USERSPACETOP - as->as_heapbreak){
+        return ENOMEM;
+    }
+
+    newbreak = as->as_heapbreak + amount;
+    newtop = ROUNDUP(newbreak, PAGE_SIZE);
+    oldtop = heap->vr_base + heap->vr_npages * PAGE_SIZE;
+    //the heap can't grow into whatever comes after it, or the stack
+    if(newtop > oldtop &&
+       ((heap->vr_next != NULL && newtop > heap->vr_next->vr_base) ||
+        newtop > USERSTACK - VM_STACKLIMIT)){
+        return ENOMEM;
+    }
+
+    heap->vr_npages = (newtop - heap->vr_base) / PAGE_SIZE;
+    if(newtop < oldtop){
+        as_discard_range(as, newtop, (oldtop - newtop) / PAGE_SIZE);
+    }
+    *oldbreak = as->as_heapbreak;
+    as->as_heapbreak = newbreak;
+    return 0;
+}
+
+/*
+ * True if none of the NPAGES pages from BASE belongs to a region of
+ * AS, and no region starts among them either: the heap may be empty
+ * but must still be able to grow.
+ */
+static
+bool
+as_range_free(struct addrspace *as, vaddr_t base, size_t npages)
+{
+    struct vm_region *r;
+    vaddr_t top = base + npages * PAGE_SIZE;
+
+    for(r = as->as_regions; r != NULL && r->vr_base < top; r = r->vr_next){
+        if(r->vr_base >= base ||
+           r->vr_base + r->vr_npages * PAGE_SIZE > base){
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+ * True if every one of the NPAGES pages from BASE is in some region
+ * of AS.
+ */
+static
+bool
+as_range_mapped(struct addrspace *as, vaddr_t base, size_t npages)
+{
+    struct vm_region *r;
+    vaddr_t top = base + npages * PAGE_SIZE, next = base;
+
+    for(r = as->as_regions; r != NULL && r->vr_base <= next && next < top;
+        r = r->vr_next){
+        if(r->vr_base + r->vr_npages * PAGE_SIZE > next){
+            next = r->vr_base + r->vr_npages * PAGE_SIZE;
+        }
+    }
+    return next >= top;
+}
+
+/*
+ * Find room for NPAGES pages below the space kept for the stack,
+ * as high up as possible so that the heap has room to grow. Page 0
+ * is never handed out. Returns 0 if there is no gap that large.
+ */
+static
+vaddr_t
+as_find_gap(struct addrspace *as, size_t npages)
+{
+    struct vm_region *r;
+    vaddr_t lo = PAGE_SIZE, hi, top = USERSTACK - VM_STACKLIMIT, best = 0;
+
+    for(r = as->as_regions; ; r = r->vr_next){
+        hi = (r == NULL || r->vr_base > top) ? top : r->vr_base;
+        if(hi > lo && (hi - lo) / PAGE_SIZE >= npages){
+            best = hi - npages * PAGE_SIZE;
+        }
+        if(r == NULL || r->vr_base >= top){
+            return best;
+        }
+        if(r->vr_base + r->vr_npages * PAGE_SIZE > lo){
+            lo = r->vr_base + r->vr_npages * PAGE_SIZE;
+        }
+    }
+}
+
+/*
+ * Split R, an mmap region of AS, in two at VADDR and return the upper
+ * half, or NULL if out of memory.
+ */
+static
+struct vm_region *
+as_split_region(struct addrspace *as, struct vm_region *r, vaddr_t vaddr)
+{
+    struct vm_region *nr;
+    vaddr_t top = r->vr_base + r->vr_npages * PAGE_SIZE;
+
+    KASSERT(r->vr_mmapped);
+    KASSERT(vaddr > r->vr_base && vaddr < top);
+    nr = as_insert_region(as, vaddr, (top - vaddr) / PAGE_SIZE,
+                          r->vr_writeable);
+    if(nr == NULL){
+        return NULL;
+    }
+    nr->vr_mmapped = true;
+    nr->vr_noaccess = r->vr_noaccess;
+    nr->vr_advice = r->vr_advice;
+    r->vr_npages = (vaddr - r->vr_base) / PAGE_SIZE;
+    return nr;
+}
+
+/*
+ * Make the NPAGES pages from VADDR a run of whole regions of AS, by
+ * splitting the ones that stick out at either end. Fails with EINVAL
+ * if any page in the range belongs to a region mmap didn't make, and
+ * with ENOMEM if MAPPED is set and some page isn't mapped at all.
+ */
+static
+int
+as_isolate_range(struct addrspace *as, vaddr_t vaddr, size_t npages,
+                 bool mapped)
+{
+    struct vm_region *r;
+    vaddr_t top = vaddr + npages * PAGE_SIZE, next = vaddr;
+
+    if((vaddr & ~(vaddr_t)PAGE_FRAME) != 0 || npages == 0 ||
+       top <= vaddr || top > USERSPACETOP){
+        return EINVAL;
+    }
+    for(r = as->as_regions; r != NULL && r->vr_base < top; r = r->vr_next){
+        if(r->vr_base + r->vr_npages * PAGE_SIZE <= vaddr){
+            continue;
+        }
+        if(!r->vr_mmapped){
+            return EINVAL;
+        }
+        if(r->vr_base > next && mapped){
+            return ENOMEM;
+        }
+        next = r->vr_base + r->vr_npages * PAGE_SIZE;
+    }
+    if(next < top && mapped){
+        return ENOMEM;
+    }
+
+    for(r = as->as_regions; r != NULL && r->vr_base < top; r = r->vr_next){
+        if(r->vr_base + r->vr_npages * PAGE_SIZE <= vaddr){
+            continue;
+        }
+        //the upper half is looked at next time round
+        if(r->vr_base < vaddr){
+            if(as_split_region(as, r, vaddr) == NULL){
+                return ENOMEM;
+            }
+            continue;
+        }
+        if(r->vr_base + r->vr_npages * PAGE_SIZE > top){
+            if(as_split_region(as, r, top) == NULL){
+                return ENOMEM;
+            }
+        }
+    }
+    return 0;
+}
+
+/*
+ * Set the protection bits of every page table entry for the NPAGES
+ * pages from BASE in AS to PROTBITS and flush the TLBs, so that the
+ * next access goes through vm_fault and sees them.
+ */
+static
+void
+as_protect_range(struct addrspace *as, vaddr_t base, size_t npages,
+                 paddr_t protbits)
+{
+    paddr_t *pte, entry;
+    vaddr_t va;
+
+    for(size_t n = 0; n < npages; n++){
+        va = base + n * PAGE_SIZE;
+        pte = as_lookup_pte(as, va, false);
+        if(pte == NULL){
+            continue;
+        }
+        entry = as_pin_pte(as, va, pte);
+        if(entry == 0){
+            continue;
+        }
+        *pte = (entry & ~(PTE_PROTBITS | PTE_TLBBITS)) | protbits;
+        if(!PTE_ISSWAPPED(entry)){
+            coremap_unpin(PTE_FRAME(entry));
+        }
+    }
+    as_flush_tlb(as);
+}
+
+int
+as_mmap(struct addrspace *as, vaddr_t hint, size_t npages, int prot,
+        bool fixed, vaddr_t *ret)
+{
+    struct vm_region *r;
+    vaddr_t base = 0;
+
+    if(npages == 0 || npages > USERSPACETOP / PAGE_SIZE){
+        return EINVAL;
+    }
+    if((hint & ~(vaddr_t)PAGE_FRAME) != 0){
+        if(fixed){
+            return EINVAL;
+        }
+        hint = 0;
+    }
+    //a hint is taken only if it is free; existing mappings stay
+    if(hint != 0 && hint + npages * PAGE_SIZE > hint &&
+       hint + npages * PAGE_SIZE <= USERSTACK - VM_STACKLIMIT &&
+       as_range_free(as, hint, npages)){
+        base = hint;
+    }
+    else if(!fixed){
+        base = as_find_gap(as, npages);
+    }
+    if(base == 0){
+        return ENOMEM;
+    }
+
+    r = as_insert_region(as, base, npages, (prot & PROT_WRITE) != 0);
+    if(r == NULL){
+        return ENOMEM;
+    }
+    r->vr_mmapped = true;
+    r->vr_noaccess = prot == PROT_NONE;
+    *ret = base;
+    return 0;
+}
+
+int
+as_munmap(struct addrspace *as, vaddr_t vaddr, size_t npages)
+{
+    struct vm_region *r, **prev;
+    vaddr_t top = vaddr + npages * PAGE_SIZE;
+    int result;
+
+    result = as_isolate_range(as, vaddr, npages, false);
+    if(result){
+        return result;
+    }
+    as_discard_range(as, vaddr, npages);
+    prev = &as->as_regions;
+    while((r = *prev) != NULL && r->vr_base < top){
+        if(r->vr_base >= vaddr){
+            KASSERT(r->vr_mmapped);
+            *prev = r->vr_next;
+            kfree(r);
+            continue;
+        }
+        prev = &r->vr_next;
+    }
+    return 0;
+}
+
+int
+as_mprotect(struct addrspace *as, vaddr_t vaddr, size_t npages, int prot)
+{
+    struct vm_region *r;
+    vaddr_t top = vaddr + npages * PAGE_SIZE;
+    paddr_t protbits;
+    int result;
+
+    result = as_isolate_range(as, vaddr, npages, true);
+    if(result){
+        return result;
+    }
+    for(r = as->as_regions; r != NULL && r->vr_base < top; r = r->vr_next){
+        if(r->vr_base >= vaddr){
+            r->vr_writeable = (prot & PROT_WRITE) != 0;
+            r->vr_noaccess = prot == PROT_NONE;
+        }
+    }
+    protbits = prot == PROT_NONE ? PTE_NOACCESS :
+               (prot & PROT_WRITE) ? 0 : PTE_READONLY;
+    as_protect_range(as, vaddr, npages, protbits);
+    return 0;
+}
+
+int
+as_madvise(struct addrspace *as, vaddr_t vaddr, size_t npages, int advice)
+{
+    struct vm_region *r;
+    vaddr_t top = vaddr + npages * PAGE_SIZE;
+
+    if((vaddr & ~(vaddr_t)PAGE_FRAME) != 0 || top < vaddr ||
+       top > USERSPACETOP){
+        return EINVAL;
+    }
+    if(advice != MADV_NORMAL && advice != MADV_RANDOM &&
+       advice != MADV_SEQUENTIAL && advice != MADV_WILLNEED &&
+       advice != MADV_DONTNEED){
+        return EINVAL;
+    }
+    if(!as_range_mapped(as, vaddr, npages)){
+        return ENOMEM;
+    }
+
+    switch(advice){
+      case MADV_WILLNEED:
+        //only a hint, so give up quietly once memory runs short
+        for(size_t n = 0; n < npages; n++){
+            if(coremap_freecount() < VM_PREFETCH_MINFREE){
+                break;
+            }
+            (void)vm_pagefault(as, VM_FAULT_READ, vaddr + n * PAGE_SIZE,
+                               true);
+        }
+        break;
+      case MADV_DONTNEED:
+        //the next touch refills them from the executable or with zeros
+        as_discard_range(as, vaddr, npages);
+        break;
+      default:
+        //executable regions can't be split, so whole regions take it
+        for(r = as->as_regions; r != NULL && r->vr_base < top;
+            r = r->vr_next){
+            if(r->vr_base + r->vr_npages * PAGE_SIZE > vaddr){
+                r->vr_advice = advice;
+            }
+        }
+        break;
+    }
+    return 0;
+}
+
+int
+as_mincore(struct addrspace *as, vaddr_t vaddr, size_t npages,
+           unsigned char *vec)
+{
+    paddr_t *pte, entry;
+    vaddr_t va;
+
+    if((vaddr & ~(vaddr_t)PAGE_FRAME) != 0 ||
+       vaddr + npages * PAGE_SIZE < vaddr ||
+       vaddr + npages * PAGE_SIZE > USERSPACETOP){
+        return EINVAL;
+    }
+    if(!as_range_mapped(as, vaddr, npages)){
+        return ENOMEM;
+    }
+    for(size_t n = 0; n < npages; n++){
+        va = vaddr + n * PAGE_SIZE;
+        pte = as_lookup_pte(as, va, false);
+        //a snapshot: the page may be evicted or faulted in right after
+        entry = pte == NULL ? 0 : *pte;
+        vec[n] = (entry != 0 && !PTE_ISSWAPPED(entry)) ? MINCORE_INCORE : 0;
+    }
+    return 0;
+}
+#endif
+
 int
 as_define_stack(struct addrspace *as, vaddr_t *stackptr)
 {
 #if OPT_A3
-    KASSERT(as->as_pagetable_stack != NULL);
+    vaddr_t stackbase = USERSTACK - VM_STACKPAGES * PAGE_SIZE;
+    int result;
+
+    KASSERT(as->as_stack == NULL);
+    result = as_define_region(as, stackbase, VM_STACKPAGES * PAGE_SIZE,
+                              1, 1, 0);
+    if(result){
+        return result;
+    }
+    as->as_stack = as_find_region(as, stackbase);
+    KASSERT(as->as_stack != NULL);
 #else
 	KASSERT(as->as_stackpbase != 0);
 #endif
@@ -572,52 +2067,63 @@ as_copy(struct addrspace *old, struct addrspace **ret)
 		return ENOMEM;
 	}
 
+#if OPT_A3
+    struct vm_region *r, *nr;
+    int result;
+
+    new->load_complete = old->load_complete;
+    //pages the parent never touched are still read from the file
+    if(old->as_vnode != NULL){
+        VOP_INCREF(old->as_vnode);
+        new->as_vnode = old->as_vnode;
+    }
+    for(r = old->as_regions; r != NULL; r = r->vr_next){
+        nr = as_insert_region(new, r->vr_base, r->vr_npages,
+                              r->vr_writeable);
+        if(nr == NULL){
+            as_destroy(new);
+            return ENOMEM;
+        }
+        nr->vr_filevaddr = r->vr_filevaddr;
+        nr->vr_fileoffset = r->vr_fileoffset;
+        nr->vr_filesize = r->vr_filesize;
+        nr->vr_mmapped = r->vr_mmapped;
+        nr->vr_noaccess = r->vr_noaccess;
+        nr->vr_advice = r->vr_advice;
+        if(r == old->as_heap){
+            new->as_heap = nr;
+        }
+        if(r == old->as_stack){
+            new->as_stack = nr;
+        }
+    }
+    new->as_heapbreak = old->as_heapbreak;
+
+    result = as_copy_pagetable(old, new);
+
+    //TLBs may still map the now-shared pages writable for the parent
+    as_flush_tlb(old);
+
+    if(result){
+        as_destroy(new);
+        return result;
+    }
+#else
 	new->as_vbase1 = old->as_vbase1;
 	new->as_npages1 = old->as_npages1;
 	new->as_vbase2 = old->as_vbase2;
 	new->as_npages2 = old->as_npages2;
-#if OPT_A3
-    new->as_pagetable1 = kmalloc(sizeof(paddr_t) * old->as_npages1);
-    new->as_pagetable2 = kmalloc(sizeof(paddr_t) * old->as_npages2);
-    new->as_pagetable_stack = kmalloc(sizeof(paddr_t) * DUMBVM_STACKPAGES);
-#endif
+
 	/* (Mis)use as_prepare_load to allocate some physical memory. */
 	if (as_prepare_load(new)) {
 		as_destroy(new);
 		return ENOMEM;
 	}
 
-    
-	//KASSERT(new->as_pbase1 != 0);
-	///KASSERT(new->as_pbase2 != 0);
-	//KASSERT(new->as_stackpbase != 0);
-#if OPT_A3
-    KASSERT(new->as_pagetable1 != NULL);
-    KASSERT(new->as_pagetable2 != NULL);
-    KASSERT(new->as_pagetable_stack != NULL);
-#else
-    KASSERT(new->as_pbase1 != 0);
-    KASSERT(new->as_pbase2 != 0);
-    KASSERT(new->as_stackpbase != 0);
-#endif
+	KASSERT(new->as_pbase1 != 0);
+	KASSERT(new->as_pbase2 != 0);
+	KASSERT(new->as_stackpbase != 0);
 
-#if OPT_A3
-    for(unsigned int i = 0; i < old->as_npages1; i++){
-        memmove((void *)PADDR_TO_KVADDR(new->as_pagetable1[i]),
-                (const void *)PADDR_TO_KVADDR(old->as_pagetable1[i]),
-                PAGE_SIZE);
-    }
-    for(unsigned int i = 0; i < old->as_npages2; i++){
-        memmove((void *)PADDR_TO_KVADDR(new->as_pagetable2[i]),
-                (const void *)PADDR_TO_KVADDR(old->as_pagetable2[i]),
-                PAGE_SIZE);
-    }
-    for(unsigned int i = 0; i < DUMBVM_STACKPAGES; i++){
-        memmove((void *)PADDR_TO_KVADDR(new->as_pagetable_stack[i]),
-                (const void *)PADDR_TO_KVADDR(old->as_pagetable_stack[i]),
-                PAGE_SIZE);
-    }
-#else
 	memmove((void *)PADDR_TO_KVADDR(new->as_pbase1),
 		(const void *)PADDR_TO_KVADDR(old->as_pbase1),
 		old->as_npages1*PAGE_SIZE);
@@ -37,6 +37,9 @@
 
 #include <vm.h>
 #include "opt-A3.h"
+#if OPT_A3
+#include <platform/maxcpus.h>
+#endif
 struct vnode;
 
 
@@ -47,29 +50,53 @@ struct vnode;
  * You write this.
  */
 
+#if OPT_A3
+/*
+ * A range of pages the process may touch, in a list sorted by base.
+ * Two regions may share a page where one ELF segment ends and the
+ * next begins, but no more than that. The FILESIZE bytes from
+ * FILEVADDR are read from the executable at FILEOFFSET. Regions made
+ * by mmap share no pages with anything, so that munmap and mprotect
+ * can split them at any page.
+ */
+struct vm_region {
+  vaddr_t vr_base;
+  size_t vr_npages;
+  bool vr_writeable;
+  vaddr_t vr_filevaddr;
+  off_t vr_fileoffset;
+  size_t vr_filesize;
+  bool vr_mmapped;
+  bool vr_noaccess;       // PROT_NONE
+  int vr_advice;          // MADV_NORMAL, MADV_RANDOM or MADV_SEQUENTIAL
+  struct vm_region *vr_next;
+};
+#endif
+
 struct addrspace {
-  vaddr_t as_vbase1;
 #if OPT_A3
-  paddr_t* as_pagetable1;
+  struct vm_region *as_regions;
+  // two-level page table: second-level tables exist only once used
+  paddr_t **as_pagedir;
+  bool load_complete; 
+  // executable the regions are paged in from
+  struct vnode *as_vnode;
+  // heap region, starting right after the executable, and its break
+  struct vm_region *as_heap;
+  vaddr_t as_heapbreak;
+  // stack region, which grows down as it is touched
+  struct vm_region *as_stack;
+  // TLB address space ID on each cpu, tagged with its generation
+  uint32_t as_asid[MAXCPUS];
 #else
+  vaddr_t as_vbase1;
   paddr_t as_pbase1;
-#endif
   size_t as_npages1;
   vaddr_t as_vbase2;
-#if OPT_A3
-  paddr_t* as_pagetable2;
-#else
   paddr_t as_pbase2;
-#endif
   size_t as_npages2;
-#if OPT_A3
-  paddr_t* as_pagetable_stack;
-#else
   paddr_t as_stackpbase;
 #endif
-#if OPT_A3
-  bool load_complete; 
-#endif
 };
 
 /*
@@ -106,6 +133,32 @@ struct addrspace {
  *    as_define_stack - set up the stack region in the address space.
  *                (Normally called *after* as_complete_load().) Hands
  *                back the initial stack pointer for the new process.
+ *
+ *    as_define_file - record that the FILESIZE bytes at VADDR come from
+ *                offset OFFSET of the executable V. The pages are read
+ *                in by vm_fault the first time they are touched.
+ *
+ *    as_sbrk   - move the heap break by AMOUNT bytes and hand back the
+ *                old break. Pages above the break are backed on first
+ *                touch; whole pages given back are freed at once.
+ *
+ *    as_mmap   - make a new zero-filled region of NPAGES pages with
+ *                protection PROT (PROT_* bits) at HINT if that is
+ *                free, or else wherever there is room below the stack,
+ *                unless FIXED is set; hands back its base.
+ *
+ *    as_munmap - remove the pages from VADDR to VADDR+NPAGES pages,
+ *                which must all have come from as_mmap if mapped.
+ *
+ *    as_mprotect - change the protection of such pages to PROT.
+ *
+ *    as_madvise - act on ADVICE (MADV_*) for the NPAGES pages from
+ *                VADDR, which must all be mapped: bring them in now,
+ *                free them, or set the read-ahead policy of the
+ *                regions they are in.
+ *
+ *    as_mincore - set VEC[i] to MINCORE_INCORE if page i of the NPAGES
+ *                from VADDR is in memory and to 0 if not.
  */
 
 struct addrspace *as_create(void);
@@ -122,6 +175,24 @@ int               as_define_region(struct addrspace *as,
 int               as_prepare_load(struct addrspace *as);
 int               as_complete_load(struct addrspace *as);
 int               as_define_stack(struct addrspace *as, vaddr_t *initstackptr);
+#if OPT_A3
+int               as_define_file(struct addrspace *as, struct vnode *v,
+                                 vaddr_t vaddr, off_t offset,
+                                 size_t filesize);
+int               as_sbrk(struct addrspace *as, intptr_t amount,
+                          vaddr_t *oldbreak);
+int               as_mmap(struct addrspace *as, vaddr_t hint,
+                          size_t npages, int prot, bool fixed,
+                          vaddr_t *ret);
+int               as_munmap(struct addrspace *as, vaddr_t vaddr,
+                            size_t npages);
+int               as_mprotect(struct addrspace *as, vaddr_t vaddr,
+                              size_t npages, int prot);
+int               as_madvise(struct addrspace *as, vaddr_t vaddr,
+                             size_t npages, int advice);
+int               as_mincore(struct addrspace *as, vaddr_t vaddr,
+                             size_t npages, unsigned char *vec);
+#endif
 
 
 /*
@@ -0,0 +1,187 @@
+#ifndef _COREMAP_H_
+#define _COREMAP_H_
+
+/*
+ * Physical page allocator.
+ *
+ * Physical memory that is left over after the kernel has booted is
+ * tracked by the coremap: one struct coremap_entry per page frame,
+ * holding that frame's metadata only. Free frames are found through
+ * a buddy allocator with one free list per block order, so allocation
+ * and free are O(log n) in the number of frames rather than a scan of
+ * the whole map. Single frames are cached per-cpu in front of that.
+ *
+ * Allocated runs are reference counted so that user pages can be
+ * shared copy-on-write between address spaces.
+ *
+ * A user page that belongs to exactly one address space records its
+ * owner, which makes it a candidate for eviction to swap. Anything
+ * that is about to use or change the mapping of such a page pins it
+ * first; the evictor only takes frames that are not pinned, and pins
+ * them itself while they are being written out.
+ *
+ * For choosing what to evict, each user frame also has a referenced
+ * bit, set whenever a TLB entry for it is loaded, and a dirty bit:
+ * a clean page still matches its swap slot, if it has one, and
+ * otherwise its executable or zero-fill origin, so it can be dropped
+ * without being written.
+ */
+
+#include <types.h>
+#include "opt-A3.h"
+
+struct addrspace;
+
+#if OPT_A3
+
+/* Largest buddy block is 2^COREMAP_MAXORDER pages (4M with 4k pages). */
+#define COREMAP_MAXORDER  10
+
+/*
+ * Bits the clock clears in an owner's page table entry when it takes
+ * the page's referenced bit away. The VM system sets them while the
+ * page may be loaded into the TLB without going through vm_fault (it
+ * is the MIPS TLBLO_VALID bit), so the next use is seen again.
+ */
+#define CM_PTE_REFBITS    0x00000200
+
+/* Replacement policies for coremap_pick_victim */
+#define CM_POLICY_CLOCK   0   /* second chance, clean pages first */
+#define CM_POLICY_FIFO    1   /* next frame after the hand */
+#define CM_POLICY_RANDOM  2   /* any frame */
+
+/* Values for cm_state */
+#define CM_FREE      0    /* on a free list; cm_order is valid */
+#define CM_HEAD      1    /* first frame of an allocated run */
+#define CM_TAIL      2    /* later frame of an allocated run */
+
+struct coremap_entry {
+	uint8_t cm_state;       /* CM_FREE, CM_HEAD or CM_TAIL */
+	uint8_t cm_order;       /* free block order (CM_FREE only) */
+	uint16_t cm_refcount;   /* references to the run (CM_HEAD only) */
+	uint32_t cm_npages;     /* length of allocated run (CM_HEAD only) */
+	int32_t cm_next;        /* free list links, frame numbers or -1 */
+	int32_t cm_prev;
+	bool cm_busy;           /* pinned */
+	bool cm_referenced;     /* mapped since the clock hand last passed */
+	bool cm_dirty;          /* differs from its backing copy */
+	int32_t cm_swapslot;    /* clean copy on swap, or -1 */
+	struct addrspace *cm_as;        /* owner, if evictable */
+	vaddr_t cm_vaddr;               /* where the owner maps it */
+	paddr_t *cm_pte;                /* owner's page table entry */
+	void *cm_kmalloc;               /* kmalloc's record of the page */
+};
+
+/* Call once from vm_bootstrap, after ram_bootstrap. */
+void coremap_bootstrap(void);
+
+/* True once coremap_bootstrap has run. */
+bool coremap_ready(void);
+
+/*
+ * Allocate NPAGES physically contiguous frames; returns the physical
+ * address of the first one, or 0 if no run that large is free.
+ */
+paddr_t coremap_alloc(unsigned long npages);
+
+/*
+ * Drop a reference to a run previously returned by coremap_alloc;
+ * the run is freed when the last reference goes.
+ *
+ * Frames taken before coremap_bootstrap are not in the map. They are
+ * never freed, and the calls below treat them as shared by everyone:
+ * the VM system uses one as the zero page it maps for untouched
+ * anonymous memory.
+ */
+void coremap_free(paddr_t paddr);
+
+/*
+ * Frames start out with one reference. Address spaces that share a
+ * frame after fork take one each, and write to it only once the
+ * count is back down to one.
+ */
+void coremap_incref(paddr_t paddr);
+unsigned coremap_refcount(paddr_t paddr);
+
+/*
+ * Pin a user frame, waiting if someone else has it pinned. Fails if
+ * by then the frame is owned by anyone but AS at VADDR (or by no
+ * one); the caller should look at its page table entry again.
+ */
+bool coremap_pin(paddr_t paddr, struct addrspace *as, vaddr_t vaddr);
+void coremap_unpin(paddr_t paddr);
+
+/*
+ * Set or clear (AS == NULL) the owner of a frame, which maps it at
+ * VADDR through the page table entry PTE. Clearing it also unpins
+ * the frame.
+ */
+void coremap_setowner(paddr_t paddr, struct addrspace *as, vaddr_t vaddr,
+		      paddr_t *pte);
+
+/*
+ * Replacement state of a user page. Except for coremap_referenced,
+ * which only loses a sample if it races, the caller either has the
+ * frame pinned or has just allocated it.
+ */
+void coremap_resetstate(paddr_t paddr);         /* clean, no swap copy */
+void coremap_referenced(paddr_t paddr);
+bool coremap_isdirty(paddr_t paddr);
+int coremap_swapslot(paddr_t paddr);            /* -1 if none */
+void coremap_setswapslot(paddr_t paddr, int slot);
+int coremap_markdirty(paddr_t paddr);           /* returns dropped slot */
+
+/*
+ * A page the clock gave a second chance. It is left pinned, so that
+ * its owner can't go away before the caller is done with it.
+ */
+struct coremap_aged {
+	struct addrspace *ca_as;
+	vaddr_t ca_vaddr;
+	paddr_t ca_paddr;
+};
+
+/*
+ * Pick a frame to evict and pin it. Returns 0 if every user frame is
+ * pinned or shared. Under CM_POLICY_CLOCK, pages that were given a
+ * second chance are put in AGED (up to MAXAGED of them, count in
+ * NAGED); the caller must flush those from the TLBs, so that the next
+ * use marks them referenced again, and then unpin them.
+ */
+paddr_t coremap_pick_victim(struct addrspace **as, vaddr_t *vaddr,
+			    struct coremap_aged *aged, unsigned maxaged,
+			    unsigned *naged);
+
+/* Choose a CM_POLICY_*. */
+void coremap_setpolicy(unsigned policy);
+
+/*
+ * A single frame that is already zeroed, from the pool idle cpus keep
+ * filled, or 0 if the pool is empty; the caller then has to get and
+ * zero a frame itself.
+ */
+paddr_t coremap_alloc_zeroed(void);
+
+/*
+ * Zero one more frame for the pool. Called from the idle loop; returns
+ * false if there was nothing to do, because the pool is full or free
+ * memory is short.
+ */
+bool coremap_prezero(void);
+
+/*
+ * kmalloc keeps a pointer to its bookkeeping for each page it splits
+ * into blocks, so kfree can tell a block's size without a search.
+ * It must be set back to NULL before the frame is freed. Frames taken
+ * before coremap_bootstrap can't have one: setting it does nothing
+ * and getting it returns NULL.
+ */
+void coremap_setkmalloc(paddr_t paddr, void *data);
+void *coremap_getkmalloc(paddr_t paddr);
+
+/* Number of free frames, including those cached per-cpu or zeroed. */
+unsigned coremap_freecount(void);
+
+#endif /* OPT_A3 */
+
+#endif /* _COREMAP_H_ */
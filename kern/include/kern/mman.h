@@ -0,0 +1,31 @@
+#ifndef _KERN_MMAN_H_
+#define _KERN_MMAN_H_
+
+/*
+ * Definitions for mmap(), munmap(), mprotect(), madvise() and mincore().
+ */
+
+
+/* Page protections. Any of them but PROT_NONE implies PROT_READ. */
+#define PROT_NONE    0
+#define PROT_READ    1
+#define PROT_WRITE   2
+#define PROT_EXEC    4
+
+/* Flags for mmap(). Exactly one of MAP_SHARED and MAP_PRIVATE. */
+#define MAP_SHARED   0x0001	/* Changes go to the object. */
+#define MAP_PRIVATE  0x0002	/* Changes stay private (copy-on-write). */
+#define MAP_FIXED    0x0010	/* Use the address given or fail. */
+#define MAP_ANON     0x1000	/* Zero-filled memory, not a file; fd is -1. */
+
+/* Advice for madvise(). */
+#define MADV_NORMAL      0	/* No special treatment. */
+#define MADV_RANDOM      1	/* No read-ahead. */
+#define MADV_SEQUENTIAL  2	/* Read ahead after each page fault. */
+#define MADV_WILLNEED    3	/* Bring the pages in now. */
+#define MADV_DONTNEED    4	/* Free the pages; they refill when touched. */
+
+/* Bits in the vector mincore() fills in, one byte per page. */
+#define MINCORE_INCORE   0x1	/* The page is in memory. */
+
+#endif /* _KERN_MMAN_H_ */
@@ -0,0 +1,45 @@
+#ifndef _KERN_VMSTATS_H_
+#define _KERN_VMSTATS_H_
+
+/*
+ * Virtual memory statistics, as returned by __vmstats(): one count
+ * per VMSTAT_* index. Shared with userland.
+ */
+
+/* These are the different stats that get tracked.
+ * See kern/vm/uw-vmstats.c for strings corresponding to each stat.
+ */
+
+/* DO NOT ADD OR CHANGE WITHOUT ALSO CHANGING uw-vmstats.c */
+#define VMSTAT_TLB_FAULT              (0)
+#define VMSTAT_TLB_FAULT_FREE         (1)
+#define VMSTAT_TLB_FAULT_REPLACE      (2)
+#define VMSTAT_TLB_INVALIDATE         (3)
+#define VMSTAT_TLB_RELOAD             (4)
+#define VMSTAT_PAGE_FAULT_ZERO        (5)
+#define VMSTAT_PAGE_FAULT_DISK        (6)
+#define VMSTAT_ELF_FILE_READ          (7)
+#define VMSTAT_SWAP_FILE_READ         (8)
+#define VMSTAT_SWAP_FILE_WRITE        (9)
+#define VMSTAT_EVICT_CLEAN           (10)
+#define VMSTAT_EVICT_DIRTY           (11)
+#define VMSTAT_CLOCK_SECOND_CHANCE   (12)
+#define VMSTAT_ZERO_POOL_HIT         (13)
+#define VMSTAT_ZERO_POOL_MISS        (14)
+#define VMSTAT_ZERO_PAGE_MAP         (15)
+#define VMSTAT_ZERO_PAGE_COPY        (16)
+#define VMSTAT_PAGE_READAHEAD        (17)
+#define VMSTAT_ZSWAP_STORE           (18)
+#define VMSTAT_ZSWAP_REJECT          (19)
+#define VMSTAT_ZSWAP_LOAD            (20)
+#define VMSTAT_ZSWAP_BYTES           (21)
+#define VMSTAT_PAGE_ALLOC            (22)
+#define VMSTAT_COW_COPY              (23)
+#define VMSTAT_PAGE_ZEROED           (24)
+#define VMSTAT_SWAP_IN_USEC          (25)
+#define VMSTAT_SWAP_OUT_USEC         (26)
+#define VMSTAT_TLB_SHOOTDOWN         (27)
+#define VMSTAT_RECLAIM_PAGES         (28)
+#define VMSTAT_COUNT                 (29)
+
+#endif /* _KERN_VMSTATS_H_ */
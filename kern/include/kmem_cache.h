@@ -0,0 +1,55 @@
+#ifndef _KMEM_CACHE_H_
+#define _KMEM_CACHE_H_
+
+/*
+ * Object caches.
+ *
+ * A cache hands out objects of one type, packed into one-page slabs
+ * at their own size rather than kmalloc's next power of two. An
+ * optional constructor puts each object into a constructed state
+ * when its slab is made, and the destructor undoes that when the slab
+ * is given back. In between, objects keep that state across free and
+ * alloc: whatever the constructor sets up, such as spinlocks, list
+ * nodes or arrays, users of the cache don't redo, and must leave as
+ * they found it when they free the object.
+ */
+
+#include "opt-A3.h"
+
+#if OPT_A3
+
+struct kmem_cache;
+
+/*
+ * Create a cache of SIZE-byte objects. NAME, which should be a string
+ * constant, is for statistics. CTOR and DTOR may be NULL; they must
+ * not sleep or allocate from the same cache.
+ */
+struct kmem_cache *kmem_cache_create(const char *name, size_t size,
+				     void (*ctor)(void *obj),
+				     void (*dtor)(void *obj));
+
+/*
+ * Destroy a cache. Every object must have been freed, and nothing may
+ * be reaping caches at the same time.
+ */
+void kmem_cache_destroy(struct kmem_cache *kc);
+
+/* Get a constructed object, or NULL if out of memory. */
+void *kmem_cache_alloc(struct kmem_cache *kc);
+
+/* Give back an object, in its constructed state. */
+void kmem_cache_free(struct kmem_cache *kc, void *obj);
+
+/*
+ * Free the empty slabs every cache keeps for its next allocations;
+ * called when memory is short.
+ */
+void kmem_cache_reap(void);
+
+/* Print statistics for every cache; called from kheap_printstats. */
+void kmem_cache_printstats(void);
+
+#endif /* OPT_A3 */
+
+#endif /* _KMEM_CACHE_H_ */
@@ -126,6 +126,8 @@ uint32_t random(void);
 void *kmalloc(size_t size);
 void kfree(void *ptr);
 void kheap_printstats(void);
+/* Top MAXSITES kmalloc callers, if built with "options kheapprof". */
+void kheap_printsites(unsigned maxsites);
 
 /*
  * C string functions. 
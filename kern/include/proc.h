@@ -39,6 +39,7 @@
 #include <spinlock.h>
 #include <thread.h> /* required for struct threadarray */
 #include "opt-A2.h"
+#include "opt-A3.h"
 #include <synch.h>
 
 struct addrspace;
@@ -55,6 +56,10 @@ struct zombie{
     pid_t pid;
     int exit_code;
 };
+#if OPT_A3
+/* Where struct zombies come from, instead of kmalloc */
+extern struct kmem_cache *zombie_cache;
+#endif
 #endif
 
 struct proc {
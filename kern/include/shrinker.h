@@ -0,0 +1,60 @@
+#ifndef _SHRINKER_H_
+#define _SHRINKER_H_
+
+/*
+ * Memory reclaim callbacks.
+ *
+ * Anything that holds on to memory it could do without - caches,
+ * pools of free objects - registers a shrinker. When alloc_kpages is
+ * about to fail, it calls the shrinkers in turn and tries again; and
+ * when free memory drops below SHRINK_LOWWATER frames, a background
+ * thread calls them until it is back above SHRINK_HIGHWATER.
+ *
+ * A shrinker is asked to give back NPAGES pages and returns how many
+ * it thinks it freed; an estimate will do. It is called with no
+ * spinlocks held and may sleep, but it may be running on behalf of a
+ * thread that holds sleep locks of its own, so it must not wait for
+ * anything that might be waiting for memory, or call into other
+ * subsystems that take their own locks. Work of that kind, such as
+ * dropping vnode references, goes in the shrinker's deferred
+ * callback, which only the background thread calls, with nothing
+ * held, each time it wakes up.
+ *
+ * A thread running shrinkers has t_reclaiming set, and
+ * shrink_memory does nothing in such a thread, so a shrinker that
+ * allocates or frees memory can't end up calling itself again. Code
+ * that must not have shrinkers run under it for other reasons, such
+ * as holding a lock a shrinker takes, can set it too.
+ */
+
+#include "opt-A3.h"
+
+#if OPT_A3
+
+#define SHRINKER_MAX       8     /* registered shrinkers */
+#define SHRINK_LOWWATER    32    /* wake the thread below this... */
+#define SHRINK_HIGHWATER   64    /* ...and let it sleep above this */
+
+/*
+ * Add a shrinker. NAME is for messages; DEFERRED may be NULL.
+ * Shrinkers are registered once at boot and stay registered.
+ */
+void shrinker_register(const char *name, unsigned (*shrink)(unsigned npages),
+		       void (*deferred)(void));
+
+/* Start the background thread. Call once from vm_bootstrap. */
+void shrinker_bootstrap(void);
+
+/*
+ * Call the shrinkers until NPAGES pages have been freed or all have
+ * been tried; returns the number freed. Returns 0 at once if the
+ * caller can't sleep or is itself a shrinker.
+ */
+unsigned shrink_memory(unsigned npages);
+
+/* Free memory is low: wake the background thread. Safe anywhere. */
+void shrinker_kick(void);
+
+#endif /* OPT_A3 */
+
+#endif /* _SHRINKER_H_ */
@@ -0,0 +1,61 @@
+#ifndef _SWAP_H_
+#define _SWAP_H_
+
+/*
+ * Backing store for evicted user pages.
+ *
+ * Swap space is a raw disk (lhd) or a plain file, divided into
+ * page-sized slots that are handed out from a bitmap. A slot holds
+ * exactly one page and belongs to exactly one page table entry.
+ * In front of the device is a pool of compressed pages in memory
+ * (zswap.h), whose slots are handed out the same way.
+ */
+
+#include "opt-A3.h"
+
+#if OPT_A3
+
+/* Used at boot; "swapon" in the menu switches to another device. */
+#define SWAP_DEFAULT_DEVICE  "lhd0raw:"
+
+/* Size of a swap file that is created empty. */
+#define SWAP_FILE_SIZE       (8*1024*1024)
+
+/* Call once from vm_bootstrap, after the devices are attached. */
+void swap_bootstrap(void);
+
+/* Close the swap device; call before the filesystems go away. */
+void swap_shutdown(void);
+
+/*
+ * Switch swap to PATH, which is opened (or created, for a file).
+ * Fails with EBUSY if the current device has slots in use.
+ */
+int swap_setdevice(const char *path);
+
+/* True if there is a swap device at all. */
+bool swap_enabled(void);
+
+/*
+ * Write the page at PADDR to a free slot, in the compressed pool if
+ * it fits there, and return the slot number in SLOT. Fails with
+ * ENOSPC when swap is full.
+ */
+int swap_out(paddr_t paddr, unsigned *slot);
+
+/*
+ * Read SLOT into the frame at PADDR. The slot stays allocated, so a
+ * page that is not written to can be evicted again for free; give it
+ * up with swap_free once the page is dirtied.
+ */
+int swap_in(unsigned slot, paddr_t paddr);
+
+/* Give up SLOT without reading it. */
+void swap_free(unsigned slot);
+
+/* Copy SLOT to a newly allocated slot, for fork. */
+int swap_dup(unsigned slot, unsigned *newslot);
+
+#endif /* OPT_A3 */
+
+#endif /* _SWAP_H_ */
@@ -36,6 +36,15 @@
 
 
 #include <spinlock.h>
+#include "opt-A3.h"
+
+#if OPT_A3
+/*
+ * Set up the object caches semaphores, locks and CVs come from. Call
+ * once during system startup, before anything creates one.
+ */
+void synch_bootstrap(void);
+#endif
 
 /*
  * Dijkstra-style semaphore.
@@ -28,6 +28,7 @@
  */
 
 #include "opt-A2.h"
+#include "opt-A3.h"
 
 #ifndef _TEST_H_
 #define _TEST_H_
@@ -70,6 +71,20 @@ int uwlocktest1(int, char **);
 int uwvmstatstest(int, char **);
 #endif
 
+#if OPT_A3
+/* Page allocator scaling benchmark */
+int coremaptest(int, char **);
+/* kmalloc test and scaling benchmark */
+int kmalloctest(int, char **);
+/*
+ * Run FUNC(threadnum) in 1, 2, ... MAXTHREADS threads and print the
+ * rate of OPSPERTHREAD operations (UNIT) per thread for each count.
+ */
+void scaletest_run(const char *name, unsigned maxthreads,
+		   void (*func)(unsigned long num), unsigned long opsperthread,
+		   const char *unit);
+#endif
+
 /* filesystem tests */
 int fstest(int, char **);
 int readstress(int, char **);
@@ -0,0 +1,49 @@
+#ifndef _TEXTCACHE_H_
+#define _TEXTCACHE_H_
+
+/*
+ * Shared cache of read-only executable pages.
+ *
+ * A page of a read-only segment that comes entirely from the file is
+ * the same in every process that runs that file, so its frame is kept
+ * here, keyed by (vnode, file offset), and mapped read-only into all
+ * of them. The cache holds one reference to each frame and to each
+ * vnode it has pages of. Frames nobody maps any more stay cached
+ * until memory runs short and textcache_reclaim hands them back.
+ */
+
+#include "opt-A3.h"
+
+#if OPT_A3
+
+struct vnode;
+
+/* Call once from vm_bootstrap, after the coremap is up. */
+void textcache_bootstrap(void);
+
+/*
+ * Look up the page at OFFSET in V. Returns its frame with a new
+ * reference for the caller, or 0 if it isn't cached.
+ */
+paddr_t textcache_get(struct vnode *v, off_t offset);
+
+/*
+ * Offer PADDR, a frame the caller has just filled from OFFSET in V,
+ * to the cache. Returns the frame the caller should map, with a
+ * reference for it: PADDR, or the copy someone else put there first,
+ * in which case PADDR is freed. If the cache can't take the frame,
+ * PADDR comes back still private (refcount 1).
+ */
+paddr_t textcache_put(struct vnode *v, off_t offset, paddr_t paddr);
+
+/*
+ * Drop a cached page that no address space maps and return its frame,
+ * still allocated, for reuse. Returns 0 if every cached page is in use.
+ * The cache's reference to the vnode is dropped later, by the
+ * shrinker thread.
+ */
+paddr_t textcache_reclaim(void);
+
+#endif /* OPT_A3 */
+
+#endif /* _TEXTCACHE_H_ */
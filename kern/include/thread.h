@@ -39,6 +39,7 @@
 #include <array.h>
 #include <spinlock.h>
 #include <threadlist.h>
+#include "opt-A3.h"
 
 struct cpu;
 
@@ -104,6 +105,9 @@ struct thread {
 	/*
 	 * Public fields
 	 */
+#if OPT_A3
+	bool t_reclaiming;		/* Running shrinkers (shrinker.h) */
+#endif
 
 	/* add more here as needed */
 };
@@ -124,6 +128,11 @@ void thread_bootstrap(void);
 /* Call late in system startup to get secondary CPUs running. */
 void thread_start_cpus(void);
 
+#if OPT_A3
+/* Number of CPUs that have been started. */
+unsigned thread_numcpus(void);
+#endif
+
 /* Call during panic to stop other threads in their tracks */
 void thread_panic(void);
 
@@ -10,9 +10,12 @@
 /* Tracks stats on user programs */
 
 /* NOTE !!!!!! WARNING !!!!!
+ * Each cpu counts in its own array; reading sums them up. No locks.
  * All of the functions (except vmstats_print) whose names begin with '_'
  * assume that atomicity is ensured elsewhere
- * (i.e., outside of these routines) by acquiring stats_lock.
+ * (i.e., outside of these routines) by having interrupts off,
+ * e.g. by holding a spinlock, so that the thread can't be
+ * interrupted or moved to another cpu.
  * All of the functions whose names do not begin
  * with '_' ensure atomicity locally (except vmstats_print).
  *
@@ -21,27 +24,13 @@
  */
 
 
-/* These are the different stats that get tracked.
- * See vmstats.c for strings corresponding to each stat.
- */
-
-/* DO NOT ADD OR CHANGE WITHOUT ALSO CHANGING vmstats.h */
-#define VMSTAT_TLB_FAULT              (0)
-#define VMSTAT_TLB_FAULT_FREE         (1)
-#define VMSTAT_TLB_FAULT_REPLACE      (2)
-#define VMSTAT_TLB_INVALIDATE         (3)
-#define VMSTAT_TLB_RELOAD             (4)
-#define VMSTAT_PAGE_FAULT_ZERO        (5)
-#define VMSTAT_PAGE_FAULT_DISK        (6)
-#define VMSTAT_ELF_FILE_READ          (7)
-#define VMSTAT_SWAP_FILE_READ         (8)
-#define VMSTAT_SWAP_FILE_WRITE        (9)
-#define VMSTAT_COUNT                 (10)
+/* The stats that get tracked are in <kern/vmstats.h>, for userland. */
+#include <kern/vmstats.h>
 
 /* ----------------------------------------------------------------------- */
 
 /* Initialize the statistics: must be called before using */
-void vmstats_init(void);                     /* uses locking */
+void vmstats_init(void);                     /* turns interrupts off */
 void _vmstats_init(void);                    /* atomicity must be ensured elsewhere */
 
 /* Increment the specified count 
@@ -49,9 +38,18 @@ void _vmstats_init(void);                    /* atomicity must be ensured elsewh
  *   vmstats_inc(VMSTAT_TLB_FAULT);
  *   vmstats_inc(VMSTAT_PAGE_FAULT_ZERO);
  */
-void vmstats_inc(unsigned int index);    /* uses locking */
+void vmstats_inc(unsigned int index);    /* turns interrupts off */
 void _vmstats_inc(unsigned int index);   /* atomicity must be ensured elsewhere */
 
+/* Add AMOUNT to the specified count, for stats that count bytes */
+void vmstats_add(unsigned int index, unsigned int amount);    /* turns interrupts off */
+void _vmstats_add(unsigned int index, unsigned int amount);   /* atomicity must be ensured elsewhere */
+
+/* Sum the counts of all cpus into COUNTS, which has VMSTAT_COUNT entries.
+ * The cpus keep counting meanwhile, so this is only a snapshot.
+ */
+void vmstats_snapshot(unsigned int *counts);
+
 /* Print the statistics: assumes that at least vmstats_init has been called */
 void vmstats_print(void);                    /* Does NOT use locking */
 
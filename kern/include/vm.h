@@ -38,6 +38,7 @@
 
 
 #include <machine/vm.h>
+#include "opt-A3.h"
 
 /* Fault-type arguments to vm_fault() */
 #define VM_FAULT_READ        0    /* A read was attempted */
@@ -59,5 +60,20 @@ void free_kpages(vaddr_t addr);
 void vm_tlbshootdown_all(void);
 void vm_tlbshootdown(const struct tlbshootdown *);
 
+#if OPT_A3
+/*
+ * Background work for an idle cpu, called from the idle loop at
+ * splhigh, a bounded amount at a time. Returns false if there was
+ * none, in which case the cpu goes to sleep.
+ */
+bool vm_idle(void);
+
+/*
+ * Turn on kmalloc's per-cpu caches. Called from vm_bootstrap once the
+ * coremap is up; until then every kmalloc takes the shared lock.
+ */
+void kmalloc_bootstrap(void);
+#endif
+
 
 #endif /* _VM_H_ */
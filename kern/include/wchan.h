@@ -35,8 +35,18 @@
  */
 
 
+#include "opt-A3.h"
+
 struct wchan; /* Opaque */
 
+#if OPT_A3
+/*
+ * Set up the object cache wait channels come from. Call once during
+ * system startup, before anything creates one.
+ */
+void wchan_bootstrap(void);
+#endif
+
 /*
  * Create a wait channel. Use NAME as a symbolic name for the channel.
  * NAME should be a string constant; if not, the caller is responsible
@@ -0,0 +1,60 @@
+#ifndef _ZSWAP_H_
+#define _ZSWAP_H_
+
+/*
+ * Compressed swap.
+ *
+ * A pool of kernel frames, set aside at boot, that holds evicted
+ * pages compressed. Each pool frame is cut into equal objects of one
+ * size class, a multiple of ZSWAP_CLASSSIZE, and a compressed page
+ * goes in an object of the smallest class it fits. Pages that don't
+ * compress to ZSWAP_MAXSIZE, or that find the pool full, go to the
+ * swap device instead.
+ *
+ * Objects are named by slot numbers from ZSWAP_SLOTBASE up, above
+ * any slot of the swap device, so swap.c can hand them out as swap
+ * slots and nobody else has to know which is which.
+ */
+
+#include "opt-A3.h"
+
+#if OPT_A3
+
+/* First slot number of the pool; swap devices use the ones below. */
+#define ZSWAP_SLOTBASE     0x80000
+
+/* The pool gets 1/ZSWAP_POOLDIV of free memory, up to ZSWAP_MAXPOOL. */
+#define ZSWAP_POOLDIV      8
+#define ZSWAP_MAXPOOL      512
+
+/* Size classes, and the largest compressed page worth keeping. */
+#define ZSWAP_CLASSSIZE    256
+#define ZSWAP_NCLASSES     8
+#define ZSWAP_MAXSIZE      (ZSWAP_CLASSSIZE * ZSWAP_NCLASSES)
+#define ZSWAP_MAXOBJS      (PAGE_SIZE / ZSWAP_CLASSSIZE)
+
+/* Call once from swap_bootstrap, after the coremap is up. */
+void zswap_bootstrap(void);
+
+/* True if SLOT is one of ours rather than the swap device's. */
+bool zswap_isslot(unsigned slot);
+
+/*
+ * Compress the page at PAGE into the pool and return its slot in
+ * SLOT. Fails with ENOSPC if it doesn't compress well enough or the
+ * pool is full.
+ */
+int zswap_store(const void *page, unsigned *slot);
+
+/* Uncompress SLOT into PAGE. The slot stays allocated, as in swap_in. */
+int zswap_load(unsigned slot, void *page);
+
+/* Give up SLOT. */
+void zswap_free(unsigned slot);
+
+/* Copy SLOT to a new slot, for fork. ENOSPC if the pool is full. */
+int zswap_dup(unsigned slot, unsigned *newslot);
+
+#endif /* OPT_A3 */
+
+#endif /* _ZSWAP_H_ */
@@ -51,6 +51,10 @@
 #include <synch.h>
 #include <kern/fcntl.h>
 #include "opt-A2.h"
+#include "opt-A3.h"
+#if OPT_A3
+#include <kmem_cache.h>
+#endif
 
 /*
  * The process for the kernel; this holds all the kernel-only threads.
@@ -74,6 +78,37 @@ struct semaphore *no_proc_sem;
 static pid_t curpid;
 static struct lock *lock_pid = NULL;
 #endif
+
+#if OPT_A3
+static struct kmem_cache *proc_cache;
+#if OPT_A2
+struct kmem_cache *zombie_cache;
+#endif
+
+/*
+ * Constructed state of procs: p_lock initialized and p_threads empty.
+ * The thread array keeps its storage from one proc to the next.
+ */
+static
+void
+proc_ctor(void *obj)
+{
+	struct proc *proc = obj;
+
+	threadarray_init(&proc->p_threads);
+	spinlock_init(&proc->p_lock);
+}
+
+static
+void
+proc_dtor(void *obj)
+{
+	struct proc *proc = obj;
+
+	threadarray_cleanup(&proc->p_threads);
+	spinlock_cleanup(&proc->p_lock);
+}
+#endif
 /*
  * Create a proc structure.
  */
@@ -84,18 +119,28 @@ proc_create(const char *name)
 
 	struct proc *proc;
 
+#if OPT_A3
+	proc = kmem_cache_alloc(proc_cache);
+#else
 	proc = kmalloc(sizeof(*proc));
+#endif
 	if (proc == NULL) {
 		return NULL;
 	}
 	proc->p_name = kstrdup(name);
 	if (proc->p_name == NULL) {
+#if OPT_A3
+		kmem_cache_free(proc_cache, proc);
+#else
 		kfree(proc);
+#endif
 		return NULL;
 	}
 
+#if !OPT_A3
 	threadarray_init(&proc->p_threads);
 	spinlock_init(&proc->p_lock);
+#endif
 
 	/* VM fields */
 	proc->p_addrspace = NULL;
@@ -206,7 +251,11 @@ proc_destroy(struct proc *proc)
     array_destroy(proc->children);
     while(array_num(proc->zomchildren) != 0){
           struct zombie *curzom = array_get(proc->zomchildren, 0);
+#if OPT_A3
+          kmem_cache_free(zombie_cache, curzom);
+#else
           kfree(curzom);
+#endif
           array_remove(proc->zomchildren, 0);
     }
     //cv_destroy(proc->myparent);
@@ -225,11 +274,20 @@ proc_destroy(struct proc *proc)
     lock_destroy(proc->lock_parent);
     lock_destroy(proc->zomlock);
 #endif
+#if OPT_A3
+	/* Back to the cache as the constructor left it */
+	KASSERT(threadarray_num(&proc->p_threads) == 0);
+	spinlock_cleanup(&proc->p_lock);
+
+	kfree(proc->p_name);
+	kmem_cache_free(proc_cache, proc);
+#else
 	threadarray_cleanup(&proc->p_threads);
 	spinlock_cleanup(&proc->p_lock);
 
 	kfree(proc->p_name);
 	kfree(proc);
+#endif
 
 #ifdef UW
 	/* decrement the process count */
@@ -255,6 +313,20 @@ proc_destroy(struct proc *proc)
 void
 proc_bootstrap(void)
 {
+#if OPT_A3
+  proc_cache = kmem_cache_create("proc", sizeof(struct proc),
+				 proc_ctor, proc_dtor);
+  if (proc_cache == NULL) {
+    panic("proc_bootstrap: Out of memory\n");
+  }
+#if OPT_A2
+  zombie_cache = kmem_cache_create("zombie", sizeof(struct zombie),
+				   NULL, NULL);
+  if (zombie_cache == NULL) {
+    panic("proc_bootstrap: Out of memory\n");
+  }
+#endif
+#endif
 #if OPT_A2
     curpid = 1;
 #endif
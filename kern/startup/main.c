@@ -42,6 +42,7 @@
 #include <proc.h>
 #include <current.h>
 #include <synch.h>
+#include <wchan.h>
 #include <vm.h>
 #include <mainbus.h>
 #include <vfs.h>
@@ -50,6 +51,11 @@
 #include <test.h>
 #include <version.h>
 #include "autoconf.h"  // for pseudoconfig
+#include "opt-A3.h"
+#if OPT_A3
+#include <uw-vmstats.h>
+#include <swap.h>
+#endif
 
 
 /*
@@ -107,6 +113,10 @@ boot(void)
 
 	/* Early initialization. */
 	ram_bootstrap();
+#if OPT_A3
+	wchan_bootstrap();
+	synch_bootstrap();
+#endif
 	proc_bootstrap();
 	thread_bootstrap();
 	hardclock_bootstrap();
@@ -149,10 +159,16 @@ shutdown(void)
 	
 	vfs_clearbootfs();
 	vfs_clearcurdir();
+#if OPT_A3
+	swap_shutdown();
+#endif
 	vfs_unmountall();
 
 	thread_shutdown();
 
+#if OPT_A3
+	vmstats_print();
+#endif
 	splhigh();
 }
 
@@ -46,6 +46,12 @@
 #include "opt-sfs.h"
 #include "opt-net.h"
 #include "opt-A2.h"
+#include "opt-A3.h"
+#if OPT_A3
+#include <swap.h>
+#include <coremap.h>
+#include <uw-vmstats.h>
+#endif
 
 /*
  * In-kernel menu and command dispatcher.
@@ -391,12 +397,89 @@ cmd_bootfs(int nargs, char **args)
 	return vfs_setbootfs(device);
 }
 
+#if OPT_A3
+/*
+ * Command to change the swap device.
+ *
+ * The argument is a raw disk like lhd1raw: or a file like
+ * emu0:SWAPFILE. Only possible while nothing is swapped out.
+ */
+static
+int
+cmd_swapon(int nargs, char **args)
+{
+	if (nargs != 2) {
+		kprintf("Usage: swapon device-or-file\n");
+		return EINVAL;
+	}
+
+	return swap_setdevice(args[1]);
+}
+
+/*
+ * Command to choose the page replacement policy, for comparing the
+ * clock against FIFO and random replacement with the vmstats counters.
+ */
+static
+int
+cmd_vmpolicy(int nargs, char **args)
+{
+	if (nargs == 2 && !strcmp(args[1], "clock")) {
+		coremap_setpolicy(CM_POLICY_CLOCK);
+	}
+	else if (nargs == 2 && !strcmp(args[1], "fifo")) {
+		coremap_setpolicy(CM_POLICY_FIFO);
+	}
+	else if (nargs == 2 && !strcmp(args[1], "random")) {
+		coremap_setpolicy(CM_POLICY_RANDOM);
+	}
+	else {
+		kprintf("Usage: vmpolicy clock|fifo|random\n");
+		return EINVAL;
+	}
+
+	return 0;
+}
+
+/*
+ * Command to print the VM statistics, or to zero them before a run.
+ */
+static
+int
+cmd_vmstats(int nargs, char **args)
+{
+	if (nargs == 1) {
+		vmstats_print();
+	}
+	else if (nargs == 2 && !strcmp(args[1], "reset")) {
+		vmstats_init();
+	}
+	else {
+		kprintf("Usage: vmstats [reset]\n");
+		return EINVAL;
+	}
+
+	return 0;
+}
+#endif
+
 static
 int
 cmd_kheapstats(int nargs, char **args)
 {
-	(void)nargs;
-	(void)args;
+	unsigned maxsites = 10;
+
+	if (nargs > 1 && !strcmp(args[1], "sites")) {
+		if (nargs > 2) {
+			maxsites = atoi(args[2]);
+		}
+		kheap_printsites(maxsites);
+		return 0;
+	}
+	if (nargs > 1) {
+		kprintf("Usage: kh [sites [n]]\n");
+		return EINVAL;
+	}
 
 	kheap_printstats();
 	
@@ -442,6 +525,11 @@ static const char *opsmenu[] = {
 	"[cd]      Change directory          ",
 	"[pwd]     Print current directory   ",
 	"[sync]    Sync filesystems          ",
+#if OPT_A3
+	"[swapon]  Set swap device or file   ",
+	"[vmpolicy] Set page replacement     ",
+	"[vmstats] Print VM statistics       ",
+#endif
 	"[panic]   Intentional panic         ",
 	"[q]       Quit and shut down        ",
 	NULL
@@ -476,6 +564,10 @@ static const char *testmenu[] = {
 	"[uw1] UW lock test          (1)     ",
 	"[uw2] UW vmstats test       (3)     ",
 #endif // UW
+#if OPT_A3
+	"[cm1] Coremap scaling test  (3)     ",
+	"[km3] kmalloc magazine test (3)     ",
+#endif
 	"[fs1] Filesystem test               ",
 	"[fs2] FS read stress        (4)     ",
 	"[fs3] FS write stress       (4)     ",
@@ -511,7 +603,7 @@ static const char *mainmenu[] = {
 	"[sp3] Traffic                       ",
 #endif /* UW */
 #endif
-	"[kh] Kernel heap stats              ",
+	"[kh] Kernel heap stats [sites [n]]  ",
 	"[q] Quit and shut down              ",
 	NULL
 };
@@ -565,6 +657,11 @@ static struct {
 	{ "cd",		cmd_chdir },
 	{ "pwd",	cmd_pwd },
 	{ "sync",	cmd_sync },
+#if OPT_A3
+	{ "swapon",	cmd_swapon },
+	{ "vmpolicy",	cmd_vmpolicy },
+	{ "vmstats",	cmd_vmstats },
+#endif
 	{ "panic",	cmd_panic },
 	{ "q",		cmd_quit },
 	{ "exit",	cmd_quit },
@@ -602,6 +699,10 @@ static struct {
 	{ "uw1",	uwlocktest1 },
 	{ "uw2",	uwvmstatstest },
 #endif
+#if OPT_A3
+	{ "cm1",	coremaptest },
+	{ "km3",	kmalloctest },
+#endif
 
 	/* file system assignment tests */
 	{ "fs1",	fstest },
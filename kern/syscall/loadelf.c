@@ -59,6 +59,9 @@
 #include <addrspace.h>
 #include <vnode.h>
 #include <elf.h>
+#include "opt-A3.h"
+
+#if !OPT_A3
 
 /*
  * Load a segment at virtual address VADDR. The segment in memory
@@ -144,6 +147,7 @@ load_segment(struct addrspace *as, struct vnode *v,
 	
 	return result;
 }
+#endif /* !OPT_A3 */
 
 /*
  * Load an ELF executable user program into the current address space.
@@ -243,6 +247,20 @@ load_elf(struct vnode *v, vaddr_t *entrypoint)
 			return ENOEXEC;
 		}
 
+#if OPT_A3
+		/*
+		 * Nothing is copied in here any more, so uiomove won't
+		 * catch a segment in kernel space; check by hand.
+		 */
+		if (ph.p_vaddr + ph.p_memsz < ph.p_vaddr ||
+		    ph.p_vaddr + ph.p_memsz > USERSPACETOP) {
+			return ENOEXEC;
+		}
+		if (ph.p_filesz > ph.p_memsz) {
+			kprintf("ELF: warning: segment filesize > segment memsize\n");
+			ph.p_filesz = ph.p_memsz;
+		}
+#endif
 		result = as_define_region(as,
 					  ph.p_vaddr, ph.p_memsz,
 					  ph.p_flags & PF_R,
@@ -251,6 +269,14 @@ load_elf(struct vnode *v, vaddr_t *entrypoint)
 		if (result) {
 			return result;
 		}
+#if OPT_A3
+		/* The contents are paged in from V by vm_fault. */
+		result = as_define_file(as, v, ph.p_vaddr, ph.p_offset,
+					ph.p_filesz);
+		if (result) {
+			return result;
+		}
+#endif
 	}
 
 	result = as_prepare_load(as);
@@ -258,6 +284,7 @@ load_elf(struct vnode *v, vaddr_t *entrypoint)
 		return result;
 	}
 
+#if !OPT_A3
 	/*
 	 * Now actually load each segment.
 	 */
@@ -295,6 +322,7 @@ load_elf(struct vnode *v, vaddr_t *entrypoint)
 			return result;
 		}
 	}
+#endif
 
 	result = as_complete_load(as);
 	if (result) {
@@ -11,11 +11,15 @@
 #include <copyinout.h>
 
 #include "opt-A2.h"
+#include "opt-A3.h"
 #include <mips/trapframe.h>
 #include <kern/fcntl.h>
 #include <vm.h>
 #include <vfs.h>
 #include <test.h>
+#if OPT_A3
+#include <kmem_cache.h>
+#endif
   /* this implementation of sys__exit does not do anything with the exit code */
   /* this needs to be fixed to get exit() and waitpid() working properly */
 
@@ -37,7 +41,11 @@ void sys__exit(int exitcode) {
       }
       lock_acquire(curproc->parent->zomlock);
       //lock_release(curproc->parent->lock_parent);
+#if OPT_A3
+      struct zombie *zomchild = kmem_cache_alloc(zombie_cache);
+#else
       struct zombie *zomchild = kmalloc(sizeof(struct zombie));
+#endif
       zomchild->pid = curproc->pid;
       zomchild->exit_code = exitcode;
       //lock_acquire(curproc->parent->zomlock);
@@ -0,0 +1,220 @@
+/*
+ * Memory management system calls.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/mman.h>
+#include <lib.h>
+#include <copyinout.h>
+#include <proc.h>
+#include <current.h>
+#include <addrspace.h>
+#include <syscall.h>
+#include <uw-vmstats.h>
+
+/* Pages mincore looks at per copyout. */
+#define MINCORE_BATCH  128
+
+/*
+ * sbrk: move the end of the heap by AMOUNT bytes and return where it
+ * was before. AMOUNT may be negative.
+ */
+int
+sys_sbrk(intptr_t amount, vaddr_t *retval)
+{
+	struct addrspace *as;
+
+	as = curproc_getas();
+	if (as == NULL) {
+		return ENOMEM;
+	}
+	return as_sbrk(as, amount, retval);
+}
+
+/*
+ * Round LEN up to whole pages; 0 if it is 0 or too large to map.
+ */
+static
+size_t
+mmap_npages(size_t len)
+{
+	if (len == 0 || len > USERSPACETOP) {
+		return 0;
+	}
+	return DIVROUNDUP(len, PAGE_SIZE);
+}
+
+/*
+ * mmap: map LEN bytes of zero-filled memory with protection PROT.
+ * There is no file table (write only knows the console), so there
+ * are no files to map yet: FLAGS must include MAP_ANON, and FD and
+ * OFFSET are ignored. MAP_SHARED is refused, since fork would still
+ * give the child a copy-on-write copy.
+ */
+int
+sys_mmap(userptr_t addr, size_t len, int prot, int flags, int fd,
+	 off_t offset, vaddr_t *retval)
+{
+	struct addrspace *as;
+	int sharing = flags & (MAP_SHARED | MAP_PRIVATE);
+	size_t npages;
+
+	(void)fd;
+	(void)offset;
+
+	as = curproc_getas();
+	if (as == NULL) {
+		return ENOMEM;
+	}
+	if ((prot & ~(PROT_READ | PROT_WRITE | PROT_EXEC)) != 0 ||
+	    (flags & ~(MAP_SHARED | MAP_PRIVATE | MAP_FIXED | MAP_ANON)) != 0 ||
+	    (sharing != MAP_SHARED && sharing != MAP_PRIVATE)) {
+		return EINVAL;
+	}
+	if ((flags & MAP_ANON) == 0) {
+		return EBADF;
+	}
+	if (sharing == MAP_SHARED) {
+		return EUNIMP;
+	}
+	npages = mmap_npages(len);
+	if (npages == 0) {
+		return len == 0 ? EINVAL : ENOMEM;
+	}
+	return as_mmap(as, (vaddr_t)addr, npages, prot,
+		       (flags & MAP_FIXED) != 0, retval);
+}
+
+/*
+ * munmap: remove the pages from ADDR to ADDR+LEN. Pages in the range
+ * that aren't mapped are skipped; ones not made by mmap are EINVAL.
+ */
+int
+sys_munmap(userptr_t addr, size_t len)
+{
+	struct addrspace *as;
+	size_t npages;
+
+	as = curproc_getas();
+	if (as == NULL) {
+		return EINVAL;
+	}
+	npages = mmap_npages(len);
+	if (npages == 0) {
+		return EINVAL;
+	}
+	return as_munmap(as, (vaddr_t)addr, npages);
+}
+
+/*
+ * mprotect: change the protection of the mmapped pages from ADDR to
+ * ADDR+LEN, which must all be mapped, to PROT.
+ */
+int
+sys_mprotect(userptr_t addr, size_t len, int prot)
+{
+	struct addrspace *as;
+	size_t npages;
+
+	as = curproc_getas();
+	if (as == NULL) {
+		return ENOMEM;
+	}
+	if ((prot & ~(PROT_READ | PROT_WRITE | PROT_EXEC)) != 0) {
+		return EINVAL;
+	}
+	npages = mmap_npages(len);
+	if (npages == 0) {
+		return len == 0 ? EINVAL : ENOMEM;
+	}
+	return as_mprotect(as, (vaddr_t)addr, npages, prot);
+}
+
+/*
+ * madvise: act on ADVICE for the pages from ADDR to ADDR+LEN, which
+ * must all be mapped. WILLNEED reads them in and DONTNEED frees
+ * them; the rest set the read-ahead policy.
+ */
+int
+sys_madvise(userptr_t addr, size_t len, int advice)
+{
+	struct addrspace *as;
+
+	as = curproc_getas();
+	if (as == NULL) {
+		return ENOMEM;
+	}
+	if (len == 0) {
+		return ((vaddr_t)addr & ~(vaddr_t)PAGE_FRAME) ? EINVAL : 0;
+	}
+	if (len > USERSPACETOP) {
+		return ENOMEM;
+	}
+	return as_madvise(as, (vaddr_t)addr, mmap_npages(len), advice);
+}
+
+/*
+ * mincore: fill in one byte of VEC for each page from ADDR to
+ * ADDR+LEN, MINCORE_INCORE if the page is in memory.
+ */
+int
+sys_mincore(userptr_t addr, size_t len, userptr_t vec)
+{
+	struct addrspace *as;
+	unsigned char buf[MINCORE_BATCH];
+	size_t npages, done, n;
+	int result;
+
+	as = curproc_getas();
+	if (as == NULL) {
+		return ENOMEM;
+	}
+	if (len == 0) {
+		return ((vaddr_t)addr & ~(vaddr_t)PAGE_FRAME) ? EINVAL : 0;
+	}
+	if (len > USERSPACETOP) {
+		return ENOMEM;
+	}
+	npages = mmap_npages(len);
+	for (done = 0; done < npages; done += n) {
+		n = npages - done;
+		if (n > MINCORE_BATCH) {
+			n = MINCORE_BATCH;
+		}
+		result = as_mincore(as, (vaddr_t)addr + done * PAGE_SIZE, n,
+				    buf);
+		if (result) {
+			return result;
+		}
+		result = copyout(buf, (userptr_t)((vaddr_t)vec + done), n);
+		if (result) {
+			return result;
+		}
+	}
+	return 0;
+}
+
+/*
+ * __vmstats: copy a snapshot of the VM statistics, summed over all
+ * cpus, into COUNTS, at most NCOUNTS of them. Returns how many there
+ * are, so a caller built against an older <kern/vmstats.h> still
+ * works and one built against a newer one can tell.
+ */
+int
+sys___vmstats(userptr_t counts, unsigned ncounts, int *retval)
+{
+	unsigned buf[VMSTAT_COUNT];
+	int result;
+
+	vmstats_snapshot(buf);
+	if (ncounts > VMSTAT_COUNT) {
+		ncounts = VMSTAT_COUNT;
+	}
+	result = copyout(buf, counts, ncounts * sizeof(buf[0]));
+	if (result) {
+		return result;
+	}
+	*retval = VMSTAT_COUNT;
+	return 0;
+}
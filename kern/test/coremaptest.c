@@ -0,0 +1,74 @@
+/*
+ * Page allocator scaling test.
+ *
+ * Runs 1, 2, ... N threads that each allocate and free single pages
+ * as fast as they can and reports the aggregate pages per second.
+ * N defaults to the number of cpus. With the per-cpu frame magazines
+ * the rate should grow with the thread count instead of flattening
+ * out on coremap_lock.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <thread.h>
+#include <vm.h>
+#include <test.h>
+
+#define CMT_ITERATIONS  2000
+#define CMT_BATCH       8       /* pages held at once per thread */
+
+static volatile unsigned cmt_failures;
+
+static
+void
+cmt_thread(unsigned long num)
+{
+	vaddr_t pages[CMT_BATCH];
+	unsigned i, j;
+
+	(void)num;
+
+	for (i=0; i<CMT_ITERATIONS; i++) {
+		for (j=0; j<CMT_BATCH; j++) {
+			pages[j] = alloc_kpages(1);
+			if (pages[j] == 0) {
+				cmt_failures++;
+			}
+		}
+		for (j=0; j<CMT_BATCH; j++) {
+			if (pages[j] != 0) {
+				free_kpages(pages[j]);
+			}
+		}
+	}
+}
+
+int
+coremaptest(int nargs, char **args)
+{
+	unsigned maxthreads;
+
+	maxthreads = thread_numcpus();
+	if (nargs > 1) {
+		maxthreads = atoi(args[1]);
+	}
+	if (maxthreads == 0) {
+		kprintf("Usage: cm1 [maxthreads]\n");
+		return EINVAL;
+	}
+
+	cmt_failures = 0;
+
+	kprintf("Starting coremap scaling test (%u cpus)...\n",
+		thread_numcpus());
+	scaletest_run("cmt", maxthreads, cmt_thread,
+		      CMT_ITERATIONS * CMT_BATCH, "pages");
+
+	if (cmt_failures > 0) {
+		kprintf("cm1: %u failed allocations\n", cmt_failures);
+	}
+	kprintf("coremaptest done.\n");
+
+	return 0;
+}
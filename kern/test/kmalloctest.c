@@ -0,0 +1,123 @@
+/*
+ * kmalloc test with the magazine layer in front.
+ *
+ * Each thread repeatedly allocates a batch of blocks of assorted
+ * sizes, fills every byte of each with a pattern of its own, checks
+ * all the patterns once the batch is complete, and frees the blocks
+ * in a different order from the one they came in. A block handed out
+ * twice, one too small, or one still in use by another thread shows
+ * up as a broken pattern.
+ *
+ * This runs with 1, 2, ... N threads (N defaults to the number of
+ * cpus) and reports the rate for each, which should grow with the
+ * number of threads.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <thread.h>
+#include <test.h>
+
+#define KMT_ITERATIONS  500
+#define KMT_BATCH       16      /* blocks held at once per thread */
+
+/* Sizes to cycle through: both sides of each block size, and pages. */
+static const size_t kmt_sizes[] = {
+	1, 8, 15, 16, 17, 31, 60, 64, 100, 127, 128, 255,
+	300, 511, 512, 997, 1024, 1500, 2040, 2048, 3000, 5000,
+};
+#define KMT_NSIZES (sizeof(kmt_sizes) / sizeof(kmt_sizes[0]))
+
+static volatile unsigned kmt_failures;
+static volatile unsigned kmt_errors;
+
+static
+unsigned char
+kmt_pattern(unsigned long num, unsigned i, unsigned j, size_t k)
+{
+	return (unsigned char)(num * 131 + i * 31 + j * 7 + k);
+}
+
+static
+void
+kmt_thread(unsigned long num)
+{
+	unsigned char *blocks[KMT_BATCH];
+	size_t sizes[KMT_BATCH];
+	unsigned i, j, n;
+	size_t k;
+
+	for (i=0; i<KMT_ITERATIONS; i++) {
+		for (j=0; j<KMT_BATCH; j++) {
+			sizes[j] = kmt_sizes[(num + i + j * 5) % KMT_NSIZES];
+			blocks[j] = kmalloc(sizes[j]);
+			if (blocks[j] == NULL) {
+				kmt_failures++;
+				continue;
+			}
+			if ((vaddr_t)blocks[j] % sizeof(uint64_t) != 0) {
+				kprintf("km3: %p: misaligned\n", blocks[j]);
+				kmt_errors++;
+			}
+			for (k=0; k<sizes[j]; k++) {
+				blocks[j][k] = kmt_pattern(num, i, j, k);
+			}
+		}
+
+		for (j=0; j<KMT_BATCH; j++) {
+			if (blocks[j] == NULL) {
+				continue;
+			}
+			for (k=0; k<sizes[j]; k++) {
+				if (blocks[j][k] != kmt_pattern(num, i, j, k)) {
+					kprintf("km3: %p (%lu bytes): byte %lu "
+						"overwritten\n", blocks[j],
+						(unsigned long)sizes[j],
+						(unsigned long)k);
+					kmt_errors++;
+					break;
+				}
+			}
+		}
+
+		/* Free every third one, round and round. */
+		for (j=0, n=i % KMT_BATCH; j<KMT_BATCH; j++) {
+			kfree(blocks[n]);
+			n = (n + 3) % KMT_BATCH;
+		}
+	}
+}
+
+int
+kmalloctest(int nargs, char **args)
+{
+	unsigned maxthreads;
+
+	maxthreads = thread_numcpus();
+	if (nargs > 1) {
+		maxthreads = atoi(args[1]);
+	}
+	if (maxthreads == 0) {
+		kprintf("Usage: km3 [maxthreads]\n");
+		return EINVAL;
+	}
+
+	kmt_failures = 0;
+	kmt_errors = 0;
+
+	kprintf("Starting kmalloc magazine test (%u cpus)...\n",
+		thread_numcpus());
+	scaletest_run("kmt", maxthreads, kmt_thread,
+		      KMT_ITERATIONS * KMT_BATCH, "kmalloc/kfree pairs");
+
+	if (kmt_failures > 0) {
+		kprintf("km3: %u allocations failed\n", kmt_failures);
+	}
+	if (kmt_errors > 0) {
+		kprintf("km3: %u errors; test failed\n", kmt_errors);
+		return EINVAL;
+	}
+	kprintf("kmalloctest done.\n");
+	return 0;
+}
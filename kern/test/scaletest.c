@@ -0,0 +1,82 @@
+/*
+ * Driver for the allocator scaling benchmarks.
+ *
+ * Runs a test's thread function in 1, 2, ... N threads at once and
+ * prints the aggregate rate for each thread count. The function
+ * itself decides what an operation is and checks its own results.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <clock.h>
+#include <thread.h>
+#include <synch.h>
+#include <test.h>
+
+struct scaletest {
+	void (*st_func)(unsigned long num);
+	struct semaphore *st_donesem;
+};
+
+static
+void
+scaletest_thread(void *stv, unsigned long num)
+{
+	struct scaletest *st = stv;
+
+	st->st_func(num);
+	V(st->st_donesem);
+}
+
+void
+scaletest_run(const char *name, unsigned maxthreads,
+	      void (*func)(unsigned long num), unsigned long opsperthread,
+	      const char *unit)
+{
+	struct scaletest st;
+	unsigned nthreads, i;
+	time_t secs1, secs2, secs;
+	uint32_t nsecs1, nsecs2, nsecs;
+	uint64_t usecs, nops;
+	char tname[32];
+	int result;
+
+	st.st_func = func;
+	st.st_donesem = sem_create(name, 0);
+	if (st.st_donesem == NULL) {
+		panic("%s: sem_create failed\n", name);
+	}
+
+	for (nthreads=1; nthreads<=maxthreads; nthreads++) {
+		gettime(&secs1, &nsecs1);
+
+		for (i=0; i<nthreads; i++) {
+			snprintf(tname, sizeof(tname), "%s %u", name, i);
+			result = thread_fork(tname, NULL, scaletest_thread,
+					     &st, i);
+			if (result) {
+				panic("%s: thread_fork failed: %s\n", name,
+				      strerror(result));
+			}
+		}
+		for (i=0; i<nthreads; i++) {
+			P(st.st_donesem);
+		}
+
+		gettime(&secs2, &nsecs2);
+		getinterval(secs1, nsecs1, secs2, nsecs2, &secs, &nsecs);
+
+		usecs = (uint64_t)secs * 1000000 + nsecs / 1000;
+		if (usecs == 0) {
+			usecs = 1;
+		}
+		nops = (uint64_t)nthreads * opsperthread;
+
+		kprintf("%2u thread(s): %lu %s in %lu.%06lu s: %lu/sec\n",
+			nthreads, (unsigned long)nops, unit,
+			(unsigned long)secs, (unsigned long)(nsecs / 1000),
+			(unsigned long)(nops * 1000000 / usecs));
+	}
+
+	sem_destroy(st.st_donesem);
+}
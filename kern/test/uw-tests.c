@@ -7,9 +7,14 @@
  */
 
 #include <types.h>
+#include <lib.h>
+#include <spl.h>
+#include <cpu.h>
+#include <current.h>
 #include <synch.h>
 #include <thread.h>
 #include <test.h>
+#include <platform/maxcpus.h>
 #include <uw-vmstats.h>
 
 #define NAME_LEN (30)
@@ -170,6 +175,9 @@ uwlocktest1(int nargs, char **args)
 
 /*-----------------------------------------------------------------------*/
 
+/* Which cpus' rows the threads counted in */
+static volatile bool vmstats_cpus_used[MAXCPUS];
+
 /* Each thread makes some calls to vmstats functions */
 static
 void
@@ -177,6 +185,7 @@ vmstats_thread(void *junk, unsigned long num)
 {
 	int i;
 	int j;
+	int spl;
 	(void)num;
 	(void)junk;
 
@@ -218,36 +227,109 @@ vmstats_thread(void *junk, unsigned long num)
             }
             break;
 
-          /* VMSTAT_PAGE_FAULT_DISK = VMSTAT_ELF_FILE_READ + VMSTAT_SWAP_FILE_READ */
+          /* VMSTAT_PAGE_FAULT_DISK + VMSTAT_PAGE_READAHEAD =
+           *   VMSTAT_ELF_FILE_READ + VMSTAT_SWAP_FILE_READ + VMSTAT_ZSWAP_LOAD
+           */
           case VMSTAT_PAGE_FAULT_DISK:
             if (i % 2 == 0) {
                vmstats_inc(j);
             }
             break;
 
+          /* Read-ahead pages come from the ELF file too */
+          case VMSTAT_PAGE_READAHEAD:
+            if (i % 8 == 0) {
+               vmstats_inc(j);
+            }
+            break;
+
           case VMSTAT_ELF_FILE_READ:
             if (i % 4 == 0) {
                vmstats_inc(j);
             }
+            if (i % 8 == 0) {
+               vmstats_inc(j);
+            }
             break;
 
+          /* Half the swap reads come from compressed swap instead */
           case VMSTAT_SWAP_FILE_READ:
-            if (i % 4 == 0) {
+            if (i % 8 == 0) {
                vmstats_inc(j);
             }
             break;
 
+          case VMSTAT_ZSWAP_LOAD:
+            if (i % 8 == 4) {
+               vmstats_inc(j);
+            }
+            break;
+
+          /* Half a page per compressed store, for a ratio of 2 */
+          case VMSTAT_ZSWAP_BYTES:
+            if (i % 4 == 0) {
+               vmstats_add(j, 2048);
+            }
+            break;
+
           case VMSTAT_SWAP_FILE_WRITE:
             if (i % 8 == 0) {
                vmstats_inc(j);
             }
             break;
 
+          /* Counters that are not part of any of the sums */
+          case VMSTAT_EVICT_CLEAN:
+          case VMSTAT_EVICT_DIRTY:
+          case VMSTAT_CLOCK_SECOND_CHANCE:
+          case VMSTAT_ZERO_POOL_HIT:
+          case VMSTAT_ZERO_POOL_MISS:
+          case VMSTAT_ZERO_PAGE_MAP:
+          case VMSTAT_ZERO_PAGE_COPY:
+          case VMSTAT_ZSWAP_STORE:
+          case VMSTAT_ZSWAP_REJECT:
+          case VMSTAT_PAGE_ALLOC:
+          case VMSTAT_COW_COPY:
+          case VMSTAT_PAGE_ZEROED:
+          case VMSTAT_TLB_SHOOTDOWN:
+          case VMSTAT_RECLAIM_PAGES:
+            if (i % 4 == 0) {
+               vmstats_inc(j);
+            }
+            break;
+
+          /* So the averages come out at 100 */
+          case VMSTAT_SWAP_IN_USEC:
+            if (i % 8 == 0 || i % 8 == 4) {
+               vmstats_add(j, 100);
+            }
+            break;
+
+          case VMSTAT_SWAP_OUT_USEC:
+            if (i % 8 == 0) {
+               vmstats_add(j, 100);
+            }
+            if (i % 4 == 0) {
+               vmstats_add(j, 100);
+            }
+            break;
+
+          /* Anything else is counted once per loop */
           default:
-            kprintf("Unknown stat %d\n", j);
+            vmstats_inc(j);
             break;
       }
     }
+
+    /* Note which cpu's row that went into, and give the others a
+     * chance to take some of the threads.
+     */
+    spl = splhigh();
+    vmstats_cpus_used[curcpu->c_number] = true;
+    splx(spl);
+    if (i % 64 == 0) {
+      thread_yield();
+    }
 	}
 
 	V(donesem);
@@ -257,8 +339,9 @@ vmstats_thread(void *junk, unsigned long num)
 int
 uwvmstatstest(int nargs, char **args)
 {
-	int i, result;
+	int i, result, ncpus;
   char name[NAME_LEN];
+  unsigned int counts[VMSTAT_COUNT];
 
 	(void)nargs;
 	(void)args;
@@ -268,6 +351,9 @@ uwvmstatstest(int nargs, char **args)
 
   kprintf("Initializing vmstats\n");
   vmstats_init();
+  for (i=0; i<MAXCPUS; i++) {
+    vmstats_cpus_used[i] = false;
+  }
 
 	for (i=0; i<NTESTTHREADS; i++) {
     snprintf(name, NAME_LEN, "vmstatsthread %d", i);
@@ -284,6 +370,20 @@ uwvmstatstest(int nargs, char **args)
 
   vmstats_print();
 
+  /* The rows must add up to what all the threads counted */
+  vmstats_snapshot(counts);
+  if (counts[VMSTAT_TLB_FAULT] != 2 * NTESTLOOPS * NTESTTHREADS) {
+    kprintf("WARNING: TLB Faults (%u) != %d\n", counts[VMSTAT_TLB_FAULT],
+      2 * NTESTLOOPS * NTESTTHREADS);
+  }
+  ncpus = 0;
+  for (i=0; i<MAXCPUS; i++) {
+    if (vmstats_cpus_used[i]) {
+      ncpus++;
+    }
+  }
+  kprintf("vmstats counted on %d of %u cpus\n", ncpus, thread_numcpus());
+
 	cleanitems();
 	kprintf("uwvmstatstest done.\n");
 
@@ -39,6 +39,70 @@
 #include <thread.h>
 #include <current.h>
 #include <synch.h>
+#include "opt-A3.h"
+#if OPT_A3
+#include <kmem_cache.h>
+
+static struct kmem_cache *sem_cache;
+static struct kmem_cache *lock_cache;
+static struct kmem_cache *cv_cache;
+
+/*
+ * Constructed state of semaphores and locks: spinlock initialized,
+ * and for locks, not held. Destroying either checks that it is still
+ * so.
+ */
+static
+void
+sem_ctor(void *obj)
+{
+	struct semaphore *sem = obj;
+
+	spinlock_init(&sem->sem_lock);
+}
+
+static
+void
+lock_ctor(void *obj)
+{
+	struct lock *lock = obj;
+
+	lock->owner = NULL;
+	lock->held = false;
+	spinlock_init(&lock->spin);
+}
+
+static
+void
+sem_dtor(void *obj)
+{
+	struct semaphore *sem = obj;
+
+	spinlock_cleanup(&sem->sem_lock);
+}
+
+static
+void
+lock_dtor(void *obj)
+{
+	struct lock *lock = obj;
+
+	spinlock_cleanup(&lock->spin);
+}
+
+void
+synch_bootstrap(void)
+{
+	sem_cache = kmem_cache_create("semaphore", sizeof(struct semaphore),
+				      sem_ctor, sem_dtor);
+	lock_cache = kmem_cache_create("lock", sizeof(struct lock),
+				       lock_ctor, lock_dtor);
+	cv_cache = kmem_cache_create("cv", sizeof(struct cv), NULL, NULL);
+	if (sem_cache == NULL || lock_cache == NULL || cv_cache == NULL) {
+		panic("synch_bootstrap: Out of memory\n");
+	}
+}
+#endif
 
 ////////////////////////////////////////////////////////////
 //
@@ -51,25 +115,39 @@ sem_create(const char *name, int initial_count)
 
         KASSERT(initial_count >= 0);
 
+#if OPT_A3
+        sem = kmem_cache_alloc(sem_cache);
+#else
         sem = kmalloc(sizeof(struct semaphore));
+#endif
         if (sem == NULL) {
                 return NULL;
         }
 
         sem->sem_name = kstrdup(name);
         if (sem->sem_name == NULL) {
+#if OPT_A3
+                kmem_cache_free(sem_cache, sem);
+#else
                 kfree(sem);
+#endif
                 return NULL;
         }
 
 	sem->sem_wchan = wchan_create(sem->sem_name);
 	if (sem->sem_wchan == NULL) {
 		kfree(sem->sem_name);
+#if OPT_A3
+		kmem_cache_free(sem_cache, sem);
+#else
 		kfree(sem);
+#endif
 		return NULL;
 	}
 
+#if !OPT_A3
 	spinlock_init(&sem->sem_lock);
+#endif
         sem->sem_count = initial_count;
 
         return sem;
@@ -84,7 +162,11 @@ sem_destroy(struct semaphore *sem)
 	spinlock_cleanup(&sem->sem_lock);
 	wchan_destroy(sem->sem_wchan);
         kfree(sem->sem_name);
+#if OPT_A3
+        kmem_cache_free(sem_cache, sem);
+#else
         kfree(sem);
+#endif
 }
 
 void 
@@ -152,22 +234,32 @@ lock_create(const char *name)
 {
         struct lock *lock;
 
+#if OPT_A3
+        lock = kmem_cache_alloc(lock_cache);
+#else
         lock = kmalloc(sizeof(struct lock));
+#endif
         if (lock == NULL) {
                 return NULL;
         }
 
         lock->lk_name = kstrdup(name);
         if (lock->lk_name == NULL) {
+#if OPT_A3
+                kmem_cache_free(lock_cache, lock);
+#else
                 kfree(lock);
+#endif
                 return NULL;
         }
         
 
         // add stuff here as needed
+#if !OPT_A3
         lock->owner = NULL;
         lock->held = false;
         spinlock_init(&lock->spin);
+#endif
         lock->wc = wchan_create(lock->lk_name);
         return lock;
 }
@@ -181,7 +273,13 @@ lock_destroy(struct lock *lock)
         spinlock_cleanup(&lock->spin);
         wchan_destroy(lock->wc);
         kfree(lock->lk_name);
+#if OPT_A3
+        //back to the cache as the constructor left it
+        KASSERT(!lock->held && lock->owner == NULL);
+        kmem_cache_free(lock_cache, lock);
+#else
         kfree(lock);
+#endif
 }
 
 void
@@ -241,14 +339,22 @@ cv_create(const char *name)
 {
         struct cv *cv;
 
+#if OPT_A3
+        cv = kmem_cache_alloc(cv_cache);
+#else
         cv = kmalloc(sizeof(struct cv));
+#endif
         if (cv == NULL) {
                 return NULL;
         }
 
         cv->cv_name = kstrdup(name);
         if (cv->cv_name==NULL) {
+#if OPT_A3
+                kmem_cache_free(cv_cache, cv);
+#else
                 kfree(cv);
+#endif
                 return NULL;
         }
         
@@ -266,7 +372,11 @@ cv_destroy(struct cv *cv)
         // add stuff here as needed
         wchan_destroy(cv->wc);
         kfree(cv->cv_name);
+#if OPT_A3
+        kmem_cache_free(cv_cache, cv);
+#else
         kfree(cv);
+#endif
 }
 
 void
@@ -52,6 +52,11 @@
 #include <vnode.h>
 
 #include "opt-synchprobs.h"
+#include "opt-A3.h"
+#if OPT_A3
+#include <uw-vmstats.h>
+#include <kmem_cache.h>
+#endif
 
 
 /* Magic number used as a guard value on kernel thread stacks. */
@@ -72,6 +77,48 @@ static struct cpuarray allcpus;
 /* Used to wait for secondary CPUs to come online. */
 static struct semaphore *cpu_startup_sem;
 
+#if OPT_A3
+static struct kmem_cache *thread_cache;
+static struct kmem_cache *wchan_cache;
+
+/*
+ * Constructed state of threads: machine-dependent part and list node
+ * initialized. thread_destroy checks they still are.
+ */
+static
+void
+thread_ctor(void *obj)
+{
+	struct thread *thread = obj;
+
+	thread_machdep_init(&thread->t_machdep);
+	threadlistnode_init(&thread->t_listnode, thread);
+}
+
+/*
+ * Constructed state of wait channels: empty and unlocked.
+ */
+static
+void
+wchan_ctor(void *obj)
+{
+	struct wchan *wc = obj;
+
+	spinlock_init(&wc->wc_lock);
+	threadlist_init(&wc->wc_threads);
+}
+
+static
+void
+wchan_dtor(void *obj)
+{
+	struct wchan *wc = obj;
+
+	spinlock_cleanup(&wc->wc_lock);
+	threadlist_cleanup(&wc->wc_threads);
+}
+#endif
+
 ////////////////////////////////////////////////////////////
 
 /*
@@ -123,22 +170,32 @@ thread_create(const char *name)
 
 	DEBUGASSERT(name != NULL);
 
+#if OPT_A3
+	thread = kmem_cache_alloc(thread_cache);
+#else
 	thread = kmalloc(sizeof(*thread));
+#endif
 	if (thread == NULL) {
 		return NULL;
 	}
 
 	thread->t_name = kstrdup(name);
 	if (thread->t_name == NULL) {
+#if OPT_A3
+		kmem_cache_free(thread_cache, thread);
+#else
 		kfree(thread);
+#endif
 		return NULL;
 	}
 	thread->t_wchan_name = "NEW";
 	thread->t_state = S_READY;
 
 	/* Thread subsystem fields */
+#if !OPT_A3
 	thread_machdep_init(&thread->t_machdep);
 	threadlistnode_init(&thread->t_listnode, thread);
+#endif
 	thread->t_stack = NULL;
 	thread->t_context = NULL;
 	thread->t_cpu = NULL;
@@ -149,6 +206,10 @@ thread_create(const char *name)
 	thread->t_curspl = IPL_HIGH;
 	thread->t_iplhigh_count = 1; /* corresponding to t_curspl */
 
+#if OPT_A3
+	thread->t_reclaiming = false;
+#endif
+
 	/* If you add to struct thread, be sure to initialize here */
 
 	return thread;
@@ -259,7 +320,11 @@ thread_destroy(struct thread *thread)
 	thread->t_wchan_name = "DESTROYED";
 
 	kfree(thread->t_name);
+#if OPT_A3
+	kmem_cache_free(thread_cache, thread);
+#else
 	kfree(thread);
+#endif
 }
 
 /*
@@ -349,6 +414,14 @@ thread_bootstrap(void)
 	struct cpu *bootcpu;
 	struct thread *bootthread;
 
+#if OPT_A3
+	thread_cache = kmem_cache_create("thread", sizeof(struct thread),
+					 thread_ctor, NULL);
+	if (thread_cache == NULL) {
+		panic("thread_bootstrap: Out of memory\n");
+	}
+#endif
+
 	cpuarray_init(&allcpus);
 
 	/*
@@ -426,6 +499,17 @@ thread_start_cpus(void)
 	cpu_startup_sem = NULL;
 }
 
+#if OPT_A3
+/*
+ * Number of cpus in the system.
+ */
+unsigned
+thread_numcpus(void)
+{
+	return cpuarray_num(&allcpus);
+}
+#endif
+
 /*
  * Make a thread runnable.
  *
@@ -635,7 +719,14 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 		next = threadlist_remhead(&curcpu->c_runqueue);
 		if (next == NULL) {
 			spinlock_release(&curcpu->c_runqueue_lock);
+#if OPT_A3
+			/* Only sleep once the VM has nothing to do. */
+			if (!vm_idle()) {
+				cpu_idle();
+			}
+#else
 			cpu_idle();
+#endif
 			spinlock_acquire(&curcpu->c_runqueue_lock);
 		}
 	} while (next == NULL);
@@ -971,17 +1062,36 @@ thread_consider_migration(void)
  * arrangements should be made to free it after the wait channel is
  * destroyed.
  */
+#if OPT_A3
+void
+wchan_bootstrap(void)
+{
+	wchan_cache = kmem_cache_create("wchan", sizeof(struct wchan),
+					wchan_ctor, wchan_dtor);
+	if (wchan_cache == NULL) {
+		panic("wchan_bootstrap: Out of memory\n");
+	}
+}
+#endif
+
 struct wchan *
 wchan_create(const char *name)
 {
 	struct wchan *wc;
 
+#if OPT_A3
+	wc = kmem_cache_alloc(wchan_cache);
+	if (wc == NULL) {
+		return NULL;
+	}
+#else
 	wc = kmalloc(sizeof(*wc));
 	if (wc == NULL) {
 		return NULL;
 	}
 	spinlock_init(&wc->wc_lock);
 	threadlist_init(&wc->wc_threads);
+#endif
 	wc->wc_name = name;
 	return wc;
 }
@@ -995,7 +1105,11 @@ wchan_destroy(struct wchan *wc)
 {
 	spinlock_cleanup(&wc->wc_lock);
 	threadlist_cleanup(&wc->wc_threads);
+#if OPT_A3
+	kmem_cache_free(wchan_cache, wc);
+#else
 	kfree(wc);
+#endif
 }
 
 /*
@@ -1148,7 +1262,14 @@ ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping)
 	spinlock_acquire(&target->c_ipi_lock);
 
 	n = target->c_numshootdown;
+#if OPT_A3
+	if (n == TLBSHOOTDOWN_ALL) {
+		/* already flushing everything */
+	}
+	else if (n == TLBSHOOTDOWN_MAX) {
+#else
 	if (n == TLBSHOOTDOWN_MAX) {
+#endif
 		target->c_numshootdown = TLBSHOOTDOWN_ALL;
 	}
 	else {
@@ -1162,6 +1283,63 @@ ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping)
 	spinlock_release(&target->c_ipi_lock);
 }
 
+#if OPT_A3
+/*
+ * Invalidate MAPPINGS[0..N) here and on each other cpu whose number is
+ * set in CPUMASK. The other cpus do it from their IPI handler; we
+ * poll until each has cleared its pending bit, with interrupts on so
+ * that a cpu doing the same to us is not stuck. Interrupts are off
+ * while sending so we can't change cpus between doing our own TLB
+ * and picking whom to send to. More than TLBSHOOTDOWN_MAX mappings
+ * become one full flush.
+ */
+void
+ipi_tlbshootdown_cpus(const struct tlbshootdown *mappings, unsigned n,
+		      uint32_t cpumask)
+{
+	unsigned i, j;
+	struct cpu *c, *self;
+	bool pending;
+	int spl;
+
+	spl = splhigh();
+	self = curcpu->c_self;
+	if (n > TLBSHOOTDOWN_MAX) {
+		vm_tlbshootdown_all();
+	}
+	else {
+		for (j=0; j<n; j++) {
+			vm_tlbshootdown(&mappings[j]);
+		}
+	}
+	for (i=0; i < cpuarray_num(&allcpus); i++) {
+		c = cpuarray_get(&allcpus, i);
+		if (c == self || (cpumask & (1U << c->c_number)) == 0) {
+			continue;
+		}
+		/* The one past TLBSHOOTDOWN_MAX turns them into ALL. */
+		for (j=0; j<n && j<=TLBSHOOTDOWN_MAX; j++) {
+			ipi_tlbshootdown(c, &mappings[j]);
+			_vmstats_inc(VMSTAT_TLB_SHOOTDOWN);
+		}
+	}
+	splx(spl);
+
+	for (i=0; i < cpuarray_num(&allcpus); i++) {
+		c = cpuarray_get(&allcpus, i);
+		if (c == self || (cpumask & (1U << c->c_number)) == 0) {
+			continue;
+		}
+		do {
+			spinlock_acquire(&c->c_ipi_lock);
+			pending = (c->c_ipi_pending &
+				   ((uint32_t)1 << IPI_TLBSHOOTDOWN)) != 0;
+			spinlock_release(&c->c_ipi_lock);
+		} while (pending);
+	}
+}
+#endif
+
 void
 interprocessor_interrupt(void)
 {
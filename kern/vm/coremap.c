@@ -0,0 +1,876 @@
+/*
+ * Buddy-system physical page allocator.
+ *
+ * The frames handed out start just past the coremap itself. Frame
+ * numbers below are relative to that base, so a block of order k
+ * always starts at a frame number that is a multiple of 2^k and its
+ * buddy is found by flipping bit k.
+ *
+ * Runs that are not a power of two long are carved out of the next
+ * larger block and the unused tail is given straight back, so
+ * alloc_kpages(3) costs three frames and not four.
+ *
+ * Single frames, which is almost everything user address spaces ask
+ * for, go through a small per-cpu magazine first. A magazine is only
+ * ever locked by its own cpu except when memory is short and another
+ * cpu drains it, so the common path never touches coremap_lock. Empty
+ * magazines are refilled and full ones drained FRAME_BATCH frames at
+ * a time under one acquisition of coremap_lock.
+ *
+ * Idle cpus also keep a pool of frames that are already zeroed, for
+ * callers that would otherwise bzero a fresh frame themselves. The
+ * pool only grows while plenty of memory is free, and gives its
+ * frames up to anyone once nothing else is left.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <cpu.h>
+#include <current.h>
+#include <wchan.h>
+#include <vm.h>
+#include <coremap.h>
+#include <platform/maxcpus.h>
+
+static struct spinlock coremap_lock = SPINLOCK_INITIALIZER;
+
+static struct coremap_entry *coremap;
+static unsigned coremap_nframes;    /* frames managed */
+static paddr_t coremap_base;        /* physical address of frame 0 */
+static unsigned coremap_nfree;
+
+static int32_t freelists[COREMAP_MAXORDER + 1];
+
+static bool have_coremap = false;
+
+/* Threads waiting for a pinned frame. */
+static struct wchan *coremap_wchan;
+
+/* Where coremap_pick_victim looks next, and how it chooses. */
+static unsigned coremap_hand;
+static unsigned coremap_policy = CM_POLICY_CLOCK;
+
+#define FRAME_MAGAZINE_SIZE  32
+#define FRAME_BATCH          16
+
+struct frame_magazine {
+	struct spinlock fm_lock;
+	unsigned fm_count;
+	paddr_t fm_frames[FRAME_MAGAZINE_SIZE];
+};
+
+static struct frame_magazine magazines[MAXCPUS];
+
+#define ZEROPOOL_SIZE     64
+#define ZEROPOOL_RESERVE  (4 * ZEROPOOL_SIZE)  /* free frames to leave */
+
+static struct spinlock zeropool_lock = SPINLOCK_INITIALIZER;
+static paddr_t zeropool[ZEROPOOL_SIZE];
+static unsigned zeropool_count;
+
+#define FRAME_TO_PADDR(f)  (coremap_base + (paddr_t)(f) * PAGE_SIZE)
+#define PADDR_TO_FRAME(pa) (((pa) - coremap_base) / PAGE_SIZE)
+
+////////////////////////////////////////
+
+static
+void
+freelist_push(int32_t frame, unsigned order)
+{
+	struct coremap_entry *e = &coremap[frame];
+
+	e->cm_state = CM_FREE;
+	e->cm_order = order;
+	e->cm_prev = -1;
+	e->cm_next = freelists[order];
+	if (freelists[order] >= 0) {
+		coremap[freelists[order]].cm_prev = frame;
+	}
+	freelists[order] = frame;
+}
+
+static
+void
+freelist_remove(int32_t frame)
+{
+	struct coremap_entry *e = &coremap[frame];
+
+	KASSERT(e->cm_state == CM_FREE);
+	if (e->cm_prev >= 0) {
+		coremap[e->cm_prev].cm_next = e->cm_next;
+	}
+	else {
+		freelists[e->cm_order] = e->cm_next;
+	}
+	if (e->cm_next >= 0) {
+		coremap[e->cm_next].cm_prev = e->cm_prev;
+	}
+	e->cm_state = CM_TAIL;
+	e->cm_next = e->cm_prev = -1;
+}
+
+/*
+ * Return the block of 2^ORDER frames at FRAME to the free lists,
+ * merging it with its buddy for as long as the buddy is also free.
+ */
+static
+void
+buddy_free(int32_t frame, unsigned order)
+{
+	int32_t buddy;
+
+	while (order < COREMAP_MAXORDER) {
+		buddy = frame ^ (1 << order);
+		if ((unsigned)buddy + (1 << order) > coremap_nframes ||
+		    coremap[buddy].cm_state != CM_FREE ||
+		    coremap[buddy].cm_order != order) {
+			break;
+		}
+		freelist_remove(buddy);
+		if (buddy < frame) {
+			frame = buddy;
+		}
+		order++;
+	}
+	freelist_push(frame, order);
+}
+
+/*
+ * Free the run [FRAME, FRAME+NPAGES) by splitting it into the largest
+ * aligned blocks that fit.
+ */
+static
+void
+buddy_free_run(int32_t frame, unsigned long npages)
+{
+	unsigned order;
+
+	while (npages > 0) {
+		order = 0;
+		while (order < COREMAP_MAXORDER &&
+		       (frame & (1 << order)) == 0 &&
+		       (2UL << order) <= npages) {
+			order++;
+		}
+		buddy_free(frame, order);
+		frame += 1 << order;
+		npages -= 1UL << order;
+	}
+}
+
+////////////////////////////////////////
+
+void
+coremap_bootstrap(void)
+{
+	paddr_t lo, hi;
+	unsigned total, mappages, i;
+
+	ram_getsize(&lo, &hi);
+	total = (hi - lo) / PAGE_SIZE;
+
+	/* The coremap itself lives in the first frames of free memory. */
+	mappages = DIVROUNDUP(total * sizeof(struct coremap_entry), PAGE_SIZE);
+	KASSERT(mappages < total);
+
+	coremap = (struct coremap_entry *)PADDR_TO_KVADDR(lo);
+	coremap_base = lo + mappages * PAGE_SIZE;
+	coremap_nframes = total - mappages;
+	coremap_nfree = coremap_nframes;
+
+	for (i=0; i<=COREMAP_MAXORDER; i++) {
+		freelists[i] = -1;
+	}
+	for (i=0; i<coremap_nframes; i++) {
+		coremap[i].cm_state = CM_TAIL;
+		coremap[i].cm_order = 0;
+		coremap[i].cm_npages = 0;
+		coremap[i].cm_refcount = 0;
+		coremap[i].cm_busy = false;
+		coremap[i].cm_referenced = false;
+		coremap[i].cm_dirty = false;
+		coremap[i].cm_swapslot = -1;
+		coremap[i].cm_as = NULL;
+		coremap[i].cm_vaddr = 0;
+		coremap[i].cm_pte = NULL;
+		coremap[i].cm_kmalloc = NULL;
+		coremap[i].cm_next = coremap[i].cm_prev = -1;
+	}
+	buddy_free_run(0, coremap_nframes);
+
+	for (i=0; i<MAXCPUS; i++) {
+		spinlock_init(&magazines[i].fm_lock);
+		magazines[i].fm_count = 0;
+	}
+
+	have_coremap = true;
+
+	coremap_wchan = wchan_create("coremap");
+	if (coremap_wchan == NULL) {
+		panic("coremap_bootstrap: wchan_create failed\n");
+	}
+
+	kprintf("coremap: %u frames at 0x%x, %u pages of metadata\n",
+		coremap_nframes, coremap_base, mappages);
+}
+
+bool
+coremap_ready(void)
+{
+	return have_coremap;
+}
+
+/*
+ * Take a run of NPAGES frames off the buddy lists. Returns a frame
+ * number, or -1. Caller holds coremap_lock.
+ */
+static
+int32_t
+buddy_alloc(unsigned long npages)
+{
+	unsigned order, j;
+	int32_t frame;
+
+	KASSERT(spinlock_do_i_hold(&coremap_lock));
+	KASSERT(npages > 0);
+
+	order = 0;
+	while ((1UL << order) < npages) {
+		order++;
+	}
+	if (order > COREMAP_MAXORDER) {
+		return -1;
+	}
+
+	for (j=order; j<=COREMAP_MAXORDER && freelists[j] < 0; j++) {
+		/* nothing */
+	}
+	if (j > COREMAP_MAXORDER) {
+		return -1;
+	}
+
+	frame = freelists[j];
+	freelist_remove(frame);
+
+	/* Split down to the order we want, freeing the upper halves. */
+	while (j > order) {
+		j--;
+		freelist_push(frame + (1 << j), j);
+	}
+
+	coremap[frame].cm_state = CM_HEAD;
+	coremap[frame].cm_npages = npages;
+	coremap[frame].cm_refcount = 1;
+	for (j=1; j<npages; j++) {
+		coremap[frame + j].cm_state = CM_TAIL;
+	}
+
+	/* Give back the part of the block we don't need. */
+	if (npages < (1UL << order)) {
+		buddy_free_run(frame + npages, (1UL << order) - npages);
+	}
+
+	coremap_nfree -= npages;
+	return frame;
+}
+
+/*
+ * Release the allocated run starting at FRAME. Caller holds
+ * coremap_lock.
+ */
+static
+void
+buddy_release(int32_t frame)
+{
+	unsigned long npages;
+
+	KASSERT(spinlock_do_i_hold(&coremap_lock));
+
+	if (coremap[frame].cm_state != CM_HEAD) {
+		panic("coremap_free: 0x%x is not an allocated block\n",
+		      FRAME_TO_PADDR(frame));
+	}
+	KASSERT(coremap[frame].cm_as == NULL);
+	KASSERT(coremap[frame].cm_kmalloc == NULL);
+	KASSERT(!coremap[frame].cm_busy);
+	npages = coremap[frame].cm_npages;
+	coremap[frame].cm_npages = 0;
+	coremap[frame].cm_refcount = 0;
+	buddy_free_run(frame, npages);
+	coremap_nfree += npages;
+}
+
+/*
+ * Move up to FRAME_BATCH frames from magazine FM back to the buddy
+ * lists. Caller holds fm_lock.
+ */
+static
+void
+magazine_drain(struct frame_magazine *fm, unsigned batch)
+{
+	unsigned i;
+
+	KASSERT(spinlock_do_i_hold(&fm->fm_lock));
+
+	if (batch > fm->fm_count) {
+		batch = fm->fm_count;
+	}
+	spinlock_acquire(&coremap_lock);
+	for (i=0; i<batch; i++) {
+		fm->fm_count--;
+		buddy_release(PADDR_TO_FRAME(fm->fm_frames[fm->fm_count]));
+	}
+	spinlock_release(&coremap_lock);
+}
+
+/*
+ * Give every cached frame on every cpu back to the buddy lists, so
+ * that a failing multi-page allocation gets a chance to coalesce them.
+ */
+static
+void
+magazine_drain_all(void)
+{
+	unsigned i;
+
+	for (i=0; i<MAXCPUS; i++) {
+		spinlock_acquire(&magazines[i].fm_lock);
+		magazine_drain(&magazines[i], FRAME_MAGAZINE_SIZE);
+		spinlock_release(&magazines[i].fm_lock);
+	}
+}
+
+static
+paddr_t
+magazine_alloc(void)
+{
+	struct frame_magazine *fm;
+	int32_t frame;
+	paddr_t pa;
+
+	fm = &magazines[curcpu->c_number];
+	spinlock_acquire(&fm->fm_lock);
+
+	if (fm->fm_count == 0) {
+		/* Refill. */
+		spinlock_acquire(&coremap_lock);
+		while (fm->fm_count < FRAME_BATCH) {
+			frame = buddy_alloc(1);
+			if (frame < 0) {
+				break;
+			}
+			fm->fm_frames[fm->fm_count++] = FRAME_TO_PADDR(frame);
+		}
+		spinlock_release(&coremap_lock);
+
+		if (fm->fm_count == 0) {
+			spinlock_release(&fm->fm_lock);
+			return 0;
+		}
+	}
+
+	pa = fm->fm_frames[--fm->fm_count];
+	spinlock_release(&fm->fm_lock);
+	return pa;
+}
+
+static
+void
+magazine_free(paddr_t paddr)
+{
+	struct frame_magazine *fm;
+
+	fm = &magazines[curcpu->c_number];
+	spinlock_acquire(&fm->fm_lock);
+
+	if (fm->fm_count == FRAME_MAGAZINE_SIZE) {
+		magazine_drain(fm, FRAME_BATCH);
+	}
+	fm->fm_frames[fm->fm_count++] = paddr;
+
+	spinlock_release(&fm->fm_lock);
+}
+
+/*
+ * Take a frame out of the zeroed pool, or return 0 if it is empty.
+ */
+static
+paddr_t
+zeropool_take(void)
+{
+	paddr_t pa = 0;
+
+	spinlock_acquire(&zeropool_lock);
+	if (zeropool_count > 0) {
+		pa = zeropool[--zeropool_count];
+	}
+	spinlock_release(&zeropool_lock);
+	return pa;
+}
+
+/*
+ * Give every frame in the zeroed pool back to the buddy lists.
+ */
+static
+void
+zeropool_drain(void)
+{
+	spinlock_acquire(&zeropool_lock);
+	spinlock_acquire(&coremap_lock);
+	while (zeropool_count > 0) {
+		buddy_release(PADDR_TO_FRAME(zeropool[--zeropool_count]));
+	}
+	spinlock_release(&coremap_lock);
+	spinlock_release(&zeropool_lock);
+}
+
+paddr_t
+coremap_alloc(unsigned long npages)
+{
+	int32_t frame;
+	paddr_t pa;
+
+	if (npages == 1) {
+		pa = magazine_alloc();
+		if (pa == 0) {
+			/* Better a zeroed frame than none. */
+			pa = zeropool_take();
+		}
+		return pa;
+	}
+
+	spinlock_acquire(&coremap_lock);
+	frame = buddy_alloc(npages);
+	spinlock_release(&coremap_lock);
+
+	if (frame < 0) {
+		/* Frames sitting in magazines might complete a block. */
+		magazine_drain_all();
+		zeropool_drain();
+		spinlock_acquire(&coremap_lock);
+		frame = buddy_alloc(npages);
+		spinlock_release(&coremap_lock);
+		if (frame < 0) {
+			return 0;
+		}
+	}
+	return FRAME_TO_PADDR(frame);
+}
+
+void
+coremap_free(paddr_t paddr)
+{
+	int32_t frame;
+
+	KASSERT((paddr & PAGE_FRAME) == paddr);
+
+	/*
+	 * Pages stolen with ram_stealmem before the coremap existed
+	 * are below coremap_base; they are never reclaimed. The VM
+	 * system maps one of them, the zero page, into any number of
+	 * address spaces, so the calls below treat them as permanently
+	 * shared: always pinnable, never owned, dirty or on swap.
+	 */
+	if (paddr < coremap_base) {
+		return;
+	}
+
+	frame = PADDR_TO_FRAME(paddr);
+	KASSERT((unsigned)frame < coremap_nframes);
+
+	/*
+	 * A frame with one reference belongs to the caller alone, so
+	 * its entry can be read unlocked. Frames cached in a magazine
+	 * keep their count of one. User frames have to be disowned
+	 * before they are freed, and kmalloc pages forgotten.
+	 */
+	KASSERT(coremap[frame].cm_as == NULL);
+	KASSERT(coremap[frame].cm_kmalloc == NULL);
+	if (coremap[frame].cm_state == CM_HEAD &&
+	    coremap[frame].cm_npages == 1 &&
+	    coremap[frame].cm_refcount == 1) {
+		magazine_free(paddr);
+		return;
+	}
+
+	spinlock_acquire(&coremap_lock);
+	KASSERT(coremap[frame].cm_refcount > 0);
+	if (coremap[frame].cm_refcount > 1) {
+		coremap[frame].cm_refcount--;
+		spinlock_release(&coremap_lock);
+		return;
+	}
+	buddy_release(frame);
+	spinlock_release(&coremap_lock);
+}
+
+void
+coremap_incref(paddr_t paddr)
+{
+	int32_t frame;
+
+	if (paddr < coremap_base) {
+		return;
+	}
+	frame = PADDR_TO_FRAME(paddr);
+	KASSERT((unsigned)frame < coremap_nframes);
+
+	spinlock_acquire(&coremap_lock);
+	KASSERT(coremap[frame].cm_state == CM_HEAD);
+	KASSERT(coremap[frame].cm_refcount < 0xffff);
+	coremap[frame].cm_refcount++;
+	spinlock_release(&coremap_lock);
+}
+
+unsigned
+coremap_refcount(paddr_t paddr)
+{
+	int32_t frame;
+
+	if (paddr < coremap_base) {
+		return 0xffff;
+	}
+	frame = PADDR_TO_FRAME(paddr);
+	KASSERT((unsigned)frame < coremap_nframes);
+
+	/* Unlocked; callers only act on a count of one, see coremap.h. */
+	return coremap[frame].cm_refcount;
+}
+
+bool
+coremap_pin(paddr_t paddr, struct addrspace *as, vaddr_t vaddr)
+{
+	struct coremap_entry *e;
+
+	if (paddr < coremap_base) {
+		return true;
+	}
+	e = &coremap[PADDR_TO_FRAME(paddr)];
+
+	spinlock_acquire(&coremap_lock);
+	while (e->cm_busy) {
+		wchan_lock(coremap_wchan);
+		spinlock_release(&coremap_lock);
+		wchan_sleep(coremap_wchan);
+		spinlock_acquire(&coremap_lock);
+	}
+	if (e->cm_state != CM_HEAD ||
+	    (e->cm_as != NULL && (e->cm_as != as || e->cm_vaddr != vaddr))) {
+		spinlock_release(&coremap_lock);
+		return false;
+	}
+	e->cm_busy = true;
+	spinlock_release(&coremap_lock);
+	return true;
+}
+
+void
+coremap_unpin(paddr_t paddr)
+{
+	struct coremap_entry *e;
+
+	if (paddr < coremap_base) {
+		return;
+	}
+	e = &coremap[PADDR_TO_FRAME(paddr)];
+
+	spinlock_acquire(&coremap_lock);
+	KASSERT(e->cm_busy);
+	e->cm_busy = false;
+	wchan_wakeall(coremap_wchan);
+	spinlock_release(&coremap_lock);
+}
+
+void
+coremap_setowner(paddr_t paddr, struct addrspace *as, vaddr_t vaddr,
+		 paddr_t *pte)
+{
+	struct coremap_entry *e;
+
+	if (paddr < coremap_base) {
+		KASSERT(as == NULL);
+		return;
+	}
+	e = &coremap[PADDR_TO_FRAME(paddr)];
+
+	KASSERT(as == NULL || pte != NULL);
+	spinlock_acquire(&coremap_lock);
+	KASSERT(e->cm_state == CM_HEAD);
+	e->cm_as = as;
+	e->cm_vaddr = vaddr;
+	e->cm_pte = pte;
+	if (as == NULL && e->cm_busy) {
+		e->cm_busy = false;
+		wchan_wakeall(coremap_wchan);
+	}
+	spinlock_release(&coremap_lock);
+}
+
+static
+struct coremap_entry *
+coremap_user_entry(paddr_t paddr)
+{
+	unsigned frame;
+
+	KASSERT(paddr >= coremap_base);
+	frame = PADDR_TO_FRAME(paddr);
+	KASSERT(frame < coremap_nframes);
+	KASSERT(coremap[frame].cm_state == CM_HEAD);
+	return &coremap[frame];
+}
+
+void
+coremap_resetstate(paddr_t paddr)
+{
+	struct coremap_entry *e = coremap_user_entry(paddr);
+
+	e->cm_referenced = false;
+	e->cm_dirty = false;
+	e->cm_swapslot = -1;
+}
+
+void
+coremap_referenced(paddr_t paddr)
+{
+	if (paddr < coremap_base) {
+		return;
+	}
+	coremap_user_entry(paddr)->cm_referenced = true;
+}
+
+bool
+coremap_isdirty(paddr_t paddr)
+{
+	if (paddr < coremap_base) {
+		return false;
+	}
+	return coremap_user_entry(paddr)->cm_dirty;
+}
+
+int
+coremap_swapslot(paddr_t paddr)
+{
+	if (paddr < coremap_base) {
+		return -1;
+	}
+	return coremap_user_entry(paddr)->cm_swapslot;
+}
+
+void
+coremap_setswapslot(paddr_t paddr, int slot)
+{
+	struct coremap_entry *e = coremap_user_entry(paddr);
+
+	e->cm_dirty = false;
+	e->cm_swapslot = slot;
+}
+
+int
+coremap_markdirty(paddr_t paddr)
+{
+	struct coremap_entry *e = coremap_user_entry(paddr);
+	int slot;
+
+	slot = e->cm_swapslot;
+	e->cm_dirty = true;
+	e->cm_swapslot = -1;
+	return slot;
+}
+
+/*
+ * Only kmalloc touches cm_kmalloc, and only on frames it has
+ * allocated, so these need no lock.
+ */
+void
+coremap_setkmalloc(paddr_t paddr, void *data)
+{
+	unsigned frame;
+
+	if (!have_coremap || paddr < coremap_base) {
+		return;
+	}
+	frame = PADDR_TO_FRAME(paddr);
+	KASSERT(frame < coremap_nframes);
+	KASSERT(coremap[frame].cm_state == CM_HEAD);
+	coremap[frame].cm_kmalloc = data;
+}
+
+void *
+coremap_getkmalloc(paddr_t paddr)
+{
+	unsigned frame;
+
+	if (!have_coremap || paddr < coremap_base) {
+		return NULL;
+	}
+	frame = PADDR_TO_FRAME(paddr);
+	KASSERT(frame < coremap_nframes);
+	return coremap[frame].cm_kmalloc;
+}
+
+void
+coremap_setpolicy(unsigned policy)
+{
+	KASSERT(policy <= CM_POLICY_RANDOM);
+	coremap_policy = policy;
+}
+
+/*
+ * True if E could be evicted right now. Caller holds coremap_lock.
+ */
+static
+bool
+coremap_evictable(struct coremap_entry *e)
+{
+	return e->cm_state == CM_HEAD && e->cm_npages == 1 &&
+		e->cm_refcount == 1 && e->cm_as != NULL && !e->cm_busy;
+}
+
+/*
+ * The clock. The hand goes round at most twice: referenced pages
+ * have the bit cleared and are pinned and passed over, unreferenced
+ * clean pages are taken at once, and the first unreferenced dirty
+ * page is taken if a whole turn finds nothing clean. Once AGED is
+ * full, referenced pages are passed over without clearing them, so
+ * if everything is in use we fall back to the first evictable page
+ * seen.
+ */
+static
+struct coremap_entry *
+coremap_clock(struct coremap_aged *aged, unsigned maxaged, unsigned *naged)
+{
+	struct coremap_entry *e, *dirty = NULL, *any = NULL;
+	unsigned n;
+
+	for (n=0; n < 2 * coremap_nframes; n++) {
+		if (n == coremap_nframes && dirty != NULL) {
+			return dirty;
+		}
+		e = &coremap[coremap_hand];
+		coremap_hand = (coremap_hand + 1) % coremap_nframes;
+		if (!coremap_evictable(e)) {
+			continue;
+		}
+		if (any == NULL) {
+			any = e;
+		}
+		if (e->cm_referenced) {
+			if (*naged < maxaged) {
+				e->cm_referenced = false;
+				/* unpinned, so nobody else changes the entry */
+				*e->cm_pte &= ~(paddr_t)CM_PTE_REFBITS;
+				e->cm_busy = true;
+				aged[*naged].ca_as = e->cm_as;
+				aged[*naged].ca_vaddr = e->cm_vaddr;
+				aged[*naged].ca_paddr = FRAME_TO_PADDR(e - coremap);
+				(*naged)++;
+			}
+			continue;
+		}
+		if (!e->cm_dirty) {
+			return e;
+		}
+		if (dirty == NULL) {
+			dirty = e;
+		}
+	}
+	return dirty != NULL ? dirty : any;
+}
+
+paddr_t
+coremap_pick_victim(struct addrspace **as, vaddr_t *vaddr,
+		    struct coremap_aged *aged, unsigned maxaged,
+		    unsigned *naged)
+{
+	struct coremap_entry *e = NULL;
+	unsigned n;
+
+	*naged = 0;
+
+	spinlock_acquire(&coremap_lock);
+	switch (coremap_policy) {
+	    case CM_POLICY_CLOCK:
+		e = coremap_clock(aged, maxaged, naged);
+		break;
+	    case CM_POLICY_RANDOM:
+		coremap_hand = random() % coremap_nframes;
+		/* fall through */
+	    case CM_POLICY_FIFO:
+		for (n=0; n<coremap_nframes; n++) {
+			e = &coremap[coremap_hand];
+			coremap_hand = (coremap_hand + 1) % coremap_nframes;
+			if (coremap_evictable(e)) {
+				break;
+			}
+			e = NULL;
+		}
+		break;
+	}
+	if (e == NULL) {
+		spinlock_release(&coremap_lock);
+		return 0;
+	}
+	/* The fallback may be a page we just aged; it is ours already. */
+	for (n=0; n < *naged; n++) {
+		if (aged[n].ca_paddr == FRAME_TO_PADDR(e - coremap)) {
+			aged[n] = aged[--(*naged)];
+			break;
+		}
+	}
+	e->cm_busy = true;
+	*as = e->cm_as;
+	*vaddr = e->cm_vaddr;
+	spinlock_release(&coremap_lock);
+	return FRAME_TO_PADDR(e - coremap);
+}
+
+paddr_t
+coremap_alloc_zeroed(void)
+{
+	return zeropool_take();
+}
+
+bool
+coremap_prezero(void)
+{
+	paddr_t pa;
+
+	/* Unlocked checks; being off by a frame or two doesn't matter. */
+	if (!have_coremap || zeropool_count >= ZEROPOOL_SIZE ||
+	    coremap_nfree < ZEROPOOL_RESERVE) {
+		return false;
+	}
+
+	pa = coremap_alloc(1);
+	if (pa == 0) {
+		return false;
+	}
+	bzero((void *)PADDR_TO_KVADDR(pa), PAGE_SIZE);
+
+	spinlock_acquire(&zeropool_lock);
+	if (zeropool_count < ZEROPOOL_SIZE) {
+		zeropool[zeropool_count++] = pa;
+		pa = 0;
+	}
+	spinlock_release(&zeropool_lock);
+
+	if (pa != 0) {
+		/* Another cpu filled it first. */
+		coremap_free(pa);
+	}
+	return true;
+}
+
+unsigned
+coremap_freecount(void)
+{
+	unsigned i, n;
+
+	/* Unlocked; this is only a snapshot. */
+	n = coremap_nfree + zeropool_count;
+	for (i=0; i<MAXCPUS; i++) {
+		n += magazines[i].fm_count;
+	}
+	return n;
+}
@@ -31,6 +31,16 @@
 #include <lib.h>
 #include <spinlock.h>
 #include <vm.h>
+#include "opt-A3.h"
+#include "opt-kheapprof.h"
+#if OPT_A3
+#include <cpu.h>
+#include <current.h>
+#include <coremap.h>
+#include <kmem_cache.h>
+#include <shrinker.h>
+#include <platform/maxcpus.h>
+#endif
 
 /*
  * Kernel malloc.
@@ -104,6 +114,10 @@ struct freelist {
 struct pageref {
 	struct pageref *next_samesize;
 	struct pageref *next_all;
+#if OPT_A3
+	struct pageref **prev_samesize;	/* what points to us, or NULL */
+	struct pageref **prev_all;
+#endif
 	vaddr_t pageaddr_and_blocktype;
 	uint16_t freelist_offset;
 	uint16_t nfree;
@@ -117,6 +131,147 @@ struct pageref {
 
 ////////////////////////////////////////
 
+/*
+ * Use one spinlock for the whole thing. Making parts of the kmalloc
+ * logic per-cpu is worthwhile for scalability; however, for the time
+ * being at least we won't, because it adds a lot of complexity and in
+ * OS/161 performance and scalability aren't super-critical.
+ */
+
+static struct spinlock kmalloc_spinlock = SPINLOCK_INITIALIZER;
+
+#if OPT_A3
+/*
+ * ...except that we now do: see "Per-cpu magazine layer" below. A
+ * magazine is a small stack of free blocks of one size, 128 bytes
+ * itself, so magazines come from the subpage allocator too.
+ */
+
+#define KMAG_ROUNDS    30      /* blocks per magazine */
+#define KMAG_MAXBYTES  (2 * PAGE_SIZE)  /* ...but no more than this */
+#define KMAG_DEPOTMAX  4       /* full magazines kept per size */
+
+/* How many blocks of size BLKTYPE a magazine holds. */
+#define KMAG_CAPACITY(blktype) \
+	(KMAG_MAXBYTES / sizes[blktype] < KMAG_ROUNDS ? \
+	 KMAG_MAXBYTES / sizes[blktype] : KMAG_ROUNDS)
+
+struct kmagazine {
+	struct kmagazine *km_next;     /* on a depot list */
+	unsigned km_nrounds;
+	void *km_rounds[KMAG_ROUNDS];
+};
+
+/* Accessed by other cpus only when printing stats. */
+struct kmalloc_cpucache {
+	struct spinlock kc_lock;
+	struct kmagazine *kc_loaded;   /* the one in use */
+	struct kmagazine *kc_previous; /* the one used before, or NULL */
+};
+
+/* Protected by kmalloc_depot_lock. */
+struct kmalloc_depot {
+	struct kmagazine *kd_full;
+	struct kmagazine *kd_empty;
+	unsigned kd_nfull;
+	unsigned kd_nempty;
+};
+
+static struct kmalloc_cpucache kmalloc_cpucaches[MAXCPUS][NSIZES];
+static struct kmalloc_depot kmalloc_depots[NSIZES];
+static struct spinlock kmalloc_depot_lock = SPINLOCK_INITIALIZER;
+static bool kmalloc_cpucaches_on;
+#endif
+
+////////////////////////////////////////
+
+#if OPT_A3
+/*
+ * Pagerefs are carved out of whole pages, got from alloc_kpages as
+ * they are needed, so the number of pages the subpage allocator can
+ * manage grows with the heap. Free pagerefs are kept on freepagerefs,
+ * linked through next_all. Pages of pagerefs are never given back;
+ * at one pageref per page of heap they cost well under 1% of the
+ * largest the heap has been.
+ *
+ * The first page of them is in the kernel BSS, so that kmalloc works
+ * before alloc_kpages can give it whole pages to spare.
+ */
+
+#define NPAGEREFS (PAGE_SIZE / sizeof(struct pageref))
+static struct pageref pagerefs[NPAGEREFS];
+static bool pagerefs_added;
+static struct pageref *freepagerefs;
+static unsigned npagerefpages;
+
+/*
+ * Put N new pagerefs at PRS on the free list.
+ */
+static
+void
+addpagerefs(struct pageref *prs, unsigned n)
+{
+	unsigned i;
+
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+
+	for (i=0; i<n; i++) {
+		prs[i].next_all = freepagerefs;
+		freepagerefs = &prs[i];
+	}
+	npagerefpages++;
+}
+
+/*
+ * Called with kmalloc_spinlock held. If there are no free pagerefs,
+ * drops the lock to get another page of them, so anything the caller
+ * found under the lock may have changed by the time it returns.
+ */
+static
+struct pageref *
+allocpageref(void)
+{
+	struct pageref *p;
+	vaddr_t page;
+
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+
+	if (!pagerefs_added) {
+		addpagerefs(pagerefs, NPAGEREFS);
+		pagerefs_added = true;
+	}
+
+	if (freepagerefs == NULL) {
+		spinlock_release(&kmalloc_spinlock);
+		page = alloc_kpages(1);
+		spinlock_acquire(&kmalloc_spinlock);
+		if (page == 0) {
+			/* Someone may have freed one meanwhile. */
+			if (freepagerefs == NULL) {
+				return NULL;
+			}
+		}
+		else {
+			addpagerefs((struct pageref *)page, NPAGEREFS);
+		}
+	}
+
+	p = freepagerefs;
+	freepagerefs = p->next_all;
+	return p;
+}
+
+static
+void
+freepageref(struct pageref *p)
+{
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+
+	p->next_all = freepagerefs;
+	freepagerefs = p;
+}
+
+#else
 /*
  * This is cheesy. 
  *
@@ -180,22 +335,25 @@ freepageref(struct pageref *p)
 	KASSERT((pagerefs_inuse[i] & k) != 0);
 	pagerefs_inuse[i] &= ~k;
 }
+#endif /* OPT_A3 */
 
 ////////////////////////////////////////
 
 static struct pageref *sizebases[NSIZES];
 static struct pageref *allbase;
-
-////////////////////////////////////////
-
+#if OPT_A3
 /*
- * Use one spinlock for the whole thing. Making parts of the kmalloc
- * logic per-cpu is worthwhile for scalability; however, for the time
- * being at least we won't, because it adds a lot of complexity and in
- * OS/161 performance and scalability aren't super-critical.
+ * Pages that were allocated before the coremap existed can't be
+ * tagged with their pageref (see coremap_setkmalloc), so subpage_kfree
+ * has to search for them. They are kept here instead of on allbase,
+ * so that the search only covers the few pages kmalloc got at boot.
+ *
+ * Only pages with free blocks are on sizebases; full ones are taken
+ * off until a block is freed, so subpage_kmalloc never steps over
+ * them.
  */
-
-static struct spinlock kmalloc_spinlock = SPINLOCK_INITIALIZER;
+static struct pageref *earlybase;
+#endif
 
 ////////////////////////////////////////
 
@@ -257,6 +415,32 @@ checksubpages(void)
 
 	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
 
+#if OPT_A3
+	for (i=0; i<NSIZES; i++) {
+		for (pr = sizebases[i]; pr != NULL; pr = pr->next_samesize) {
+			checksubpage(pr);
+			KASSERT(pr->nfree > 0);
+			KASSERT(*pr->prev_samesize == pr);
+			sc++;
+		}
+	}
+
+	/* Count the pages that should have been on sizebases. */
+	for (pr = allbase; pr != NULL; pr = pr->next_all) {
+		checksubpage(pr);
+		KASSERT(*pr->prev_all == pr);
+		if (pr->nfree > 0) {
+			ac++;
+		}
+	}
+	for (pr = earlybase; pr != NULL; pr = pr->next_all) {
+		checksubpage(pr);
+		KASSERT(*pr->prev_all == pr);
+		if (pr->nfree > 0) {
+			ac++;
+		}
+	}
+#else
 	for (i=0; i<NSIZES; i++) {
 		for (pr = sizebases[i]; pr != NULL; pr = pr->next_samesize) {
 			checksubpage(pr);
@@ -270,6 +454,7 @@ checksubpages(void)
 		KASSERT(ac < NPAGEREFS);
 		ac++;
 	}
+#endif
 
 	KASSERT(sc==ac);
 }
@@ -330,6 +515,10 @@ dumpsubpage(struct pageref *pr)
 	kprintf("\n");
 }
 
+#if OPT_A3
+static void kmag_printstats(void);
+#endif
+
 void
 kheap_printstats(void)
 {
@@ -343,12 +532,82 @@ kheap_printstats(void)
 	for (pr = allbase; pr != NULL; pr = pr->next_all) {
 		dumpsubpage(pr);
 	}
+#if OPT_A3
+	for (pr = earlybase; pr != NULL; pr = pr->next_all) {
+		dumpsubpage(pr);
+	}
+	kprintf("%u page(s) of pagerefs\n", npagerefpages);
+#endif
 
 	spinlock_release(&kmalloc_spinlock);
+
+#if OPT_A3
+	kmag_printstats();
+	kmem_cache_printstats();
+#endif
 }
 
 ////////////////////////////////////////
 
+#if OPT_A3
+static
+void
+add_samesize(struct pageref *pr, int blktype)
+{
+	KASSERT(pr->prev_samesize == NULL);
+
+	pr->next_samesize = sizebases[blktype];
+	if (pr->next_samesize != NULL) {
+		pr->next_samesize->prev_samesize = &pr->next_samesize;
+	}
+	pr->prev_samesize = &sizebases[blktype];
+	sizebases[blktype] = pr;
+}
+
+static
+void
+remove_samesize(struct pageref *pr)
+{
+	KASSERT(pr->prev_samesize != NULL);
+
+	*pr->prev_samesize = pr->next_samesize;
+	if (pr->next_samesize != NULL) {
+		pr->next_samesize->prev_samesize = pr->prev_samesize;
+	}
+	pr->next_samesize = NULL;
+	pr->prev_samesize = NULL;
+}
+
+static
+void
+add_all(struct pageref **base, struct pageref *pr)
+{
+	pr->next_all = *base;
+	if (pr->next_all != NULL) {
+		pr->next_all->prev_all = &pr->next_all;
+	}
+	pr->prev_all = base;
+	*base = pr;
+}
+
+static
+void
+remove_lists(struct pageref *pr, int blktype)
+{
+	KASSERT(blktype>=0 && blktype<NSIZES);
+
+	if (pr->prev_samesize != NULL) {
+		remove_samesize(pr);
+	}
+
+	*pr->prev_all = pr->next_all;
+	if (pr->next_all != NULL) {
+		pr->next_all->prev_all = pr->prev_all;
+	}
+	pr->next_all = NULL;
+	pr->prev_all = NULL;
+}
+#else
 static
 void
 remove_lists(struct pageref *pr, int blktype)
@@ -373,6 +632,7 @@ remove_lists(struct pageref *pr, int blktype)
 		}
 	}
 }
+#endif
 
 static
 inline
@@ -441,6 +701,9 @@ subpage_kmalloc(size_t sz)
 			else {
 				KASSERT(pr->nfree == 0);
 				pr->freelist_offset = INVALID_OFFSET;
+#if OPT_A3
+				remove_samesize(pr);
+#endif
 			}
 
 			checksubpages();
@@ -479,6 +742,10 @@ subpage_kmalloc(size_t sz)
 
 	pr->pageaddr_and_blocktype = MKPAB(prpage, blktype);
 	pr->nfree = PAGE_SIZE / sizes[blktype];
+#if OPT_A3
+	pr->prev_samesize = NULL;
+	coremap_setkmalloc(KVADDR_TO_PADDR(prpage), pr);
+#endif
 
 	/*
 	 * Note: fl is volatile because the MIPS toolchain we were
@@ -498,11 +765,21 @@ subpage_kmalloc(size_t sz)
 	pr->freelist_offset = fla - prpage;
 	KASSERT(pr->freelist_offset == (pr->nfree-1)*sizes[blktype]);
 
+#if OPT_A3
+	add_samesize(pr, blktype);
+	if (coremap_getkmalloc(KVADDR_TO_PADDR(prpage)) == pr) {
+		add_all(&allbase, pr);
+	}
+	else {
+		add_all(&earlybase, pr);
+	}
+#else
 	pr->next_samesize = sizebases[blktype];
 	sizebases[blktype] = pr;
 
 	pr->next_all = allbase;
 	allbase = pr;
+#endif
 
 	/* This is kind of cheesy, but avoids duplicating the alloc code. */
 	goto doalloc;
@@ -526,6 +803,30 @@ subpage_kfree(void *ptr)
 
 	checksubpages();
 
+#if OPT_A3
+	/* Pages got before the coremap have no tag; search for those. */
+	pr = coremap_getkmalloc(KVADDR_TO_PADDR(ptraddr & PAGE_FRAME));
+	if (pr == NULL) {
+		for (pr = earlybase; pr; pr = pr->next_all) {
+			prpage = PR_PAGEADDR(pr);
+			if (ptraddr >= prpage && ptraddr < prpage + PAGE_SIZE) {
+				break;
+			}
+		}
+	}
+	if (pr == NULL) {
+		/* Not on any of our pages - not a subpage allocation */
+		spinlock_release(&kmalloc_spinlock);
+		return -1;
+	}
+
+	prpage = PR_PAGEADDR(pr);
+	blktype = PR_BLOCKTYPE(pr);
+
+	/* check for corruption */
+	KASSERT(blktype>=0 && blktype<NSIZES);
+	checksubpage(pr);
+#else
 	for (pr = allbase; pr; pr = pr->next_all) {
 		prpage = PR_PAGEADDR(pr);
 		blktype = PR_BLOCKTYPE(pr);
@@ -544,6 +845,7 @@ subpage_kfree(void *ptr)
 		spinlock_release(&kmalloc_spinlock);
 		return -1;
 	}
+#endif
 
 	offset = ptraddr - prpage;
 
@@ -572,12 +874,21 @@ subpage_kfree(void *ptr)
 	}
 	pr->freelist_offset = offset;
 	pr->nfree++;
+#if OPT_A3
+	if (pr->nfree == 1) {
+		/* It was full; it has a block to give out again. */
+		add_samesize(pr, blktype);
+	}
+#endif
 
 	KASSERT(pr->nfree <= PAGE_SIZE / sizes[blktype]);
 	if (pr->nfree == PAGE_SIZE / sizes[blktype]) {
 		/* Whole page is free. */
 		remove_lists(pr, blktype);
 		freepageref(pr);
+#if OPT_A3
+		coremap_setkmalloc(KVADDR_TO_PADDR(prpage), NULL);
+#endif
 		/* Call free_kpages without kmalloc_spinlock. */
 		spinlock_release(&kmalloc_spinlock);
 		free_kpages(prpage);
@@ -598,8 +909,523 @@ subpage_kfree(void *ptr)
 //
 ////////////////////////////////////////////////////////////
 
+#if OPT_A3
+////////////////////////////////////////////////////////////
+//
+// Per-cpu magazine layer.
+//
+// In front of the subpage allocator, each cpu has two magazines for
+// each block size: the loaded one, which kmalloc pops blocks off and
+// kfree pushes them onto, and the previous one. When the loaded one
+// runs empty (or full) and the previous one is full (or empty) they
+// trade places. Only when both are empty (or both full) does the cpu
+// go to the depot, under kmalloc_depot_lock, to swap a whole magazine
+// for a full (or empty) one. So the shared locks are taken at most
+// once every KMAG_ROUNDS blocks, and the cpu's own lock is only ever
+// contended by kheap_printstats.
+//
+// The blocks in magazines are still allocated as far as the subpage
+// allocator knows. Magazines for big blocks hold fewer of them, and
+// the depot keeps only KMAG_DEPOTMAX full magazines of each size and
+// gives the blocks of any more back, so that their pages can be freed.
+//
+// kfree finds a block's size through the pageref that subpage_kmalloc
+// records in the coremap entry of each page it splits up. Blocks on
+// pages that were stolen before the coremap existed have none and
+// always go straight back to the subpage allocator.
+//
+// When memory is short, kmalloc_shrink empties all the magazines, so
+// that pages whose blocks were only held there can be freed.
+//
+
+static unsigned kmalloc_shrink(unsigned npages);
+
+void
+kmalloc_bootstrap(void)
+{
+	unsigned i, j;
+
+	for (i=0; i<MAXCPUS; i++) {
+		for (j=0; j<NSIZES; j++) {
+			spinlock_init(&kmalloc_cpucaches[i][j].kc_lock);
+			kmalloc_cpucaches[i][j].kc_loaded = NULL;
+			kmalloc_cpucaches[i][j].kc_previous = NULL;
+		}
+	}
+	kmalloc_cpucaches_on = true;
+	shrinker_register("kmalloc", kmalloc_shrink, NULL);
+}
+
+/*
+ * Give all the blocks in KM, and KM itself, back to the subpage
+ * allocator.
+ */
+static
+void
+kmag_flush(struct kmagazine *km)
+{
+	int result;
+
+	while (km->km_nrounds > 0) {
+		km->km_nrounds--;
+		result = subpage_kfree(km->km_rounds[km->km_nrounds]);
+		KASSERT(result == 0);
+	}
+	result = subpage_kfree(km);
+	KASSERT(result == 0);
+}
+
+/*
+ * Take a block of size BLKTYPE from this cpu's magazines, or return
+ * NULL if they and the depot have none.
+ */
+static
+void *
+kmag_alloc(unsigned blktype)
+{
+	struct kmalloc_cpucache *kc;
+	struct kmalloc_depot *kd;
+	struct kmagazine *km;
+	void *ptr = NULL;
+
+	kc = &kmalloc_cpucaches[curcpu->c_number][blktype];
+	spinlock_acquire(&kc->kc_lock);
+
+	if (kc->kc_loaded == NULL || kc->kc_loaded->km_nrounds == 0) {
+		if (kc->kc_previous != NULL &&
+		    kc->kc_previous->km_nrounds > 0) {
+			km = kc->kc_loaded;
+			kc->kc_loaded = kc->kc_previous;
+			kc->kc_previous = km;
+		}
+		else {
+			/* Trade the previous (empty) one for a full one. */
+			kd = &kmalloc_depots[blktype];
+			spinlock_acquire(&kmalloc_depot_lock);
+			km = kd->kd_full;
+			if (km != NULL) {
+				kd->kd_full = km->km_next;
+				kd->kd_nfull--;
+				if (kc->kc_previous != NULL) {
+					kc->kc_previous->km_next = kd->kd_empty;
+					kd->kd_empty = kc->kc_previous;
+					kd->kd_nempty++;
+				}
+				kc->kc_previous = kc->kc_loaded;
+				kc->kc_loaded = km;
+			}
+			spinlock_release(&kmalloc_depot_lock);
+		}
+	}
+
+	km = kc->kc_loaded;
+	if (km != NULL && km->km_nrounds > 0) {
+		km->km_nrounds--;
+		ptr = km->km_rounds[km->km_nrounds];
+	}
+
+	spinlock_release(&kc->kc_lock);
+	return ptr;
+}
+
+/*
+ * Put PTR, a block of size BLKTYPE, in this cpu's magazines. SPARE,
+ * if not NULL, is an empty magazine to use if one is needed, or else
+ * to leave in the depot. Fails if an empty magazine is needed and
+ * there is none. A full magazine the depot has no room for comes back
+ * in FLUSH, to be flushed once no locks are held.
+ */
+static
+bool
+kmag_free(unsigned blktype, void *ptr, struct kmagazine *spare,
+	  struct kmagazine **flush)
+{
+	struct kmalloc_cpucache *kc;
+	struct kmalloc_depot *kd;
+	struct kmagazine *km;
+
+	kc = &kmalloc_cpucaches[curcpu->c_number][blktype];
+	kd = &kmalloc_depots[blktype];
+	spinlock_acquire(&kc->kc_lock);
+
+	if (kc->kc_loaded == NULL ||
+	    kc->kc_loaded->km_nrounds == KMAG_CAPACITY(blktype)) {
+		if (kc->kc_previous != NULL &&
+		    kc->kc_previous->km_nrounds < KMAG_CAPACITY(blktype)) {
+			km = kc->kc_loaded;
+			kc->kc_loaded = kc->kc_previous;
+			kc->kc_previous = km;
+		}
+		else {
+			/* Trade the previous (full) one for an empty one. */
+			spinlock_acquire(&kmalloc_depot_lock);
+			km = kd->kd_empty;
+			if (km != NULL) {
+				kd->kd_empty = km->km_next;
+				kd->kd_nempty--;
+			}
+			else {
+				km = spare;
+				spare = NULL;
+			}
+			if (km == NULL) {
+				spinlock_release(&kmalloc_depot_lock);
+				spinlock_release(&kc->kc_lock);
+				return false;
+			}
+			if (kc->kc_previous == NULL) {
+				/* nothing to give back */
+			}
+			else if (kd->kd_nfull < KMAG_DEPOTMAX) {
+				kc->kc_previous->km_next = kd->kd_full;
+				kd->kd_full = kc->kc_previous;
+				kd->kd_nfull++;
+			}
+			else {
+				*flush = kc->kc_previous;
+			}
+			kc->kc_previous = kc->kc_loaded;
+			kc->kc_loaded = km;
+			spinlock_release(&kmalloc_depot_lock);
+		}
+	}
+
+	km = kc->kc_loaded;
+	KASSERT(km->km_nrounds < KMAG_CAPACITY(blktype));
+	km->km_rounds[km->km_nrounds] = ptr;
+	km->km_nrounds++;
+
+	if (spare != NULL) {
+		spinlock_acquire(&kmalloc_depot_lock);
+		spare->km_next = kd->kd_empty;
+		kd->kd_empty = spare;
+		kd->kd_nempty++;
+		spinlock_release(&kmalloc_depot_lock);
+	}
+
+	spinlock_release(&kc->kc_lock);
+	return true;
+}
+
+/*
+ * kfree for a block on the page PR describes.
+ */
+static
+void
+kmag_kfree(struct pageref *pr, void *ptr)
+{
+	struct kmagazine *spare, *flush = NULL;
+	unsigned blktype;
+	vaddr_t offset;
+	int result;
+
+	blktype = PR_BLOCKTYPE(pr);
+	KASSERT(blktype < NSIZES);
+	offset = (vaddr_t)ptr - PR_PAGEADDR(pr);
+	if (offset >= PAGE_SIZE || offset % sizes[blktype] != 0) {
+		panic("kfree: subpage free of invalid addr %p\n", ptr);
+	}
+
+	/* As in subpage_kfree, to catch uses of dangling pointers. */
+	fill_deadbeef(ptr, sizes[blktype]);
+
+	if (!kmag_free(blktype, ptr, NULL, &flush)) {
+		spare = subpage_kmalloc(sizeof(*spare));
+		if (spare == NULL) {
+			result = subpage_kfree(ptr);
+			KASSERT(result == 0);
+			return;
+		}
+		spare->km_nrounds = 0;
+		if (!kmag_free(blktype, ptr, spare, &flush)) {
+			panic("kfree: magazine refused a spare\n");
+		}
+	}
+
+	if (flush != NULL) {
+		kmag_flush(flush);
+	}
+}
+
+/*
+ * Shrinker: free the object caches' spare slabs, then take every
+ * magazine away from the cpus and the depot and flush it. This gives
+ * back all it can whatever NPAGES is; the cpus soon refill their
+ * magazines if they need them.
+ */
+static
+unsigned
+kmalloc_shrink(unsigned npages)
+{
+	struct kmalloc_cpucache *kc;
+	struct kmalloc_depot *kd;
+	struct kmagazine *km, *flush = NULL;
+	unsigned before, after, i, j;
+
+	(void)npages;
+
+	before = coremap_freecount();
+	kmem_cache_reap();
+
+	for (j=0; j<NSIZES; j++) {
+		for (i=0; i<MAXCPUS; i++) {
+			kc = &kmalloc_cpucaches[i][j];
+			spinlock_acquire(&kc->kc_lock);
+			if (kc->kc_loaded != NULL) {
+				kc->kc_loaded->km_next = flush;
+				flush = kc->kc_loaded;
+				kc->kc_loaded = NULL;
+			}
+			if (kc->kc_previous != NULL) {
+				kc->kc_previous->km_next = flush;
+				flush = kc->kc_previous;
+				kc->kc_previous = NULL;
+			}
+			spinlock_release(&kc->kc_lock);
+		}
+
+		kd = &kmalloc_depots[j];
+		spinlock_acquire(&kmalloc_depot_lock);
+		while (kd->kd_full != NULL) {
+			km = kd->kd_full;
+			kd->kd_full = km->km_next;
+			km->km_next = flush;
+			flush = km;
+		}
+		while (kd->kd_empty != NULL) {
+			km = kd->kd_empty;
+			kd->kd_empty = km->km_next;
+			km->km_next = flush;
+			flush = km;
+		}
+		kd->kd_nfull = 0;
+		kd->kd_nempty = 0;
+		spinlock_release(&kmalloc_depot_lock);
+	}
+
+	while (flush != NULL) {
+		km = flush;
+		flush = km->km_next;
+		kmag_flush(km);
+	}
+
+	/* Only a guess: other cpus may be allocating meanwhile. */
+	after = coremap_freecount();
+	return after > before ? after - before : 0;
+}
+
+/*
+ * Print how many blocks of each size are sitting in magazines.
+ */
+static
+void
+kmag_printstats(void)
+{
+	struct kmalloc_cpucache *kc;
+	struct kmagazine *km;
+	unsigned cached[NSIZES], nfull[NSIZES], nempty[NSIZES];
+	unsigned i, j;
+
+	if (!kmalloc_cpucaches_on) {
+		return;
+	}
+
+	for (j=0; j<NSIZES; j++) {
+		cached[j] = 0;
+		for (i=0; i<MAXCPUS; i++) {
+			kc = &kmalloc_cpucaches[i][j];
+			spinlock_acquire(&kc->kc_lock);
+			if (kc->kc_loaded != NULL) {
+				cached[j] += kc->kc_loaded->km_nrounds;
+			}
+			if (kc->kc_previous != NULL) {
+				cached[j] += kc->kc_previous->km_nrounds;
+			}
+			spinlock_release(&kc->kc_lock);
+		}
+		spinlock_acquire(&kmalloc_depot_lock);
+		for (km = kmalloc_depots[j].kd_full; km != NULL;
+		     km = km->km_next) {
+			cached[j] += km->km_nrounds;
+		}
+		nfull[j] = kmalloc_depots[j].kd_nfull;
+		nempty[j] = kmalloc_depots[j].kd_nempty;
+		spinlock_release(&kmalloc_depot_lock);
+	}
+
+	kprintf("Magazine layer status:\n");
+	for (j=0; j<NSIZES; j++) {
+		kprintf("size %-4lu  %u free blocks cached, "
+			"depot %u full %u empty\n",
+			(unsigned long)sizes[j], cached[j], nfull[j], nempty[j]);
+	}
+}
+
+//
+////////////////////////////////////////////////////////////
+#endif /* OPT_A3 */
+
+#if OPT_KHEAPPROF
+////////////////////////////////////////////////////////////
+//
+// Per-call-site profiling ("options kheapprof").
+//
+// kmalloc and kfree become wrappers around the allocator proper,
+// kheap_alloc and kheap_free below. Each allocation is charged to
+// the return address of its kmalloc call: small ones carry a header,
+// in front of the block, that points to their site's record; whole
+// page allocations, which must stay page aligned, are remembered in
+// a small table instead, and aren't counted if it is full. Sites are
+// kept in an open hash table; once it is full, new sites are lumped
+// together as "other".
+//
+// Sites are printed as addresses; look them up in the kernel's
+// symbol table (os161-addr2line or os161-nm).
+//
+
+#define KHEAPPROF_NSITES   256     /* sites tracked */
+#define KHEAPPROF_NBIG     512     /* live page allocations tracked */
+
+struct kheapprof_site {
+	void *ks_site;                  /* return address, or NULL */
+	unsigned ks_nallocs;            /* ever */
+	unsigned ks_nlive;
+	size_t ks_live;                 /* bytes asked for, now */
+	size_t ks_maxlive;              /* high-water mark of ks_live */
+};
+
+/* In front of each small block; 8 bytes, keeping blocks aligned. */
+struct kheapprof_hdr {
+	struct kheapprof_site *kh_site;
+	uint32_t kh_size;
+};
+#define KHEAPPROF_HDRSIZE  ROUNDUP(sizeof(struct kheapprof_hdr), 8)
+
+struct kheapprof_big {
+	void *kb_ptr;                   /* NULL if this entry is free */
+	struct kheapprof_site *kb_site;
+	size_t kb_size;
+};
+
+static struct spinlock kheapprof_lock = SPINLOCK_INITIALIZER;
+static struct kheapprof_site kheapprof_sites[KHEAPPROF_NSITES];
+static struct kheapprof_site kheapprof_other;
+static struct kheapprof_big kheapprof_big[KHEAPPROF_NBIG];
+static unsigned kheapprof_bigmissed;    /* not counted */
+
+/*
+ * Charge SIZE bytes to SITE and return its record.
+ */
+static
+struct kheapprof_site *
+kheapprof_charge(void *site, size_t size)
+{
+	struct kheapprof_site *ks = &kheapprof_other;
+	unsigned i, h;
+
+	KASSERT(spinlock_do_i_hold(&kheapprof_lock));
+
+	h = ((uintptr_t)site / sizeof(uint32_t)) % KHEAPPROF_NSITES;
+	for (i=0; i<KHEAPPROF_NSITES; i++) {
+		if (kheapprof_sites[h].ks_site == site ||
+		    kheapprof_sites[h].ks_site == NULL) {
+			ks = &kheapprof_sites[h];
+			ks->ks_site = site;
+			break;
+		}
+		h = (h + 1) % KHEAPPROF_NSITES;
+	}
+
+	ks->ks_nallocs++;
+	ks->ks_nlive++;
+	ks->ks_live += size;
+	if (ks->ks_live > ks->ks_maxlive) {
+		ks->ks_maxlive = ks->ks_live;
+	}
+	return ks;
+}
+
+static
+void
+kheapprof_uncharge(struct kheapprof_site *ks, size_t size)
+{
+	KASSERT(spinlock_do_i_hold(&kheapprof_lock));
+	KASSERT(ks->ks_nlive > 0);
+	KASSERT(ks->ks_live >= size);
+
+	ks->ks_nlive--;
+	ks->ks_live -= size;
+}
+
+void
+kheap_printsites(unsigned maxsites)
+{
+	struct kheapprof_site *ks, *best;
+	bool printed[KHEAPPROF_NSITES];
+	size_t total = 0;
+	unsigned i, n;
+
+	spinlock_acquire(&kheapprof_lock);
+
+	for (i=0; i<KHEAPPROF_NSITES; i++) {
+		printed[i] = false;
+		total += kheapprof_sites[i].ks_live;
+	}
+	total += kheapprof_other.ks_live;
+
+	kprintf("Kernel heap by call site (%lu bytes live):\n",
+		(unsigned long)total);
+	kprintf("%-10s %10s %6s %10s %8s\n", "site", "live", "blocks",
+		"max", "allocs");
+
+	/* Selection by live bytes; there are only a few hundred. */
+	for (n=0; n<maxsites; n++) {
+		best = NULL;
+		for (i=0; i<KHEAPPROF_NSITES; i++) {
+			ks = &kheapprof_sites[i];
+			if (ks->ks_site == NULL || printed[i]) {
+				continue;
+			}
+			if (best == NULL || ks->ks_live > best->ks_live) {
+				best = ks;
+			}
+		}
+		if (best == NULL) {
+			break;
+		}
+		printed[best - kheapprof_sites] = true;
+		kprintf("0x%08lx %10lu %6u %10lu %8u\n",
+			(unsigned long)(uintptr_t)best->ks_site,
+			(unsigned long)best->ks_live, best->ks_nlive,
+			(unsigned long)best->ks_maxlive, best->ks_nallocs);
+	}
+
+	ks = &kheapprof_other;
+	if (ks->ks_nallocs > 0) {
+		kprintf("%-10s %10lu %6u %10lu %8u\n", "other",
+			(unsigned long)ks->ks_live, ks->ks_nlive,
+			(unsigned long)ks->ks_maxlive, ks->ks_nallocs);
+	}
+	if (kheapprof_bigmissed > 0) {
+		kprintf("%u page allocation(s) not counted\n",
+			kheapprof_bigmissed);
+	}
+
+	spinlock_release(&kheapprof_lock);
+}
+
+//
+////////////////////////////////////////////////////////////
+#endif /* OPT_KHEAPPROF */
+
+#if OPT_KHEAPPROF
+static
+void *
+kheap_alloc(size_t sz)
+#else
 void *
 kmalloc(size_t sz)
+#endif
 {
 	if (sz>=LARGEST_SUBPAGE_SIZE) {
 		unsigned long npages;
@@ -615,12 +1441,41 @@ kmalloc(size_t sz)
 		return (void *)address;
 	}
 
+#if OPT_A3
+	if (kmalloc_cpucaches_on) {
+		void *ptr;
+
+		ptr = kmag_alloc(blocktype(sz));
+		if (ptr != NULL) {
+			return ptr;
+		}
+	}
+#endif
 	return subpage_kmalloc(sz);
 }
 
+#if OPT_KHEAPPROF
+static
+void
+kheap_free(void *ptr)
+#else
 void
 kfree(void *ptr)
+#endif
 {
+#if OPT_A3
+	struct pageref *pr;
+
+	if (ptr != NULL && kmalloc_cpucaches_on) {
+		pr = coremap_getkmalloc(KVADDR_TO_PADDR((vaddr_t)ptr &
+							PAGE_FRAME));
+		if (pr != NULL) {
+			kmag_kfree(pr, ptr);
+			return;
+		}
+	}
+#endif
+
 	/*
 	 * Try subpage first; if that fails, assume it's a big allocation.
 	 */
@@ -632,3 +1487,89 @@ kfree(void *ptr)
 	}
 }
 
+#if OPT_KHEAPPROF
+void *
+kmalloc(size_t sz)
+{
+	struct kheapprof_hdr *kh;
+	void *site, *ptr;
+	unsigned i;
+
+	site = __builtin_return_address(0);
+
+	if (sz + KHEAPPROF_HDRSIZE >= LARGEST_SUBPAGE_SIZE) {
+		/* Whole pages, no header. */
+		ptr = kheap_alloc(sz < LARGEST_SUBPAGE_SIZE ?
+				  LARGEST_SUBPAGE_SIZE : sz);
+		if (ptr == NULL) {
+			return NULL;
+		}
+		spinlock_acquire(&kheapprof_lock);
+		for (i=0; i<KHEAPPROF_NBIG; i++) {
+			if (kheapprof_big[i].kb_ptr == NULL) {
+				kheapprof_big[i].kb_ptr = ptr;
+				kheapprof_big[i].kb_site =
+					kheapprof_charge(site, sz);
+				kheapprof_big[i].kb_size = sz;
+				break;
+			}
+		}
+		if (i == KHEAPPROF_NBIG) {
+			kheapprof_bigmissed++;
+		}
+		spinlock_release(&kheapprof_lock);
+		return ptr;
+	}
+
+	kh = kheap_alloc(sz + KHEAPPROF_HDRSIZE);
+	if (kh == NULL) {
+		return NULL;
+	}
+	spinlock_acquire(&kheapprof_lock);
+	kh->kh_site = kheapprof_charge(site, sz);
+	spinlock_release(&kheapprof_lock);
+	kh->kh_size = sz;
+	return (char *)kh + KHEAPPROF_HDRSIZE;
+}
+
+void
+kfree(void *ptr)
+{
+	struct kheapprof_hdr *kh;
+	unsigned i;
+
+	if (ptr == NULL) {
+		return;
+	}
+
+	if ((vaddr_t)ptr % PAGE_SIZE == 0) {
+		/* Headers make small blocks never page aligned. */
+		spinlock_acquire(&kheapprof_lock);
+		for (i=0; i<KHEAPPROF_NBIG; i++) {
+			if (kheapprof_big[i].kb_ptr == ptr) {
+				kheapprof_uncharge(kheapprof_big[i].kb_site,
+						   kheapprof_big[i].kb_size);
+				kheapprof_big[i].kb_ptr = NULL;
+				break;
+			}
+		}
+		spinlock_release(&kheapprof_lock);
+		kheap_free(ptr);
+		return;
+	}
+
+	kh = (struct kheapprof_hdr *)((char *)ptr - KHEAPPROF_HDRSIZE);
+	spinlock_acquire(&kheapprof_lock);
+	kheapprof_uncharge(kh->kh_site, kh->kh_size);
+	spinlock_release(&kheapprof_lock);
+	kheap_free(kh);
+}
+#else
+void
+kheap_printsites(unsigned maxsites)
+{
+	(void)maxsites;
+	kprintf("Kernel heap profiling is not compiled in "
+		"(options kheapprof)\n");
+}
+#endif /* OPT_KHEAPPROF */
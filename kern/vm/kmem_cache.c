@@ -0,0 +1,425 @@
+/*
+ * Object caches.
+ *
+ * Each slab is one page: the objects from the start, and the struct
+ * kmem_slab describing them at the end, so kmem_cache_free finds the
+ * slab of an object by masking its address. Free objects are linked
+ * through a word just past each object, not through the object
+ * itself, which would clobber its constructed state.
+ *
+ * Slabs are page aligned, so they start on a cache line. Each new
+ * slab of a cache starts its first object one cache line further in
+ * than the one before, as far as the slack at the end of the page
+ * allows, so that the same fields of objects in different slabs
+ * don't all land in the same cache lines.
+ *
+ * A cache keeps its slabs on three lists, partial, full and empty,
+ * under its own spinlock. Objects come from partial slabs first.
+ * KMEM_MAXEMPTY empty slabs are kept for the next allocations; any
+ * more are destructed and their pages freed. kmem_cache_reap frees
+ * the ones that are kept, too.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <vm.h>
+#include <kmem_cache.h>
+
+#define KMEM_ALIGN      8       /* object alignment, as kmalloc's */
+#define KMEM_CACHELINE  32      /* colouring step */
+#define KMEM_MAXEMPTY   1       /* empty slabs kept per cache */
+
+struct kmem_slab {
+	struct kmem_slab *ks_next;      /* on one of the cache's lists */
+	struct kmem_slab *ks_prev;
+	struct kmem_cache *ks_cache;
+	void *ks_free;                  /* first free object */
+	unsigned ks_nfree;
+	unsigned ks_color;              /* offset of the first object */
+};
+
+struct kmem_cache {
+	const char *kc_name;
+	size_t kc_size;                 /* object size asked for */
+	size_t kc_stride;               /* object plus link, aligned */
+	unsigned kc_perslab;            /* objects per slab */
+	unsigned kc_color;              /* colour of the next slab */
+	unsigned kc_maxcolor;
+	void (*kc_ctor)(void *);
+	void (*kc_dtor)(void *);
+
+	struct spinlock kc_lock;
+	struct kmem_slab *kc_partial;
+	struct kmem_slab *kc_full;
+	struct kmem_slab *kc_empty;
+	unsigned kc_nempty;
+
+	/* Statistics, also under kc_lock */
+	unsigned kc_nslabs;
+	unsigned kc_inuse;
+	unsigned kc_maxinuse;
+	unsigned kc_nallocs;
+	unsigned kc_nconstructed;
+
+	struct kmem_cache *kc_next;     /* on kmem_caches */
+};
+
+/* All caches, for kmem_cache_printstats. */
+static struct spinlock kmem_caches_lock = SPINLOCK_INITIALIZER;
+static struct kmem_cache *kmem_caches;
+
+/* The free list link of object OBJ in cache KC. */
+#define KMEM_LINK(kc, obj) \
+	((void **)((char *)(obj) + (kc)->kc_stride - sizeof(void *)))
+
+/* The slab object OBJ is on. */
+#define KMEM_SLAB(obj) \
+	((struct kmem_slab *)(((vaddr_t)(obj) & PAGE_FRAME) + \
+			      PAGE_SIZE - sizeof(struct kmem_slab)))
+
+/* The first byte of slab KS's page. */
+#define KMEM_SLABPAGE(ks)  ((vaddr_t)(ks) & PAGE_FRAME)
+
+////////////////////////////////////////
+
+static
+void
+kmem_slab_insert(struct kmem_slab **list, struct kmem_slab *ks)
+{
+	ks->ks_prev = NULL;
+	ks->ks_next = *list;
+	if (*list != NULL) {
+		(*list)->ks_prev = ks;
+	}
+	*list = ks;
+}
+
+static
+void
+kmem_slab_remove(struct kmem_slab **list, struct kmem_slab *ks)
+{
+	if (ks->ks_prev != NULL) {
+		ks->ks_prev->ks_next = ks->ks_next;
+	}
+	else {
+		KASSERT(*list == ks);
+		*list = ks->ks_next;
+	}
+	if (ks->ks_next != NULL) {
+		ks->ks_next->ks_prev = ks->ks_prev;
+	}
+	ks->ks_next = ks->ks_prev = NULL;
+}
+
+/*
+ * Get a page and make it a slab of constructed objects, the first at
+ * offset COLOR. Called without kc_lock, as the constructor may take
+ * other locks.
+ */
+static
+struct kmem_slab *
+kmem_slab_create(struct kmem_cache *kc, unsigned color)
+{
+	struct kmem_slab *ks;
+	vaddr_t page;
+	char *obj;
+	unsigned i;
+
+	page = alloc_kpages(1);
+	if (page == 0) {
+		return NULL;
+	}
+	ks = KMEM_SLAB(page);
+	ks->ks_next = ks->ks_prev = NULL;
+	ks->ks_cache = kc;
+	ks->ks_free = NULL;
+	ks->ks_nfree = kc->kc_perslab;
+	ks->ks_color = color;
+
+	/* Link them backwards, so they are handed out in address order. */
+	for (i = kc->kc_perslab; i-- > 0; ) {
+		obj = (char *)page + color + i * kc->kc_stride;
+		if (kc->kc_ctor != NULL) {
+			kc->kc_ctor(obj);
+		}
+		*KMEM_LINK(kc, obj) = ks->ks_free;
+		ks->ks_free = obj;
+	}
+	return ks;
+}
+
+/*
+ * Destruct the objects of an empty slab and free its page. Called
+ * without kc_lock.
+ */
+static
+void
+kmem_slab_destroy(struct kmem_cache *kc, struct kmem_slab *ks)
+{
+	vaddr_t page;
+	unsigned i;
+
+	KASSERT(ks->ks_nfree == kc->kc_perslab);
+
+	page = KMEM_SLABPAGE(ks);
+	if (kc->kc_dtor != NULL) {
+		for (i=0; i<kc->kc_perslab; i++) {
+			kc->kc_dtor((char *)page + ks->ks_color +
+				    i * kc->kc_stride);
+		}
+	}
+	free_kpages(page);
+}
+
+////////////////////////////////////////
+
+struct kmem_cache *
+kmem_cache_create(const char *name, size_t size,
+		  void (*ctor)(void *obj), void (*dtor)(void *obj))
+{
+	struct kmem_cache *kc;
+	size_t room;
+
+	kc = kmalloc(sizeof(*kc));
+	if (kc == NULL) {
+		return NULL;
+	}
+
+	room = PAGE_SIZE - sizeof(struct kmem_slab);
+	kc->kc_name = name;
+	kc->kc_size = size;
+	kc->kc_stride = ROUNDUP(ROUNDUP(size, sizeof(void *)) + sizeof(void *),
+				KMEM_ALIGN);
+	if (kc->kc_stride > room) {
+		panic("kmem_cache_create: %s: %lu-byte objects don't fit "
+		      "in a slab\n", name, (unsigned long)size);
+	}
+	kc->kc_perslab = room / kc->kc_stride;
+	kc->kc_color = 0;
+	kc->kc_maxcolor = room - kc->kc_perslab * kc->kc_stride;
+	kc->kc_maxcolor -= kc->kc_maxcolor % KMEM_CACHELINE;
+	kc->kc_ctor = ctor;
+	kc->kc_dtor = dtor;
+
+	spinlock_init(&kc->kc_lock);
+	kc->kc_partial = kc->kc_full = kc->kc_empty = NULL;
+	kc->kc_nempty = 0;
+
+	kc->kc_nslabs = 0;
+	kc->kc_inuse = 0;
+	kc->kc_maxinuse = 0;
+	kc->kc_nallocs = 0;
+	kc->kc_nconstructed = 0;
+
+	spinlock_acquire(&kmem_caches_lock);
+	kc->kc_next = kmem_caches;
+	kmem_caches = kc;
+	spinlock_release(&kmem_caches_lock);
+
+	return kc;
+}
+
+void
+kmem_cache_destroy(struct kmem_cache *kc)
+{
+	struct kmem_cache **p;
+	struct kmem_slab *ks;
+
+	KASSERT(kc->kc_inuse == 0);
+	KASSERT(kc->kc_partial == NULL);
+	KASSERT(kc->kc_full == NULL);
+
+	spinlock_acquire(&kmem_caches_lock);
+	for (p = &kmem_caches; *p != kc; p = &(*p)->kc_next) {
+		KASSERT(*p != NULL);
+	}
+	*p = kc->kc_next;
+	spinlock_release(&kmem_caches_lock);
+
+	while (kc->kc_empty != NULL) {
+		ks = kc->kc_empty;
+		kmem_slab_remove(&kc->kc_empty, ks);
+		kmem_slab_destroy(kc, ks);
+	}
+	spinlock_cleanup(&kc->kc_lock);
+	kfree(kc);
+}
+
+void *
+kmem_cache_alloc(struct kmem_cache *kc)
+{
+	struct kmem_slab *ks;
+	unsigned color;
+	void *obj;
+
+	spinlock_acquire(&kc->kc_lock);
+
+	ks = kc->kc_partial;
+	if (ks == NULL) {
+		ks = kc->kc_empty;
+		if (ks != NULL) {
+			kmem_slab_remove(&kc->kc_empty, ks);
+			kc->kc_nempty--;
+		}
+		else {
+			color = kc->kc_color;
+			kc->kc_color += KMEM_CACHELINE;
+			if (kc->kc_color > kc->kc_maxcolor) {
+				kc->kc_color = 0;
+			}
+			spinlock_release(&kc->kc_lock);
+
+			ks = kmem_slab_create(kc, color);
+			if (ks == NULL) {
+				return NULL;
+			}
+
+			spinlock_acquire(&kc->kc_lock);
+			kc->kc_nslabs++;
+			kc->kc_nconstructed += kc->kc_perslab;
+		}
+		kmem_slab_insert(&kc->kc_partial, ks);
+	}
+
+	KASSERT(ks->ks_nfree > 0);
+	obj = ks->ks_free;
+	ks->ks_free = *KMEM_LINK(kc, obj);
+	ks->ks_nfree--;
+	if (ks->ks_nfree == 0) {
+		kmem_slab_remove(&kc->kc_partial, ks);
+		kmem_slab_insert(&kc->kc_full, ks);
+	}
+
+	kc->kc_nallocs++;
+	kc->kc_inuse++;
+	if (kc->kc_inuse > kc->kc_maxinuse) {
+		kc->kc_maxinuse = kc->kc_inuse;
+	}
+
+	spinlock_release(&kc->kc_lock);
+	return obj;
+}
+
+void
+kmem_cache_free(struct kmem_cache *kc, void *obj)
+{
+	struct kmem_slab *ks, *victim = NULL;
+	vaddr_t offset;
+	bool wasfull;
+
+	ks = KMEM_SLAB(obj);
+	if (ks->ks_cache != kc) {
+		panic("kmem_cache_free: %p is not from cache %s\n",
+		      obj, kc->kc_name);
+	}
+	offset = (vaddr_t)obj - KMEM_SLABPAGE(ks) - ks->ks_color;
+	if (offset % kc->kc_stride != 0) {
+		panic("kmem_cache_free: invalid object %p in cache %s\n",
+		      obj, kc->kc_name);
+	}
+
+	spinlock_acquire(&kc->kc_lock);
+
+	wasfull = (ks->ks_nfree == 0);
+	*KMEM_LINK(kc, obj) = ks->ks_free;
+	ks->ks_free = obj;
+	ks->ks_nfree++;
+	KASSERT(ks->ks_nfree <= kc->kc_perslab);
+	KASSERT(kc->kc_inuse > 0);
+	kc->kc_inuse--;
+
+	if (ks->ks_nfree == kc->kc_perslab) {
+		kmem_slab_remove(wasfull ? &kc->kc_full : &kc->kc_partial, ks);
+		if (kc->kc_nempty < KMEM_MAXEMPTY) {
+			kmem_slab_insert(&kc->kc_empty, ks);
+			kc->kc_nempty++;
+		}
+		else {
+			kc->kc_nslabs--;
+			victim = ks;
+		}
+	}
+	else if (wasfull) {
+		kmem_slab_remove(&kc->kc_full, ks);
+		kmem_slab_insert(&kc->kc_partial, ks);
+	}
+
+	spinlock_release(&kc->kc_lock);
+
+	if (victim != NULL) {
+		kmem_slab_destroy(kc, victim);
+	}
+}
+
+void
+kmem_cache_reap(void)
+{
+	struct kmem_cache *kc;
+	struct kmem_slab *ks, *empty, *victims;
+
+	/*
+	 * Take the empty slabs off every cache under the locks, and
+	 * destroy them with no lock held, as kmem_cache_free does.
+	 * This leaves the caches themselves unprotected while their
+	 * slabs' dtors run; it's up to kmem_cache_destroy's caller not
+	 * to destroy one while memory might be getting reaped.
+	 */
+	victims = NULL;
+	spinlock_acquire(&kmem_caches_lock);
+
+	for (kc = kmem_caches; kc != NULL; kc = kc->kc_next) {
+		spinlock_acquire(&kc->kc_lock);
+		empty = kc->kc_empty;
+		kc->kc_empty = NULL;
+		kc->kc_nslabs -= kc->kc_nempty;
+		kc->kc_nempty = 0;
+		spinlock_release(&kc->kc_lock);
+
+		while (empty != NULL) {
+			ks = empty;
+			empty = ks->ks_next;
+			ks->ks_next = victims;
+			victims = ks;
+		}
+	}
+
+	spinlock_release(&kmem_caches_lock);
+
+	while (victims != NULL) {
+		ks = victims;
+		victims = ks->ks_next;
+		kmem_slab_destroy(ks->ks_cache, ks);
+	}
+}
+
+void
+kmem_cache_printstats(void)
+{
+	struct kmem_cache *kc;
+	unsigned nslabs, inuse, maxinuse, nallocs, nconstructed;
+
+	spinlock_acquire(&kmem_caches_lock);
+
+	kprintf("Object caches:\n");
+	kprintf("%-12s %5s %5s %5s %6s %6s %6s %8s %8s\n", "name", "size",
+		"slot", "slabs", "objs", "inuse", "max", "allocs", "ctors");
+
+	for (kc = kmem_caches; kc != NULL; kc = kc->kc_next) {
+		spinlock_acquire(&kc->kc_lock);
+		nslabs = kc->kc_nslabs;
+		inuse = kc->kc_inuse;
+		maxinuse = kc->kc_maxinuse;
+		nallocs = kc->kc_nallocs;
+		nconstructed = kc->kc_nconstructed;
+		spinlock_release(&kc->kc_lock);
+
+		kprintf("%-12s %5lu %5lu %5u %6u %6u %6u %8u %8u\n",
+			kc->kc_name, (unsigned long)kc->kc_size,
+			(unsigned long)kc->kc_stride, nslabs,
+			nslabs * kc->kc_perslab, inuse, maxinuse,
+			nallocs, nconstructed);
+	}
+
+	spinlock_release(&kmem_caches_lock);
+}
@@ -0,0 +1,161 @@
+/*
+ * Memory reclaim callbacks.
+ *
+ * The shrinkers are a fixed table, filled in at boot and never
+ * changed after, so shrink_memory only needs shrinker_lock to read
+ * how many there are. The background thread sleeps on shrinker_sem;
+ * shrinker_kicked keeps allocations from piling up V()s on it while
+ * it is already awake.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <synch.h>
+#include <thread.h>
+#include <current.h>
+#include <vm.h>
+#include <coremap.h>
+#include <uw-vmstats.h>
+#include <shrinker.h>
+
+struct shrinker {
+	const char *sh_name;
+	unsigned (*sh_shrink)(unsigned npages);
+	void (*sh_deferred)(void);
+};
+
+static struct spinlock shrinker_lock = SPINLOCK_INITIALIZER;
+static struct shrinker shrinkers[SHRINKER_MAX];
+static unsigned nshrinkers;
+
+static struct semaphore *shrinker_sem;
+static bool shrinker_kicked;            /* under shrinker_lock */
+
+void
+shrinker_register(const char *name, unsigned (*shrink)(unsigned npages),
+		  void (*deferred)(void))
+{
+	spinlock_acquire(&shrinker_lock);
+	if (nshrinkers >= SHRINKER_MAX) {
+		panic("shrinker_register: too many shrinkers (%s)\n", name);
+	}
+	shrinkers[nshrinkers].sh_name = name;
+	shrinkers[nshrinkers].sh_shrink = shrink;
+	shrinkers[nshrinkers].sh_deferred = deferred;
+	nshrinkers++;
+	spinlock_release(&shrinker_lock);
+}
+
+unsigned
+shrink_memory(unsigned npages)
+{
+	unsigned i, n, got, freed = 0;
+
+	if (curthread->t_in_interrupt || curthread->t_curspl != 0 ||
+	    curthread->t_reclaiming) {
+		return 0;
+	}
+
+	spinlock_acquire(&shrinker_lock);
+	n = nshrinkers;
+	spinlock_release(&shrinker_lock);
+
+	curthread->t_reclaiming = true;
+	for (i=0; i<n && freed < npages; i++) {
+		got = shrinkers[i].sh_shrink(npages - freed);
+		DEBUG(DB_VM, "shrinker: %s freed %u of %u pages\n",
+		      shrinkers[i].sh_name, got, npages - freed);
+		freed += got;
+	}
+	curthread->t_reclaiming = false;
+
+	vmstats_add(VMSTAT_RECLAIM_PAGES, freed);
+	return freed;
+}
+
+void
+shrinker_kick(void)
+{
+	bool wake;
+
+	if (shrinker_sem == NULL) {
+		/* Not up yet. */
+		return;
+	}
+
+	spinlock_acquire(&shrinker_lock);
+	wake = !shrinker_kicked;
+	shrinker_kicked = true;
+	spinlock_release(&shrinker_lock);
+
+	if (wake) {
+		V(shrinker_sem);
+	}
+}
+
+/*
+ * Run the shrinkers' deferred work.
+ */
+static
+void
+shrinker_run_deferred(void)
+{
+	unsigned i, n;
+
+	spinlock_acquire(&shrinker_lock);
+	n = nshrinkers;
+	spinlock_release(&shrinker_lock);
+
+	for (i=0; i<n; i++) {
+		if (shrinkers[i].sh_deferred != NULL) {
+			shrinkers[i].sh_deferred();
+		}
+	}
+}
+
+/*
+ * Shrink until free memory is back above the high-water mark or the
+ * shrinkers have nothing more to give, then sleep until kicked again.
+ */
+static
+void
+shrinker_thread(void *junk1, unsigned long junk2)
+{
+	unsigned nfree;
+
+	(void)junk1;
+	(void)junk2;
+
+	while (1) {
+		P(shrinker_sem);
+
+		shrinker_run_deferred();
+		while ((nfree = coremap_freecount()) < SHRINK_HIGHWATER) {
+			if (shrink_memory(SHRINK_HIGHWATER - nfree) == 0) {
+				break;
+			}
+			shrinker_run_deferred();
+		}
+
+		spinlock_acquire(&shrinker_lock);
+		shrinker_kicked = false;
+		spinlock_release(&shrinker_lock);
+	}
+}
+
+void
+shrinker_bootstrap(void)
+{
+	int result;
+
+	shrinker_sem = sem_create("shrinker", 0);
+	if (shrinker_sem == NULL) {
+		panic("shrinker_bootstrap: sem_create failed\n");
+	}
+	result = thread_fork("shrinker", NULL, shrinker_thread, NULL, 0);
+	if (result) {
+		panic("shrinker_bootstrap: thread_fork failed: %s\n",
+		      strerror(result));
+	}
+}
@@ -0,0 +1,341 @@
+/*
+ * Swap space.
+ *
+ * All swap I/O is done under swap_lock. That also protects the slot
+ * bitmap and lets swap_setdevice change devices safely. swap_dup
+ * needs a page to copy through; it uses swap_bounce, allocated at
+ * boot, because asking for memory there could mean swapping.
+ *
+ * Pages go to the compressed pool in zswap.c first and to the device
+ * only if they don't fit there. Slot numbers tell the two apart.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <kern/stat.h>
+#include <lib.h>
+#include <bitmap.h>
+#include <clock.h>
+#include <synch.h>
+#include <uio.h>
+#include <vfs.h>
+#include <vnode.h>
+#include <vm.h>
+#include <swap.h>
+#include <zswap.h>
+#include <uw-vmstats.h>
+
+static struct lock *swap_lock;
+static struct vnode *swap_vnode;
+static struct bitmap *swap_map;
+static unsigned swap_nslots;
+static unsigned swap_nused;
+static void *swap_bounce;
+
+////////////////////////////////////////
+
+void
+swap_bootstrap(void)
+{
+	int result;
+
+	swap_lock = lock_create("swap");
+	if (swap_lock == NULL) {
+		panic("swap_bootstrap: lock_create failed\n");
+	}
+	swap_bounce = kmalloc(PAGE_SIZE);
+	if (swap_bounce == NULL) {
+		panic("swap_bootstrap: out of memory\n");
+	}
+	zswap_bootstrap();
+
+	result = swap_setdevice(SWAP_DEFAULT_DEVICE);
+	if (result) {
+		kprintf("swap: %s: %s; running without swap\n",
+			SWAP_DEFAULT_DEVICE, strerror(result));
+	}
+}
+
+void
+swap_shutdown(void)
+{
+	lock_acquire(swap_lock);
+	if (swap_vnode != NULL) {
+		vfs_close(swap_vnode);
+		bitmap_destroy(swap_map);
+		swap_vnode = NULL;
+		swap_map = NULL;
+		swap_nslots = 0;
+		swap_nused = 0;
+	}
+	lock_release(swap_lock);
+}
+
+int
+swap_setdevice(const char *path)
+{
+	struct vnode *v, *oldv;
+	struct bitmap *map, *oldmap;
+	struct stat st;
+	char *name;
+	off_t size;
+	unsigned nslots;
+	int result;
+
+	/* vfs_open destroys the string it's passed */
+	name = kstrdup(path);
+	if (name == NULL) {
+		return ENOMEM;
+	}
+	result = vfs_open(name, O_RDWR, 0, &v);
+	if (result == ENOENT) {
+		strcpy(name, path);
+		result = vfs_open(name, O_RDWR|O_CREAT, 0664, &v);
+	}
+	kfree(name);
+	if (result) {
+		return result;
+	}
+
+	result = VOP_STAT(v, &st);
+	if (result) {
+		vfs_close(v);
+		return result;
+	}
+	size = st.st_size;
+	if (size == 0) {
+		/* A new swap file; it grows as slots are written. */
+		size = SWAP_FILE_SIZE;
+	}
+	nslots = size / PAGE_SIZE;
+	if (nslots > ZSWAP_SLOTBASE) {
+		/* The slots above are the compressed pool's. */
+		nslots = ZSWAP_SLOTBASE;
+	}
+	if (nslots == 0) {
+		vfs_close(v);
+		return ENOSPC;
+	}
+
+	map = bitmap_create(nslots);
+	if (map == NULL) {
+		vfs_close(v);
+		return ENOMEM;
+	}
+
+	lock_acquire(swap_lock);
+	if (swap_nused > 0) {
+		lock_release(swap_lock);
+		bitmap_destroy(map);
+		vfs_close(v);
+		return EBUSY;
+	}
+	oldv = swap_vnode;
+	oldmap = swap_map;
+	swap_vnode = v;
+	swap_map = map;
+	swap_nslots = nslots;
+	lock_release(swap_lock);
+
+	if (oldv != NULL) {
+		vfs_close(oldv);
+		bitmap_destroy(oldmap);
+	}
+
+	kprintf("swap: %s, %u pages\n", path, nslots);
+	return 0;
+}
+
+bool
+swap_enabled(void)
+{
+	/* Unlocked; only a hint. The compressed pool alone doesn't count. */
+	return swap_vnode != NULL;
+}
+
+/*
+ * Move one page between BUF and SLOT. Caller holds swap_lock.
+ */
+static
+int
+swap_io(unsigned slot, void *buf, enum uio_rw rw)
+{
+	struct iovec iov;
+	struct uio u;
+	int result;
+
+	KASSERT(lock_do_i_hold(swap_lock));
+	KASSERT(slot < swap_nslots);
+
+	uio_kinit(&iov, &u, buf, PAGE_SIZE, (off_t)slot * PAGE_SIZE, rw);
+	if (rw == UIO_READ) {
+		result = VOP_READ(swap_vnode, &u);
+	}
+	else {
+		result = VOP_WRITE(swap_vnode, &u);
+	}
+	if (result) {
+		return result;
+	}
+	if (u.uio_resid != 0) {
+		return EIO;
+	}
+	return 0;
+}
+
+/*
+ * Allocate a slot. Caller holds swap_lock.
+ */
+static
+int
+swap_allocslot(unsigned *slot)
+{
+	KASSERT(lock_do_i_hold(swap_lock));
+
+	if (swap_vnode == NULL) {
+		return ENOSPC;
+	}
+	if (bitmap_alloc(swap_map, slot)) {
+		return ENOSPC;
+	}
+	swap_nused++;
+	return 0;
+}
+
+/*
+ * Free a slot. Caller holds swap_lock.
+ */
+static
+void
+swap_freeslot(unsigned slot)
+{
+	KASSERT(lock_do_i_hold(swap_lock));
+	KASSERT(bitmap_isset(swap_map, slot));
+
+	bitmap_unmark(swap_map, slot);
+	swap_nused--;
+}
+
+/*
+ * Add the time since SECS1/NSECS1 to the latency stat STAT, in
+ * microseconds. Waiting for swap_lock counts: it is part of what a
+ * fault pays.
+ */
+static
+void
+swap_account(unsigned stat, time_t secs1, uint32_t nsecs1)
+{
+	time_t secs2, secs;
+	uint32_t nsecs2, nsecs;
+
+	gettime(&secs2, &nsecs2);
+	getinterval(secs1, nsecs1, secs2, nsecs2, &secs, &nsecs);
+	vmstats_add(stat, secs * 1000000 + nsecs / 1000);
+}
+
+int
+swap_out(paddr_t paddr, unsigned *slot)
+{
+	time_t secs;
+	uint32_t nsecs;
+	int result;
+
+	gettime(&secs, &nsecs);
+	if (zswap_store((void *)PADDR_TO_KVADDR(paddr), slot) == 0) {
+		swap_account(VMSTAT_SWAP_OUT_USEC, secs, nsecs);
+		return 0;
+	}
+
+	lock_acquire(swap_lock);
+	result = swap_allocslot(slot);
+	if (result) {
+		lock_release(swap_lock);
+		return result;
+	}
+	result = swap_io(*slot, (void *)PADDR_TO_KVADDR(paddr), UIO_WRITE);
+	if (result) {
+		swap_freeslot(*slot);
+	}
+	else {
+		vmstats_inc(VMSTAT_SWAP_FILE_WRITE);
+	}
+	lock_release(swap_lock);
+	if (result == 0) {
+		swap_account(VMSTAT_SWAP_OUT_USEC, secs, nsecs);
+	}
+	return result;
+}
+
+int
+swap_in(unsigned slot, paddr_t paddr)
+{
+	time_t secs;
+	uint32_t nsecs;
+	int result;
+
+	gettime(&secs, &nsecs);
+	if (zswap_isslot(slot)) {
+		result = zswap_load(slot, (void *)PADDR_TO_KVADDR(paddr));
+		if (result == 0) {
+			vmstats_inc(VMSTAT_ZSWAP_LOAD);
+		}
+	}
+	else {
+		lock_acquire(swap_lock);
+		result = swap_io(slot, (void *)PADDR_TO_KVADDR(paddr),
+				 UIO_READ);
+		if (result == 0) {
+			vmstats_inc(VMSTAT_SWAP_FILE_READ);
+		}
+		lock_release(swap_lock);
+	}
+	if (result == 0) {
+		swap_account(VMSTAT_SWAP_IN_USEC, secs, nsecs);
+	}
+	return result;
+}
+
+void
+swap_free(unsigned slot)
+{
+	if (zswap_isslot(slot)) {
+		zswap_free(slot);
+		return;
+	}
+	lock_acquire(swap_lock);
+	swap_freeslot(slot);
+	lock_release(swap_lock);
+}
+
+int
+swap_dup(unsigned slot, unsigned *newslot)
+{
+	int result;
+
+	if (zswap_isslot(slot) && zswap_dup(slot, newslot) == 0) {
+		return 0;
+	}
+
+	lock_acquire(swap_lock);
+	result = swap_allocslot(newslot);
+	if (result) {
+		lock_release(swap_lock);
+		return result;
+	}
+	if (zswap_isslot(slot)) {
+		/* The pool is full; the copy goes to the device. */
+		result = zswap_load(slot, swap_bounce);
+	}
+	else {
+		result = swap_io(slot, swap_bounce, UIO_READ);
+	}
+	if (result == 0) {
+		result = swap_io(*newslot, swap_bounce, UIO_WRITE);
+	}
+	if (result) {
+		swap_freeslot(*newslot);
+	}
+	lock_release(swap_lock);
+	return result;
+}
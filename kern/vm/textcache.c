@@ -0,0 +1,216 @@
+/*
+ * Shared cache of read-only executable pages.
+ *
+ * A small hash table of (vnode, offset) -> frame, under one sleep
+ * lock. Nothing allocates, frees, reads or touches vnodes while
+ * holding the lock (even kfree may allocate a magazine, and so run
+ * the shrinkers), so vm_getuserpage may call textcache_reclaim from
+ * anywhere a fault can happen. Reclaiming walks the buckets from
+ * where the last walk stopped, so repeated calls don't keep
+ * rescanning pages in use.
+ *
+ * Dropping the cache's reference to a vnode can make SFS reclaim it,
+ * which takes SFS's locks and may write to disk; that isn't safe in
+ * whatever thread happened to run out of memory. So reclaimed entries
+ * go on textcache_released instead, and the shrinker thread drops
+ * their vnodes and frees them later.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <synch.h>
+#include <vnode.h>
+#include <vm.h>
+#include <coremap.h>
+#include <textcache.h>
+#include <shrinker.h>
+
+#define TEXTCACHE_BUCKETS  64
+
+struct textcache_entry {
+	struct vnode *te_vnode;
+	off_t te_offset;
+	paddr_t te_paddr;
+	struct textcache_entry *te_next;
+};
+
+static struct lock *textcache_lock;
+static struct textcache_entry *textcache_table[TEXTCACHE_BUCKETS];
+static unsigned textcache_hand;         /* next bucket to reclaim from */
+static struct textcache_entry *textcache_released;  /* vnode to drop */
+
+static
+unsigned
+textcache_hash(struct vnode *v, off_t offset)
+{
+	return ((uintptr_t)v / sizeof(void *) + offset / PAGE_SIZE) %
+		TEXTCACHE_BUCKETS;
+}
+
+/*
+ * Find the entry for OFFSET in V. Caller holds textcache_lock.
+ */
+static
+struct textcache_entry *
+textcache_find(struct vnode *v, off_t offset)
+{
+	struct textcache_entry *te;
+
+	KASSERT(lock_do_i_hold(textcache_lock));
+
+	for (te = textcache_table[textcache_hash(v, offset)]; te != NULL;
+	     te = te->te_next) {
+		if (te->te_vnode == v && te->te_offset == offset) {
+			return te;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Shrinker: free the frames of cached pages nobody maps. This is also
+ * what lets go of vnodes, which SFS reclaims once the cache drops its
+ * reference to them, though that part waits for textcache_release.
+ */
+static
+unsigned
+textcache_shrink(unsigned npages)
+{
+	paddr_t paddr;
+	unsigned n;
+
+	if (lock_do_i_hold(textcache_lock)) {
+		/* Can't happen, as nothing allocates under it; but be sure. */
+		return 0;
+	}
+
+	for (n=0; n<npages; n++) {
+		paddr = textcache_reclaim();
+		if (paddr == 0) {
+			break;
+		}
+		coremap_free(paddr);
+	}
+	return n;
+}
+
+/*
+ * Deferred part of the shrinker, run by the shrinker thread: drop the
+ * vnodes of the entries textcache_reclaim took out.
+ */
+static
+void
+textcache_release(void)
+{
+	struct textcache_entry *te, *next;
+
+	lock_acquire(textcache_lock);
+	te = textcache_released;
+	textcache_released = NULL;
+	lock_release(textcache_lock);
+
+	for (; te != NULL; te = next) {
+		next = te->te_next;
+		VOP_DECREF(te->te_vnode);
+		kfree(te);
+	}
+}
+
+////////////////////////////////////////
+
+void
+textcache_bootstrap(void)
+{
+	textcache_lock = lock_create("textcache");
+	if (textcache_lock == NULL) {
+		panic("textcache_bootstrap: lock_create failed\n");
+	}
+	shrinker_register("textcache", textcache_shrink, textcache_release);
+}
+
+paddr_t
+textcache_get(struct vnode *v, off_t offset)
+{
+	struct textcache_entry *te;
+	paddr_t paddr = 0;
+
+	KASSERT(offset % PAGE_SIZE == 0);
+
+	lock_acquire(textcache_lock);
+	te = textcache_find(v, offset);
+	if (te != NULL) {
+		paddr = te->te_paddr;
+		coremap_incref(paddr);
+	}
+	lock_release(textcache_lock);
+	return paddr;
+}
+
+paddr_t
+textcache_put(struct vnode *v, off_t offset, paddr_t paddr)
+{
+	struct textcache_entry *te, *old;
+	unsigned bucket;
+
+	KASSERT(offset % PAGE_SIZE == 0);
+	KASSERT(coremap_refcount(paddr) == 1);
+
+	te = kmalloc(sizeof(*te));
+	if (te == NULL) {
+		return paddr;
+	}
+
+	lock_acquire(textcache_lock);
+	old = textcache_find(v, offset);
+	if (old != NULL) {
+		/* Someone else read the same page meanwhile. */
+		coremap_incref(old->te_paddr);
+		lock_release(textcache_lock);
+		kfree(te);
+		free_kpages(PADDR_TO_KVADDR(paddr));
+		return old->te_paddr;
+	}
+	te->te_vnode = v;
+	te->te_offset = offset;
+	te->te_paddr = paddr;
+	bucket = textcache_hash(v, offset);
+	te->te_next = textcache_table[bucket];
+	textcache_table[bucket] = te;
+	VOP_INCREF(v);
+	/* One reference for the cache, one for the caller. */
+	coremap_incref(paddr);
+	lock_release(textcache_lock);
+	return paddr;
+}
+
+paddr_t
+textcache_reclaim(void)
+{
+	struct textcache_entry *te, **prev;
+	paddr_t paddr = 0;
+	unsigned n;
+
+	lock_acquire(textcache_lock);
+	for (n=0; n < TEXTCACHE_BUCKETS && paddr == 0; n++) {
+		prev = &textcache_table[textcache_hand];
+		textcache_hand = (textcache_hand + 1) % TEXTCACHE_BUCKETS;
+		for (te = *prev; te != NULL; prev = &te->te_next, te = *prev) {
+			/* Only our own reference left: nobody maps it. */
+			if (coremap_refcount(te->te_paddr) == 1) {
+				*prev = te->te_next;
+				paddr = te->te_paddr;
+				te->te_paddr = 0;
+				te->te_next = textcache_released;
+				textcache_released = te;
+				break;
+			}
+		}
+	}
+	lock_release(textcache_lock);
+
+	if (paddr != 0) {
+		/* Have the shrinker thread drop the vnode. */
+		shrinker_kick();
+	}
+	return paddr;
+}
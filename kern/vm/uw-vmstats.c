@@ -5,21 +5,32 @@
 /* NOTE !!!!!! WARNING !!!!!
  * All of the functions whose names begin with '_'
  * assume that atomicity is ensured elsewhere
- * (i.e., outside of these routines) by acquiring stats_lock.
+ * (i.e., outside of these routines) by having interrupts off.
  * All of the functions whose names do not begin
  * with '_' ensure atomicity locally.
+ *
+ * Counting happens on every TLB fault, so there is no shared lock:
+ * each cpu counts in its own row of stats_counts, and only the cpu
+ * itself writes to it. Reading sums up the rows.
  */
 
 #include <types.h>
 #include <lib.h>
 #include <synch.h>
 #include <spl.h>
+#include <cpu.h>
+#include <current.h>
+#include <platform/maxcpus.h>
 #include <uw-vmstats.h>
 
-/* Counters for tracking statistics */
-static unsigned int stats_counts[VMSTAT_COUNT];
+/* Rows padded to whole 64-byte cache lines, and the array aligned to
+ * one, so cpus don't share any */
+#define STATS_LINE  64
+#define STATS_ROW   ((VMSTAT_COUNT + 15) & ~15)
 
-struct spinlock stats_lock = SPINLOCK_INITIALIZER;
+/* Counters for tracking statistics, one row per cpu */
+static unsigned int stats_counts[MAXCPUS][STATS_ROW]
+  __attribute__((__aligned__(STATS_LINE)));
 
 /* Strings used in printing out the statistics */
 static const char *stats_names[] = {
@@ -33,6 +44,25 @@ static const char *stats_names[] = {
  /*  7 */ "Page Faults from ELF",
  /*  8 */ "Page Faults from Swapfile",
  /*  9 */ "Swapfile Writes",
+ /* 10 */ "Evictions (Clean)",
+ /* 11 */ "Evictions (Dirty)",
+ /* 12 */ "Clock Second Chances",
+ /* 13 */ "Zeroed Page Pool Hits",
+ /* 14 */ "Zeroed Page Pool Misses",
+ /* 15 */ "Shared Zero Page Mappings",
+ /* 16 */ "Shared Zero Page Copies",
+ /* 17 */ "Pages Read Ahead",
+ /* 18 */ "Compressed Swap Stores",
+ /* 19 */ "Compressed Swap Rejects",
+ /* 20 */ "Compressed Swap Loads",
+ /* 21 */ "Compressed Swap Bytes",
+ /* 22 */ "Pages Allocated",
+ /* 23 */ "Copy-on-Write Copies",
+ /* 24 */ "Pages Zeroed",
+ /* 25 */ "Swap In Microseconds",
+ /* 26 */ "Swap Out Microseconds",
+ /* 27 */ "TLB Shootdown IPIs",
+ /* 28 */ "Shrinker Pages Freed",
 };
 
 
@@ -41,23 +71,37 @@ static const char *stats_names[] = {
 void
 vmstats_inc(unsigned int index)
 {
-    spinlock_acquire(&stats_lock);
+    int spl;
+
+    spl = splhigh();
       _vmstats_inc(index);
-    spinlock_release(&stats_lock);
+    splx(spl);
+}
+
+/* ---------------------------------------------------------------------- */
+/* Assumes vmstat_init has already been called */
+void
+vmstats_add(unsigned int index, unsigned int amount)
+{
+    int spl;
+
+    spl = splhigh();
+      _vmstats_add(index, amount);
+    splx(spl);
 }
 
 /* ---------------------------------------------------------------------- */
 void
 vmstats_init(void)
 {
-  /* Although the spinlock is initialized at declaration time we do it here
-   * again in case we want use/reset these stats repeatedly without shutting down the kernel.
-   */
-  spinlock_init(&stats_lock);
+  int spl;
 
-  spinlock_acquire(&stats_lock);
+  /* Other cpus may still be counting; a reset while they do only
+   * loses their increments in between.
+   */
+  spl = splhigh();
     _vmstats_init();
-  spinlock_release(&stats_lock);
+  splx(spl);
 }
 
 /* ---------------------------------------------------------------------- */
@@ -65,7 +109,15 @@ void
 _vmstats_inc(unsigned int index)
 {
   KASSERT(index < VMSTAT_COUNT);
-  stats_counts[index]++;
+  stats_counts[curcpu->c_number][index]++;
+}
+
+/* ---------------------------------------------------------------------- */
+void
+_vmstats_add(unsigned int index, unsigned int amount)
+{
+  KASSERT(index < VMSTAT_COUNT);
+  stats_counts[curcpu->c_number][index] += amount;
 }
 
 /* ---------------------------------------------------------------------- */
@@ -73,6 +125,7 @@ void
 _vmstats_init(void)
 {
   int i = 0;
+  int j = 0;
 
   if (sizeof(stats_names) / sizeof(char *) != VMSTAT_COUNT) {
     kprintf("vmstats_init: number of stats_names = %d != VMSTAT_COUNT = %d\n",
@@ -80,17 +133,39 @@ _vmstats_init(void)
     panic("Should really fix this before proceeding\n");
   }
 
-  for (i=0; i<VMSTAT_COUNT; i++) {
-    stats_counts[i] = 0;
+  for (j=0; j<MAXCPUS; j++) {
+    for (i=0; i<VMSTAT_COUNT; i++) {
+      stats_counts[j][i] = 0;
+    }
   }
 
 }
 
 /* ---------------------------------------------------------------------- */
 /* Assumes vmstat_init has already been called */
-/* NOTE: We do not grab the spinlock here because kprintf may block
- * and we can't block while holding a spinlock.
- * Just use this when there is only one thread remaining.
+/* NOTE: The rows are read while their cpus may be writing them. Each
+ * count is a single word, so every one comes out whole, but the counts
+ * need not all be from the same instant.
+ */
+void
+vmstats_snapshot(unsigned int *counts)
+{
+  int i = 0;
+  int j = 0;
+
+  for (i=0; i<VMSTAT_COUNT; i++) {
+    counts[i] = 0;
+    for (j=0; j<MAXCPUS; j++) {
+      counts[i] += ((volatile unsigned int *)stats_counts[j])[i];
+    }
+  }
+}
+
+/* ---------------------------------------------------------------------- */
+/* Assumes vmstat_init has already been called */
+/* NOTE: This prints a snapshot, so the consistency checks below only
+ * hold when nothing else is running, e.g. when there is only one
+ * thread remaining.
  */
 
 void
@@ -102,6 +177,12 @@ vmstats_print(void)
   int tlb_faults = 0;
   int elf_plus_swap_reads = 0;
   int disk_reads = 0;
+  int swap_loads = 0;
+  int swap_stores = 0;
+  int ratio = 0;
+  unsigned int stats_counts[VMSTAT_COUNT];
+
+  vmstats_snapshot(stats_counts);
 
   kprintf("VMSTATS:\n");
   for (i=0; i<VMSTAT_COUNT; i++) {
@@ -112,8 +193,11 @@ vmstats_print(void)
   free_plus_replace = stats_counts[VMSTAT_TLB_FAULT_FREE] + stats_counts[VMSTAT_TLB_FAULT_REPLACE];
   disk_plus_zeroed_plus_reload = stats_counts[VMSTAT_PAGE_FAULT_DISK] +
     stats_counts[VMSTAT_PAGE_FAULT_ZERO] + stats_counts[VMSTAT_TLB_RELOAD];
-  elf_plus_swap_reads = stats_counts[VMSTAT_ELF_FILE_READ] + stats_counts[VMSTAT_SWAP_FILE_READ];
-  disk_reads = stats_counts[VMSTAT_PAGE_FAULT_DISK];
+  /* Pages loaded from compressed swap never reach the swapfile */
+  swap_loads = stats_counts[VMSTAT_SWAP_FILE_READ] + stats_counts[VMSTAT_ZSWAP_LOAD];
+  elf_plus_swap_reads = stats_counts[VMSTAT_ELF_FILE_READ] + swap_loads;
+  /* Read-ahead reads from disk too, but not for a page fault */
+  disk_reads = stats_counts[VMSTAT_PAGE_FAULT_DISK] + stats_counts[VMSTAT_PAGE_READAHEAD];
 
   kprintf("VMSTAT TLB Faults with Free + TLB Faults with Replace = %d\n", free_plus_replace);
   if (tlb_faults != free_plus_replace) {
@@ -128,10 +212,28 @@ vmstats_print(void)
       tlb_faults, disk_plus_zeroed_plus_reload); 
   }
 
-  kprintf("VMSTAT ELF File reads + Swapfile reads = %d\n", elf_plus_swap_reads);
+  kprintf("VMSTAT ELF File reads + Swapfile reads + Compressed Swap Loads = %d\n", elf_plus_swap_reads);
   if (disk_reads != elf_plus_swap_reads) {
-    kprintf("WARNING: ELF File reads + Swapfile reads != Page Faults (Disk) %d\n",
+    kprintf("WARNING: ELF File reads + Swapfile reads + Compressed Swap Loads != Page Faults (Disk) + Pages Read Ahead %d\n",
       elf_plus_swap_reads);
   }
+
+  /* Uncompressed over compressed size, in hundredths */
+  if (stats_counts[VMSTAT_ZSWAP_BYTES] > 0) {
+    ratio = (int)((uint64_t)stats_counts[VMSTAT_ZSWAP_STORE] * 4096 * 100 /
+      stats_counts[VMSTAT_ZSWAP_BYTES]);
+    kprintf("VMSTAT Compressed Swap Ratio = %d.%02d\n", ratio / 100, ratio % 100);
+  }
+  if (swap_loads > 0) {
+    kprintf("VMSTAT Compressed Swap Hit Rate = %d percent\n",
+      (int)((uint64_t)stats_counts[VMSTAT_ZSWAP_LOAD] * 100 / swap_loads));
+    kprintf("VMSTAT Average Swap In Microseconds = %d\n",
+      stats_counts[VMSTAT_SWAP_IN_USEC] / swap_loads);
+  }
+  swap_stores = stats_counts[VMSTAT_SWAP_FILE_WRITE] + stats_counts[VMSTAT_ZSWAP_STORE];
+  if (swap_stores > 0) {
+    kprintf("VMSTAT Average Swap Out Microseconds = %d\n",
+      stats_counts[VMSTAT_SWAP_OUT_USEC] / swap_stores);
+  }
 }
 /* ---------------------------------------------------------------------- */
@@ -0,0 +1,419 @@
+/*
+ * Compressed swap pool.
+ *
+ * Everything happens under zswap_lock, which also protects the
+ * compressor's scratch space. The compressor is an LZ77 variant in
+ * the style of LZF: a control byte below ZSWAP_MAXRUN starts a run of
+ * that many plus one literal bytes; anything else is a back reference
+ * whose length minus two is in the top three bits (7 meaning "plus
+ * the next byte") and whose offset minus one is in the low five bits
+ * and the byte after. Matches are found through a small hash table
+ * of the last position each three-byte string was seen at; stale
+ * entries from earlier pages are harmless, since matches are checked.
+ *
+ * Pool frames holding objects of a class with some free are on that
+ * class's partial list; frames holding nothing are on the empty list
+ * and can be given to any class.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <synch.h>
+#include <vm.h>
+#include <coremap.h>
+#include <zswap.h>
+#include <uw-vmstats.h>
+
+#define ZSWAP_MINMATCH   3
+#define ZSWAP_MAXMATCH   (7 + 255 + 2)
+#define ZSWAP_MAXOFFSET  8192
+#define ZSWAP_MAXRUN     32
+#define ZSWAP_HLOG       10
+#define ZSWAP_HASH(p) \
+	((((unsigned)(p)[0] << 16 | (unsigned)(p)[1] << 8 | (p)[2]) * \
+	  2654435761U) >> (32 - ZSWAP_HLOG))
+
+#define ZSWAP_CLASSBYTES(c)  (((c) + 1) * ZSWAP_CLASSSIZE)
+#define ZSWAP_CLASSOBJS(c)   (PAGE_SIZE / ZSWAP_CLASSBYTES(c))
+
+struct zswap_frame {
+	uint8_t *zf_data;
+	int zf_class;                   /* -1 while on the empty list */
+	unsigned zf_nfree;              /* free objects */
+	uint32_t zf_used;               /* bitmap of objects in use */
+	uint16_t zf_len[ZSWAP_MAXOBJS]; /* compressed size of each */
+	int zf_next;                    /* list links, frame numbers or -1 */
+	int zf_prev;
+};
+
+static struct lock *zswap_lock;
+static struct zswap_frame *zswap_frames;
+static unsigned zswap_nframes;
+static int zswap_partial[ZSWAP_NCLASSES];
+static int zswap_empty;
+
+/* Compressor scratch space */
+static uint16_t zswap_htab[1 << ZSWAP_HLOG];
+static uint8_t zswap_buf[ZSWAP_MAXSIZE];
+
+////////////////////////////////////////
+// compressor
+
+/*
+ * Append the N bytes at LIT to OUT, at *OP, as literal runs. Fails if
+ * that would take OUT past OUTMAX bytes.
+ */
+static
+int
+zswap_literals(const uint8_t *lit, size_t n, uint8_t *out, size_t *op,
+	       size_t outmax)
+{
+	size_t run;
+
+	while (n > 0) {
+		run = n < ZSWAP_MAXRUN ? n : ZSWAP_MAXRUN;
+		if (*op + 1 + run > outmax) {
+			return -1;
+		}
+		out[(*op)++] = run - 1;
+		memcpy(out + *op, lit, run);
+		*op += run;
+		lit += run;
+		n -= run;
+	}
+	return 0;
+}
+
+/*
+ * Compress the page at IN into at most OUTMAX bytes at OUT. Returns
+ * the compressed size, or 0 if it doesn't fit.
+ */
+static
+size_t
+zswap_compress(const uint8_t *in, uint8_t *out, size_t outmax)
+{
+	size_t ip = 0, op = 0, anchor = 0, ref, len, off;
+	unsigned h;
+
+	while (ip + ZSWAP_MINMATCH <= PAGE_SIZE) {
+		h = ZSWAP_HASH(in + ip);
+		ref = zswap_htab[h];
+		zswap_htab[h] = ip;
+		if (ref >= ip || ip - ref > ZSWAP_MAXOFFSET ||
+		    in[ref] != in[ip] || in[ref + 1] != in[ip + 1] ||
+		    in[ref + 2] != in[ip + 2]) {
+			ip++;
+			continue;
+		}
+		len = ZSWAP_MINMATCH;
+		while (ip + len < PAGE_SIZE && len < ZSWAP_MAXMATCH &&
+		       in[ref + len] == in[ip + len]) {
+			len++;
+		}
+
+		if (zswap_literals(in + anchor, ip - anchor, out, &op, outmax)) {
+			return 0;
+		}
+		if (op + 3 > outmax) {
+			return 0;
+		}
+		off = ip - ref - 1;
+		if (len - 2 < 7) {
+			out[op++] = (len - 2) << 5 | off >> 8;
+		}
+		else {
+			out[op++] = 7 << 5 | off >> 8;
+			out[op++] = len - 2 - 7;
+		}
+		out[op++] = off & 0xff;
+		ip += len;
+		anchor = ip;
+	}
+	if (zswap_literals(in + anchor, PAGE_SIZE - anchor, out, &op, outmax)) {
+		return 0;
+	}
+	return op;
+}
+
+/*
+ * Uncompress the INLEN bytes at IN into the page at OUT.
+ */
+static
+int
+zswap_decompress(const uint8_t *in, size_t inlen, uint8_t *out)
+{
+	size_t ip = 0, op = 0, len, off;
+	unsigned ctrl;
+
+	while (ip < inlen) {
+		ctrl = in[ip++];
+		if (ctrl < ZSWAP_MAXRUN) {
+			len = ctrl + 1;
+			if (ip + len > inlen || op + len > PAGE_SIZE) {
+				return EIO;
+			}
+			memcpy(out + op, in + ip, len);
+			ip += len;
+			op += len;
+			continue;
+		}
+		len = ctrl >> 5;
+		if (len == 7) {
+			if (ip >= inlen) {
+				return EIO;
+			}
+			len += in[ip++];
+		}
+		len += 2;
+		if (ip >= inlen) {
+			return EIO;
+		}
+		off = ((ctrl & 0x1f) << 8 | in[ip++]) + 1;
+		if (off > op || op + len > PAGE_SIZE) {
+			return EIO;
+		}
+		/* Byte at a time: the match may overlap what it produces. */
+		for (; len > 0; len--, op++) {
+			out[op] = out[op - off];
+		}
+	}
+	return op == PAGE_SIZE ? 0 : EIO;
+}
+
+////////////////////////////////////////
+// pool
+
+static
+void
+zswap_push(int *head, int f)
+{
+	zswap_frames[f].zf_prev = -1;
+	zswap_frames[f].zf_next = *head;
+	if (*head >= 0) {
+		zswap_frames[*head].zf_prev = f;
+	}
+	*head = f;
+}
+
+static
+void
+zswap_remove(int *head, int f)
+{
+	struct zswap_frame *zf = &zswap_frames[f];
+
+	if (zf->zf_prev >= 0) {
+		zswap_frames[zf->zf_prev].zf_next = zf->zf_next;
+	}
+	else {
+		KASSERT(*head == f);
+		*head = zf->zf_next;
+	}
+	if (zf->zf_next >= 0) {
+		zswap_frames[zf->zf_next].zf_prev = zf->zf_prev;
+	}
+}
+
+/*
+ * Find SLOT's frame and object. Caller holds zswap_lock.
+ */
+static
+struct zswap_frame *
+zswap_lookup(unsigned slot, unsigned *obj)
+{
+	struct zswap_frame *zf;
+
+	KASSERT(zswap_isslot(slot));
+	slot -= ZSWAP_SLOTBASE;
+	KASSERT(slot / ZSWAP_MAXOBJS < zswap_nframes);
+	zf = &zswap_frames[slot / ZSWAP_MAXOBJS];
+	*obj = slot % ZSWAP_MAXOBJS;
+	KASSERT(zf->zf_used & (1U << *obj));
+	return zf;
+}
+
+/*
+ * Take an object of class C for LEN bytes and return where it is,
+ * with its slot in SLOT, or NULL if the pool is full. Caller holds
+ * zswap_lock.
+ */
+static
+uint8_t *
+zswap_alloc(unsigned c, size_t len, unsigned *slot)
+{
+	struct zswap_frame *zf;
+	unsigned obj;
+	int f;
+
+	KASSERT(lock_do_i_hold(zswap_lock));
+
+	f = zswap_partial[c];
+	if (f < 0) {
+		f = zswap_empty;
+		if (f < 0) {
+			return NULL;
+		}
+		zswap_remove(&zswap_empty, f);
+		zswap_frames[f].zf_class = c;
+		zswap_frames[f].zf_nfree = ZSWAP_CLASSOBJS(c);
+		zswap_frames[f].zf_used = 0;
+		zswap_push(&zswap_partial[c], f);
+	}
+	zf = &zswap_frames[f];
+	KASSERT(zf->zf_class == (int)c && zf->zf_nfree > 0);
+
+	for (obj = 0; zf->zf_used & (1U << obj); obj++) {
+		/* nothing */
+	}
+	KASSERT(obj < ZSWAP_CLASSOBJS(c));
+	zf->zf_used |= 1U << obj;
+	zf->zf_len[obj] = len;
+	zf->zf_nfree--;
+	if (zf->zf_nfree == 0) {
+		zswap_remove(&zswap_partial[c], f);
+	}
+
+	*slot = ZSWAP_SLOTBASE + f * ZSWAP_MAXOBJS + obj;
+	return zf->zf_data + obj * ZSWAP_CLASSBYTES(c);
+}
+
+////////////////////////////////////////
+
+void
+zswap_bootstrap(void)
+{
+	unsigned i;
+	vaddr_t va;
+
+	zswap_lock = lock_create("zswap");
+	if (zswap_lock == NULL) {
+		panic("zswap_bootstrap: lock_create failed\n");
+	}
+
+	zswap_empty = -1;
+	for (i=0; i<ZSWAP_NCLASSES; i++) {
+		zswap_partial[i] = -1;
+	}
+
+	zswap_nframes = coremap_freecount() / ZSWAP_POOLDIV;
+	if (zswap_nframes > ZSWAP_MAXPOOL) {
+		zswap_nframes = ZSWAP_MAXPOOL;
+	}
+	if (zswap_nframes == 0) {
+		return;
+	}
+	zswap_frames = kmalloc(zswap_nframes * sizeof(*zswap_frames));
+	if (zswap_frames == NULL) {
+		panic("zswap_bootstrap: out of memory\n");
+	}
+	for (i=0; i<zswap_nframes; i++) {
+		va = alloc_kpages(1);
+		if (va == 0) {
+			panic("zswap_bootstrap: out of memory\n");
+		}
+		zswap_frames[i].zf_data = (uint8_t *)va;
+		zswap_frames[i].zf_class = -1;
+		zswap_frames[i].zf_used = 0;
+		zswap_push(&zswap_empty, i);
+	}
+
+	kprintf("zswap: %u pages\n", zswap_nframes);
+}
+
+bool
+zswap_isslot(unsigned slot)
+{
+	return slot >= ZSWAP_SLOTBASE;
+}
+
+int
+zswap_store(const void *page, unsigned *slot)
+{
+	uint8_t *obj;
+	size_t len;
+
+	if (zswap_nframes == 0) {
+		return ENOSPC;
+	}
+
+	lock_acquire(zswap_lock);
+	len = zswap_compress(page, zswap_buf, ZSWAP_MAXSIZE);
+	obj = NULL;
+	if (len > 0) {
+		obj = zswap_alloc((len - 1) / ZSWAP_CLASSSIZE, len, slot);
+	}
+	if (obj == NULL) {
+		lock_release(zswap_lock);
+		vmstats_inc(VMSTAT_ZSWAP_REJECT);
+		return ENOSPC;
+	}
+	memcpy(obj, zswap_buf, len);
+	lock_release(zswap_lock);
+
+	vmstats_inc(VMSTAT_ZSWAP_STORE);
+	vmstats_add(VMSTAT_ZSWAP_BYTES, len);
+	return 0;
+}
+
+int
+zswap_load(unsigned slot, void *page)
+{
+	struct zswap_frame *zf;
+	unsigned obj;
+	int result;
+
+	lock_acquire(zswap_lock);
+	zf = zswap_lookup(slot, &obj);
+	result = zswap_decompress(zf->zf_data +
+				  obj * ZSWAP_CLASSBYTES(zf->zf_class),
+				  zf->zf_len[obj], page);
+	lock_release(zswap_lock);
+	return result;
+}
+
+void
+zswap_free(unsigned slot)
+{
+	struct zswap_frame *zf;
+	unsigned obj;
+	bool wasfull;
+	int f;
+
+	lock_acquire(zswap_lock);
+	zf = zswap_lookup(slot, &obj);
+	f = zf - zswap_frames;
+	wasfull = zf->zf_nfree == 0;
+	zf->zf_used &= ~(1U << obj);
+	zf->zf_nfree++;
+	if (zf->zf_used == 0) {
+		if (!wasfull) {
+			zswap_remove(&zswap_partial[zf->zf_class], f);
+		}
+		zf->zf_class = -1;
+		zswap_push(&zswap_empty, f);
+	}
+	else if (wasfull) {
+		zswap_push(&zswap_partial[zf->zf_class], f);
+	}
+	lock_release(zswap_lock);
+}
+
+int
+zswap_dup(unsigned slot, unsigned *newslot)
+{
+	struct zswap_frame *zf;
+	unsigned obj;
+	uint8_t *newobj;
+
+	lock_acquire(zswap_lock);
+	zf = zswap_lookup(slot, &obj);
+	newobj = zswap_alloc(zf->zf_class, zf->zf_len[obj], newslot);
+	if (newobj == NULL) {
+		lock_release(zswap_lock);
+		return ENOSPC;
+	}
+	memcpy(newobj, zf->zf_data + obj * ZSWAP_CLASSBYTES(zf->zf_class),
+	       zf->zf_len[obj]);
+	lock_release(zswap_lock);
+	return 0;
+}
@@ -0,0 +1,20 @@
+#ifndef _SYS_MMAN_H_
+#define _SYS_MMAN_H_
+
+/*
+ * Memory mapping calls.
+ */
+
+#include <sys/types.h>
+#include <kern/mman.h>
+
+/* What mmap() returns on error. */
+#define MAP_FAILED   ((void *)-1)
+
+void *mmap(void *addr, size_t len, int prot, int flags, int fd, off_t offset);
+int munmap(void *addr, size_t len);
+int mprotect(void *addr, size_t len, int prot);
+int madvise(void *addr, size_t len, int advice);
+int mincore(void *addr, size_t len, unsigned char *vec);
+
+#endif /* _SYS_MMAN_H_ */
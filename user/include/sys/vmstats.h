@@ -0,0 +1,18 @@
+#ifndef _SYS_VMSTATS_H_
+#define _SYS_VMSTATS_H_
+
+/*
+ * Virtual memory statistics.
+ */
+
+#include <kern/vmstats.h>
+
+/*
+ * Copy up to NCOUNTS of the kernel's VM counters, indexed by VMSTAT_*,
+ * into COUNTS. Returns how many counters the kernel has. The counters
+ * only ever go up (until the kernel resets them), so take one
+ * snapshot before and one after and subtract.
+ */
+int __vmstats(unsigned *counts, unsigned ncounts);
+
+#endif /* _SYS_VMSTATS_H_ */
@@ -0,0 +1,84 @@
+/*
+ * forkbench - measure fork latency.
+ *
+ * Usage: forkbench [iterations] [pages]
+ *
+ * Touches PAGES pages of data and then forks ITERATIONS times. Each
+ * child writes to a single page and exits at once, which is what the
+ * fork-then-execv pattern of the shell looks like to the VM system,
+ * and the parent waits for it. Prints the average time per fork.
+ *
+ * With copy-on-write fork the time per fork should hardly depend on
+ * PAGES; with an eager as_copy it grows linearly. The parent also
+ * checks that the child's writes did not show up in its own copy.
+ */
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <err.h>
+
+#define PAGE_SIZE	4096
+#define MAXPAGES	128
+
+static char buf[MAXPAGES * PAGE_SIZE];
+
+int
+main(int argc, char *argv[])
+{
+	int iterations = 100;
+	int npages = 64;
+	int i, j, status;
+	pid_t pid;
+	time_t secs1, secs2;
+	unsigned long nsecs1, nsecs2;
+	unsigned long long usecs;
+
+	if (argc > 1) {
+		iterations = atoi(argv[1]);
+	}
+	if (argc > 2) {
+		npages = atoi(argv[2]);
+	}
+	if (iterations <= 0 || npages <= 0 || npages > MAXPAGES) {
+		errx(1, "Usage: forkbench [iterations] [pages <= %d]",
+		     MAXPAGES);
+	}
+
+	for (j=0; j<npages; j++) {
+		buf[j * PAGE_SIZE] = 'p';
+	}
+
+	__time(&secs1, &nsecs1);
+	for (i=0; i<iterations; i++) {
+		pid = fork();
+		if (pid < 0) {
+			err(1, "fork");
+		}
+		if (pid == 0) {
+			buf[(i % npages) * PAGE_SIZE] = 'c';
+			_exit(0);
+		}
+		if (waitpid(pid, &status, 0) < 0) {
+			err(1, "waitpid");
+		}
+	}
+	__time(&secs2, &nsecs2);
+
+	for (j=0; j<npages; j++) {
+		if (buf[j * PAGE_SIZE] != 'p') {
+			errx(1, "page %d was changed by a child", j);
+		}
+	}
+
+	usecs = (secs2 - secs1) * 1000000ULL;
+	usecs += nsecs2 / 1000;
+	usecs -= nsecs1 / 1000;
+
+	printf("forkbench: %d forks with %d pages touched: "
+	       "%llu usec total, %llu usec per fork\n",
+	       iterations, npages, usecs, usecs / iterations);
+	return 0;
+}
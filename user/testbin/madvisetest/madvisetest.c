@@ -0,0 +1,129 @@
+/*
+ * madvisetest - check madvise and mincore.
+ *
+ * Usage: madvisetest
+ *
+ * Uses mincore to watch pages come and go: anonymous pages appear
+ * when written and go away with MADV_DONTNEED, coming back zeroed.
+ * Pages of initialized data are read in by MADV_WILLNEED, come back
+ * from the executable after MADV_DONTNEED, and under MADV_SEQUENTIAL
+ * a fault on one page reads in the next. Also checks the errors for
+ * bad advice and unmapped pages.
+ */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <err.h>
+
+#define PAGE_SIZE	4096
+#define NPAGES		8
+
+/* Initialized, so that it is paged in from the executable. */
+static char data[(NPAGES + 1) * PAGE_SIZE] = "madvisetest";
+
+/*
+ * Return the number of the NPAGES pages from P that mincore says are
+ * in memory.
+ */
+static
+int
+resident(void *p, int npages)
+{
+	unsigned char vec[NPAGES];
+	int i, n = 0;
+
+	if (mincore(p, npages * PAGE_SIZE, vec) < 0) {
+		err(1, "mincore");
+	}
+	for (i=0; i<npages; i++) {
+		if (vec[i] & MINCORE_INCORE) {
+			n++;
+		}
+	}
+	return n;
+}
+
+int
+main(void)
+{
+	unsigned char vec[1];
+	char *p, *d;
+	int i;
+
+	/* Anonymous memory */
+	p = mmap(NULL, NPAGES * PAGE_SIZE, PROT_READ | PROT_WRITE,
+		 MAP_PRIVATE | MAP_ANON, -1, 0);
+	if (p == MAP_FAILED) {
+		err(1, "mmap");
+	}
+	if (resident(p, NPAGES) != 0) {
+		errx(1, "FAILED: untouched pages are in memory");
+	}
+	for (i=0; i<NPAGES; i++) {
+		p[i * PAGE_SIZE] = 1;
+	}
+	if (resident(p, NPAGES) != NPAGES) {
+		errx(1, "FAILED: written pages are not in memory");
+	}
+	if (madvise(p, NPAGES * PAGE_SIZE, MADV_DONTNEED) < 0) {
+		err(1, "madvise MADV_DONTNEED");
+	}
+	if (resident(p, NPAGES) != 0) {
+		errx(1, "FAILED: MADV_DONTNEED left pages in memory");
+	}
+	for (i=0; i<NPAGES; i++) {
+		if (p[i * PAGE_SIZE] != 0) {
+			errx(1, "FAILED: page %d not zeroed after "
+			     "MADV_DONTNEED", i);
+		}
+	}
+
+	/* Initialized data, whole pages of it */
+	d = (char *)(((uintptr_t)data + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1));
+	if (madvise(d, NPAGES * PAGE_SIZE, MADV_WILLNEED) < 0) {
+		err(1, "madvise MADV_WILLNEED");
+	}
+	if (resident(d, NPAGES) != NPAGES) {
+		errx(1, "FAILED: MADV_WILLNEED did not read the pages in");
+	}
+	d[PAGE_SIZE] = 'x';
+	if (madvise(d, NPAGES * PAGE_SIZE, MADV_DONTNEED) < 0) {
+		err(1, "madvise MADV_DONTNEED");
+	}
+	if (resident(d, NPAGES) != 0) {
+		errx(1, "FAILED: MADV_DONTNEED left data pages in memory");
+	}
+	if (d[PAGE_SIZE] != 0) {
+		errx(1, "FAILED: data page not read back from the executable");
+	}
+	if (madvise(d, NPAGES * PAGE_SIZE, MADV_DONTNEED) < 0 ||
+	    madvise(d, NPAGES * PAGE_SIZE, MADV_SEQUENTIAL) < 0) {
+		err(1, "madvise MADV_SEQUENTIAL");
+	}
+	(void)*(volatile char *)d;
+	if (resident(d + PAGE_SIZE, 1) != 1) {
+		errx(1, "FAILED: MADV_SEQUENTIAL did not read ahead");
+	}
+
+	/* Errors */
+	if (madvise(p, PAGE_SIZE, 12345) == 0 || errno != EINVAL) {
+		errx(1, "FAILED: bad advice was not EINVAL");
+	}
+	if (munmap(p, NPAGES * PAGE_SIZE) < 0) {
+		err(1, "munmap");
+	}
+	if (mincore(p, PAGE_SIZE, vec) == 0 || errno != ENOMEM) {
+		errx(1, "FAILED: mincore of unmapped page was not ENOMEM");
+	}
+	if (madvise(p, PAGE_SIZE, MADV_WILLNEED) == 0 || errno != ENOMEM) {
+		errx(1, "FAILED: madvise of unmapped page was not ENOMEM");
+	}
+
+	printf("madvisetest: passed\n");
+	return 0;
+}
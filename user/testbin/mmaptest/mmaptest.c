@@ -0,0 +1,155 @@
+/*
+ * mmaptest - check anonymous mmap, munmap and mprotect.
+ *
+ * Usage: mmaptest [pages]
+ *
+ * Maps PAGES pages, checks that they come zeroed, fills and checks
+ * them. Unmaps a page in the middle and checks that the pages on
+ * either side kept their contents and that a new mapping reuses
+ * the hole zeroed. Then makes the mapping read-only, checks that it
+ * can still be read, and that a child writing to it is killed.
+ */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <signal.h>
+#include <errno.h>
+#include <err.h>
+
+#define PAGE_SIZE	4096
+
+/*
+ * Each page of the mapping is marked with its page number and a
+ * generation, in its first and last words, so a page that moved, was
+ * lost at either end, or is left over from before shows up.
+ * Generation 0 means the page should still be zero-filled.
+ */
+static
+int
+tag(int page, int gen)
+{
+	return gen == 0 ? 0 : (gen << 16) | page;
+}
+
+static
+void
+mark(char *base, int from, int to, int gen)
+{
+	int *w;
+
+	for (; from < to; from++) {
+		w = (int *)(base + from * PAGE_SIZE);
+		w[0] = tag(from, gen);
+		w[PAGE_SIZE / sizeof(int) - 1] = tag(from, gen);
+	}
+}
+
+/* Returns the first page in [from, to) not marked GEN, or -1. */
+static
+int
+firstbad(const char *base, int from, int to, int gen)
+{
+	const int *w;
+
+	for (; from < to; from++) {
+		w = (const int *)(base + from * PAGE_SIZE);
+		if (w[0] != tag(from, gen) ||
+		    w[PAGE_SIZE / sizeof(int) - 1] != tag(from, gen)) {
+			return from;
+		}
+	}
+	return -1;
+}
+
+int
+main(int argc, char *argv[])
+{
+	int npages = 16;
+	int mid, bad, status;
+	char *p, *q;
+	pid_t pid;
+
+	if (argc > 1) {
+		npages = atoi(argv[1]);
+	}
+	if (npages < 3) {
+		errx(1, "Usage: mmaptest [pages >= 3]");
+	}
+	mid = npages / 2;
+
+	p = mmap(NULL, npages * PAGE_SIZE, PROT_READ | PROT_WRITE,
+		 MAP_PRIVATE | MAP_ANON, -1, 0);
+	if (p == MAP_FAILED) {
+		err(1, "mmap");
+	}
+	bad = firstbad(p, 0, npages, 0);
+	if (bad >= 0) {
+		errx(1, "FAILED: page %d of new mapping not zeroed", bad);
+	}
+	mark(p, 0, npages, 1);
+	bad = firstbad(p, 0, npages, 1);
+	if (bad >= 0) {
+		errx(1, "FAILED: page %d lost its contents", bad);
+	}
+
+	if (munmap(p + mid * PAGE_SIZE, PAGE_SIZE) < 0) {
+		err(1, "munmap");
+	}
+	if (firstbad(p, 0, mid, 1) >= 0 ||
+	    firstbad(p, mid + 1, npages, 1) >= 0) {
+		errx(1, "FAILED: munmap disturbed the pages around the hole");
+	}
+	q = mmap(p + mid * PAGE_SIZE, PAGE_SIZE, PROT_READ | PROT_WRITE,
+		 MAP_PRIVATE | MAP_ANON | MAP_FIXED, -1, 0);
+	if (q != p + mid * PAGE_SIZE) {
+		err(1, "FAILED: mmap MAP_FIXED into the hole");
+	}
+	if (firstbad(p, mid, mid + 1, 0) >= 0) {
+		errx(1, "FAILED: remapped page not zeroed");
+	}
+	mark(p, mid, mid + 1, 1);
+
+	if (mprotect(p, npages * PAGE_SIZE, PROT_READ) < 0) {
+		err(1, "mprotect");
+	}
+	bad = firstbad(p, 0, npages, 1);
+	if (bad >= 0) {
+		errx(1, "FAILED: page %d unreadable after mprotect", bad);
+	}
+
+	pid = fork();
+	if (pid < 0) {
+		err(1, "fork");
+	}
+	if (pid == 0) {
+		p[0] = 0;
+		/* should not get here */
+		_exit(0);
+	}
+	if (waitpid(pid, &status, 0) < 0) {
+		err(1, "waitpid");
+	}
+	if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+		errx(1, "FAILED: write to read-only mapping succeeded");
+	}
+
+	if (mprotect(p, npages * PAGE_SIZE, PROT_READ | PROT_WRITE) < 0) {
+		err(1, "mprotect");
+	}
+	mark(p, 0, npages, 2);
+	bad = firstbad(p, 0, npages, 2);
+	if (bad >= 0) {
+		errx(1, "FAILED: page %d lost its contents after mprotect",
+		     bad);
+	}
+	if (munmap(p, npages * PAGE_SIZE) < 0) {
+		err(1, "munmap");
+	}
+
+	printf("mmaptest: passed\n");
+	return 0;
+}
@@ -0,0 +1,126 @@
+/*
+ * sbrktest - check that the heap grows and shrinks.
+ *
+ * Usage: sbrktest [pages]
+ *
+ * Grows the heap by PAGES pages, fills them, and checks them. Then
+ * gives most of them back, grows the heap again and checks that the
+ * pages that were given back come back zeroed, while the page below
+ * the break kept its contents. Also checks that the break can't be
+ * moved below the start of the heap.
+ */
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <err.h>
+
+#define PAGE_SIZE	4096
+
+static
+void
+fill(char *p, int npages, int seed)
+{
+	int i;
+
+	for (i=0; i<npages * PAGE_SIZE; i += 64) {
+		p[i] = (char)(seed + i / PAGE_SIZE);
+	}
+}
+
+static
+int
+check(const char *p, int npages, int seed)
+{
+	int i;
+
+	for (i=0; i<npages * PAGE_SIZE; i += 64) {
+		if (p[i] != (char)(seed + i / PAGE_SIZE)) {
+			return i / PAGE_SIZE;
+		}
+	}
+	return -1;
+}
+
+static
+int
+checkzero(const char *p, int npages)
+{
+	int i;
+
+	for (i=0; i<npages * PAGE_SIZE; i += 64) {
+		if (p[i] != 0) {
+			return i / PAGE_SIZE;
+		}
+	}
+	return -1;
+}
+
+int
+main(int argc, char *argv[])
+{
+	int npages = 64;
+	char *base, *p;
+	int bad;
+
+	if (argc > 1) {
+		npages = atoi(argv[1]);
+	}
+	if (npages < 2) {
+		errx(1, "Usage: sbrktest [pages >= 2]");
+	}
+
+	base = sbrk(0);
+	if (base == (void *)-1) {
+		err(1, "sbrk(0)");
+	}
+
+	p = sbrk(npages * PAGE_SIZE);
+	if (p != base) {
+		errx(1, "sbrk grew from %p, not the old break %p", p, base);
+	}
+	fill(p, npages, 1);
+	bad = check(p, npages, 1);
+	if (bad >= 0) {
+		errx(1, "heap page %d lost its contents", bad);
+	}
+
+	/* Give back all but the first page. */
+	p = sbrk(-(npages - 1) * PAGE_SIZE);
+	if (p != base + npages * PAGE_SIZE) {
+		errx(1, "shrinking sbrk returned %p", p);
+	}
+	if (sbrk(0) != base + PAGE_SIZE) {
+		errx(1, "break is not where it was moved to");
+	}
+
+	/* Grow again: the pages given back must be fresh. */
+	p = sbrk((npages - 1) * PAGE_SIZE);
+	if (p != base + PAGE_SIZE) {
+		errx(1, "regrowing sbrk returned %p", p);
+	}
+	bad = check(base, 1, 1);
+	if (bad >= 0) {
+		errx(1, "page below the break lost its contents");
+	}
+	bad = checkzero(p, npages - 1);
+	if (bad >= 0) {
+		errx(1, "heap page %d was not zeroed", bad + 1);
+	}
+
+	/* The break can't go below where the heap starts. */
+	if (sbrk(-(npages + 1) * PAGE_SIZE) != (void *)-1) {
+		errx(1, "sbrk moved the break below the heap");
+	}
+	if (errno != EINVAL) {
+		err(1, "sbrk below the heap: expected EINVAL, got");
+	}
+
+	if (sbrk(-npages * PAGE_SIZE) != base + npages * PAGE_SIZE) {
+		errx(1, "sbrk could not empty the heap");
+	}
+
+	printf("sbrktest: passed with %d pages\n", npages);
+	return 0;
+}
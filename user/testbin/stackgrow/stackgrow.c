@@ -0,0 +1,54 @@
+/*
+ * stackgrow - check that the user stack grows on demand.
+ *
+ * Usage: stackgrow [kilobytes]
+ *
+ * Recurses with a 1K frame per call until about KILOBYTES of stack
+ * are in use, filling each frame on the way down and checking it on
+ * the way back up. The kernel starts every process with a single
+ * stack page, so this only works if the stack grows as it is touched.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <err.h>
+
+#define FRAMESIZE	1024
+
+static
+int
+recurse(int depth)
+{
+	volatile char frame[FRAMESIZE];
+	int i, sum;
+
+	for (i=0; i<FRAMESIZE; i++) {
+		frame[i] = (char)(depth + i);
+	}
+	sum = depth > 0 ? recurse(depth - 1) : 0;
+	for (i=0; i<FRAMESIZE; i++) {
+		if (frame[i] != (char)(depth + i)) {
+			errx(1, "frame at depth %d was overwritten", depth);
+		}
+	}
+	return sum + 1;
+}
+
+int
+main(int argc, char *argv[])
+{
+	int kbytes = 512;
+
+	if (argc > 1) {
+		kbytes = atoi(argv[1]);
+	}
+	if (kbytes <= 0) {
+		errx(1, "Usage: stackgrow [kilobytes]");
+	}
+
+	if (recurse(kbytes) != kbytes + 1) {
+		errx(1, "wrong recursion count");
+	}
+	printf("stackgrow: passed with %dK of stack\n", kbytes);
+	return 0;
+}
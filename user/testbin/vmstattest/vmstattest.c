@@ -0,0 +1,133 @@
+/*
+ * vmstattest - check the __vmstats counters.
+ *
+ * Usage: vmstattest
+ *
+ * Takes a snapshot of the kernel's VM counters, writes to pages it
+ * has never touched, and checks that the faults and allocations show
+ * up in a second snapshot. Then forks and has the child write to a
+ * page it shares with the parent, which should cost a copy-on-write
+ * copy. Also checks the short-buffer and kernel-pointer cases. Other
+ * processes running at the same time only make the counts go up, so
+ * the checks are all lower bounds.
+ */
+
+#include <sys/types.h>
+#include <sys/vmstats.h>
+#include <sys/wait.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <errno.h>
+#include <err.h>
+
+#define PAGE_SIZE	4096
+#define NPAGES		16
+
+/*
+ * Uninitialized, so that the pages start out untouched. One extra so
+ * that NPAGES whole pages fit, not sharing one with anything else.
+ */
+static char pages[(NPAGES + 1) * PAGE_SIZE];
+
+/* Initialized, so that fork shares it with the child. */
+static char shared[PAGE_SIZE] = "vmstattest";
+
+static
+void
+snapshot(unsigned *counts)
+{
+	int n;
+
+	n = __vmstats(counts, VMSTAT_COUNT);
+	if (n < 0) {
+		err(1, "__vmstats");
+	}
+	if (n != VMSTAT_COUNT) {
+		errx(1, "__vmstats returned %d, expected %d", n, VMSTAT_COUNT);
+	}
+}
+
+/*
+ * Fail unless counter INDEX went up by at least MIN between BEFORE
+ * and AFTER.
+ */
+static
+void
+check(const unsigned *before, const unsigned *after, int index,
+      const char *name, unsigned min)
+{
+	unsigned delta;
+
+	delta = after[index] - before[index];
+	printf("%-24s +%u\n", name, delta);
+	if (delta < min) {
+		errx(1, "%s went up by %u, expected at least %u",
+		     name, delta, min);
+	}
+}
+
+int
+main(void)
+{
+	unsigned before[VMSTAT_COUNT], after[VMSTAT_COUNT];
+	unsigned one[2];
+	char *p;
+	pid_t pid;
+	int i, status;
+
+	/* Fresh pages: a fault, a zero-fill and an allocation each */
+	p = (char *)(((uintptr_t)pages + PAGE_SIZE - 1) &
+		     ~(uintptr_t)(PAGE_SIZE - 1));
+	snapshot(before);
+	for (i=0; i<NPAGES; i++) {
+		p[i * PAGE_SIZE] = 1;
+	}
+	snapshot(after);
+	check(before, after, VMSTAT_TLB_FAULT, "TLB faults", NPAGES);
+	check(before, after, VMSTAT_PAGE_FAULT_ZERO, "zero-fill faults", NPAGES);
+	check(before, after, VMSTAT_PAGE_ALLOC, "pages allocated", NPAGES);
+
+	/* Writing to a page shared since fork copies it */
+	shared[0] = 'V';
+	snapshot(before);
+	pid = fork();
+	if (pid < 0) {
+		err(1, "fork");
+	}
+	if (pid == 0) {
+		shared[0] = 'v';
+		_exit(0);
+	}
+	if (waitpid(pid, &status, 0) < 0) {
+		err(1, "waitpid");
+	}
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		errx(1, "child failed");
+	}
+	snapshot(after);
+	check(before, after, VMSTAT_COW_COPY, "copy-on-write copies", 1);
+	if (shared[0] != 'V') {
+		errx(1, "child's write showed up in the parent");
+	}
+
+	/* A short buffer gets only what fits */
+	one[1] = 0xdeadbeef;
+	if (__vmstats(one, 1) != VMSTAT_COUNT) {
+		err(1, "__vmstats (short buffer)");
+	}
+	if (one[1] != 0xdeadbeef) {
+		errx(1, "__vmstats wrote past the end of the buffer");
+	}
+
+	/* A kernel pointer is an error, not a crash */
+	if (__vmstats((unsigned *)0x80000000, VMSTAT_COUNT) >= 0) {
+		errx(1, "__vmstats with a kernel pointer succeeded");
+	}
+	if (errno != EFAULT) {
+		err(1, "__vmstats with a kernel pointer");
+	}
+
+	printf("vmstattest: passed\n");
+	return 0;
+}